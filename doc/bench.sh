@@ -0,0 +1,43 @@
+#!/bin/bash
+# bench.sh: time a handful of eg/ programs under two builds of bhuna.
+# usage: doc/bench.sh [extra-cflags-for-build-A] [extra-cflags-for-build-B]
+# Run from the top of the distribution.  The default compares the portable
+# switch() engine against the direct-threaded one.
+# ARGS_A and ARGS_B give command-line options for bhuna in each run;
+# PROGS the programs to time (from eg/) and RUNS how many times to run each.
+
+A=${1--UDIRECT_THREADING}
+B=${2-}
+PROGS=${PROGS:-"fib.bhu ack7.bhu fibspawn.bhu"}
+RUNS=${RUNS:-3}
+TIMEFORMAT='%3R'
+
+build() {
+	(cd src && make clean >/dev/null && make EXTRA_CFLAGS="$1" >/dev/null 2>&1) \
+	    || { echo "build failed: $1" >&2; exit 1; }
+}
+
+bench() {
+	total=0
+	for p in $PROGS; do
+		best=
+		for r in $(seq $RUNS); do
+			t=$( { time timeout 60 src/bhuna $1 eg/$p >/dev/null 2>&1; } 2>&1 )
+			if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then
+				best=$t
+			fi
+		done
+		printf "%-16s %8s\n" "$p" "$best"
+		total=$(awk "BEGIN { print $total + $best }")
+	done
+	printf "%-16s %8s\n" "(total)" "$total"
+}
+
+echo "== build A: EXTRA_CFLAGS='$A' ARGS='$ARGS_A'"
+build "$A"
+bench "$ARGS_A"
+if [ "$A" != "$B" ]; then
+	build "$B"
+fi
+echo "== build B: EXTRA_CFLAGS='$B' ARGS='$ARGS_B'"
+bench "$ARGS_B"
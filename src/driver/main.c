@@ -4,6 +4,7 @@
 #include <unistd.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "scan.h"
 #include "parse.h"
 #include "symbol.h"
@@ -15,15 +16,31 @@
 #include "type.h"
 #include "report.h"
 #include "gc.h"
+#include "gcstat.h"
 #include "trace.h"
 #include "process.h"
 #include "icode.h"
+#include "jit.h"
+
+#ifdef JIT
+#define JIT_OPTS "j:"
+#else
+#define JIT_OPTS ""
+#endif
+
+#ifdef THREADS
+#define GC_THREADS_OPTS "M:"
+#define THREADS_OPTS "t:"
+#else
+#define GC_THREADS_OPTS ""
+#define THREADS_OPTS ""
+#endif
 
 #ifdef DEBUG
-#define OPTS "cdgG:ilmnopsvy"
+#define OPTS "cC:dfgG:H:i" JIT_OPTS "l" GC_THREADS_OPTS "mnoP:prs" THREADS_OPTS "T:vy"
 #define RUN_PROGRAM run_program
 #else
-#define OPTS "G:i"
+#define OPTS "C:G:H:i" JIT_OPTS GC_THREADS_OPTS "P:r" THREADS_OPTS "T:"
 #define RUN_PROGRAM 1
 #endif
 
@@ -32,8 +49,11 @@ extern int optind, opterr, optopt;
 
 struct activation *global_ar;
 
-extern int gc_trigger;
-extern int gc_target;
+extern size_t gc_trigger;
+extern int gc_growth;
+extern int gc_cpu;
+extern int gc_max_pause;
+extern int gc_threads;
 
 void
 usage(char **argv)
@@ -42,18 +62,45 @@ usage(char **argv)
 	    argv[0]);
 #ifdef DEBUG
 	fprintf(stderr, "  -c: trace process context switching\n");
+#endif
+	fprintf(stderr, "  -C int: spend at most about this percent of a process's time collecting it\n");
+#ifdef DEBUG
 	fprintf(stderr, "  -d: trace pooling\n");
+	fprintf(stderr, "  -f: dump opcode pair and triple frequencies\n");
 	fprintf(stderr, "  -g: trace garbage collection\n");
 #endif
-	fprintf(stderr, "  -G int: set garbage collection threshold\n");
+	fprintf(stderr, "  -G int: collect a heap when it has grown by at least this many bytes\n");
+	fprintf(stderr, "  -H int: let a heap grow by this percent over what was live before collecting it\n");
 #ifdef DEBUG
 	fprintf(stderr, "  -i: dump intermediate format\n");
+#endif
+#ifdef JIT
+	fprintf(stderr, "  -j int: compile closures after this many calls (0 = never)\n");
+#endif
+#ifdef DEBUG
 	fprintf(stderr, "  -l: trace bytecode generation (implies -x)\n");
+#endif
+#ifdef THREADS
+	fprintf(stderr, "  -M int: collect all heaps on this many threads at once\n");
+#endif
+#ifdef DEBUG
 	fprintf(stderr, "  -m: trace virtual machine\n");
 	fprintf(stderr, "  -n: don't actually run program\n");
 	fprintf(stderr, "  -o: trace allocations\n");
+#endif
+	fprintf(stderr, "  -P int: pause to collect a process's heap at most this many microseconds at a time\n");
+#ifdef DEBUG
 	fprintf(stderr, "  -p: dump program AST before run\n");
+#endif
+	fprintf(stderr, "  -r: generate register-machine code\n");
+#ifdef DEBUG
 	fprintf(stderr, "  -s: dump symbol table before run\n");
+#endif
+#ifdef THREADS
+	fprintf(stderr, "  -t int: run processes on this many threads (default: one per cpu)\n");
+#endif
+	fprintf(stderr, "  -T file: write garbage collection telemetry here at exit and on SIGUSR1\n");
+#ifdef DEBUG
 	fprintf(stderr, "  -v: trace activation records\n");
 	fprintf(stderr, "  -y: trace type inference\n");
 #endif
@@ -68,8 +115,10 @@ main(int argc, char **argv)
 	struct symbol_table *stab;
 	struct ast *a;
 	char *source = NULL;
+	char *telemetry = NULL;
 	int opt;
 	int err_count = 0;
+	int use_registers = 0;
 #ifdef DEBUG
 	int run_program = 1;
 	int dump_symbols = 0;
@@ -90,18 +139,32 @@ main(int argc, char **argv)
 		case 'c':
 			trace_scheduling++;
 			break;
-#ifdef POOL_VALUES
+#ifdef POOLS
 		case 'd':
 			trace_pool++;
 			break;
 #endif
+		case 'f':
+			profile_vm++;
+			break;
 		case 'g':
 			trace_gc++;
 			break;
 #endif
+		case 'C':
+			gc_cpu = atoi(optarg);
+			break;
 		case 'G':
 			gc_trigger = atoi(optarg);
 			break;
+		case 'H':
+			gc_growth = atoi(optarg);
+			break;
+#ifdef JIT
+		case 'j':
+			jit_threshold = atoi(optarg);
+			break;
+#endif
 #ifdef DEBUG
 		case 'i':
 			dump_icode++;
@@ -109,6 +172,13 @@ main(int argc, char **argv)
 		case 'l':
 			trace_gen++;
 			break;
+#endif
+#ifdef THREADS
+		case 'M':
+			gc_threads = atoi(optarg);
+			break;
+#endif
+#ifdef DEBUG
 		case 'm':
 			trace_vm++;
 			break;
@@ -121,9 +191,27 @@ main(int argc, char **argv)
 		case 'p':
 			dump_program = 1;
 			break;
+#endif
+		case 'P':
+			gc_max_pause = atoi(optarg);
+			break;
+		case 'r':
+			use_registers = 1;
+			break;
+#ifdef DEBUG
 		case 's':
 			dump_symbols = 1;
 			break;
+#endif
+#ifdef THREADS
+		case 't':
+			process_workers = atoi(optarg);
+			break;
+#endif
+		case 'T':
+			telemetry = optarg;
+			break;
+#ifdef DEBUG
 		case 'v':
 			trace_activations++;
 			break;
@@ -144,11 +232,8 @@ main(int argc, char **argv)
 	else
 		usage(real_argv);
 
-#ifdef POOL_VALUES
-	value_pool_new();
-#endif
-
-	gc_target = gc_trigger;
+	global_heap.target = gc_trigger;
+	gcstat_init(telemetry);
 	if ((sc = scan_open(source)) != NULL) {
 		stab = symbol_table_new(NULL, 0);
 		global_ar = activation_new_on_heap(100, NULL, NULL);
@@ -162,41 +247,70 @@ main(int argc, char **argv)
 		if (dump_program) {
 			ast_dump(a, 0);
 		}
+#endif
+		err_count = report_finish();
+#ifdef INLINE_BUILTINS
+		/* while the symbols are still around */
+		if (err_count == 0)
+			ast_find_errors(a);
 #endif
 #ifndef DEBUG
 		symbol_table_free(stab);
-		types_free();
 #endif
-		err_count = report_finish();
 		if (err_count == 0) {
 			struct iprogram *ip;
 			struct vm *vm;
-			struct process *p;
 			unsigned char *program;
-
-			program = bhuna_malloc(16384);
+			size_t prog_size;
 
 			ip = ast_gen_iprogram(a);
+#ifndef DEBUG
+			/* code generation was the last to want these */
+			types_free();
+#endif
 			iprogram_eliminate_nops(ip);
 			iprogram_eliminate_useless_jumps(ip);
 			iprogram_optimize_tail_calls(ip);
 			iprogram_optimize_push_small_ints(ip);
 			iprogram_eliminate_dead_code(ip);
-			iprogram_gen(&program, ip);
+			prog_size = iprogram_gen_size(ip);
+			program = bhuna_malloc(prog_size);
+			if (use_registers) {
+#ifdef JIT
+				/*
+				 * Native code falls back on the vm at the
+				 * label of any icode; register code has
+				 * no such label for most of them.
+				 */
+				jit_threshold = 0;
+#endif
+				iprogram_gen_registers(&program, ip);
+			} else {
+				iprogram_fuse_superinstructions(ip);
+				iprogram_gen(&program, ip);
+			}
 #ifdef DEBUG
 			if (dump_icode > 0)
 				iprogram_dump(ip, program);
 #endif
 
-			vm = vm_new(program, 16384);
+			vm = vm_new(program, prog_size);
 			vm_set_pc(vm, program);
+			vm_reserve(vm, ast_stack_need(a));
 			vm->current_ar = global_ar;
-			p = process_new(vm);
 			/* ast_dump(a, 0); */
 			if (RUN_PROGRAM) {
+				process_new(vm);
 				process_scheduler();
+				if (telemetry != NULL)
+					gcstat_dump();
+			} else {
+				vm_free(vm);
 			}
-			vm_free(vm);
+#ifdef DEBUG
+			if (profile_vm > 0)
+				vm_profile_dump();
+#endif
 			bhuna_free(program);
 			/*value_dump_global_table();*/
 		}
@@ -219,7 +333,7 @@ main(int argc, char **argv)
 			printf("AR's alloc'ed:  %8d\n", activations_allocated);
 			printf("AR's freed:     %8d\n", activations_freed);
 		}
-#ifdef POOL_VALUES
+#ifdef POOLS
 		if (trace_pool > 0) {
 			pool_report();
 		}
@@ -4,10 +4,13 @@
 #include <string.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "activation.h"
 #include "value.h"
 #include "list.h"
 #include "closure.h"
+#include "gc.h"
+#include "thread.h"
 
 #ifdef DEBUG
 extern int trace_activations;
@@ -15,30 +18,69 @@ extern int activations_allocated;
 extern int activations_freed;
 #endif
 
-struct activation *a_head = NULL;
-int a_count = 0;
+/*
+ * Build the display of an activation record, which precedes it:
+ * the enclosing record, then that record's own display.
+ */
+static void
+activation_set_display(struct activation *a, struct activation *enclosing)
+{
+	struct activation **display = (struct activation **)a;
+
+	if (enclosing == NULL) {
+		a->depth = 0;
+		return;
+	}
+	a->depth = enclosing->depth + 1;
+	display[-1] = enclosing;
+	memcpy(display - a->depth, (struct activation **)enclosing -
+	    enclosing->depth, AR_DISPLAY_SIZE(enclosing));
+}
+
+static size_t
+display_size(struct activation *enclosing)
+{
+	if (enclosing == NULL)
+		return(0);
+	return(sizeof(struct activation *) * (enclosing->depth + 1));
+}
 
 struct activation *
 activation_new_on_heap(int size, struct activation *caller, struct activation *enclosing)
 {
 	struct activation *a;
+	struct heap *h = current_heap;
+	size_t dsize = display_size(enclosing);
 
-	a = bhuna_malloc(sizeof(struct activation) +
+	a = pool_alloc(dsize + sizeof(struct activation) +
 	    sizeof(struct value) * size);
 #ifdef BZERO
-	bzero(a, sizeof(struct activation) +
+	bzero(a, dsize + sizeof(struct activation) +
 	    sizeof(struct value) * size);
 #endif
+	a = (struct activation *)((unsigned char *)a + dsize);
 	a->size = size;
 	a->admin = 0;
 	a->caller = caller;
-	a->enclosing = enclosing;
+	activation_set_display(a, enclosing);
+	/*
+	 * Locals not yet assigned must look like something to the
+	 * collector, which may see this record before they are.
+	 */
+	memset(&VALARY(a, 0), 0, sizeof(struct value) * size);
 
 	/*
-	 * Link up to our GC list.
+	 * Link up to the current heap (see gc.c.)
 	 */
-	a->next = a_head;
-	a_head = a;
+	if (h == &global_heap) {
+		a->admin = AR_ADMIN_SHARED;
+		LOCK(&heap_lock);
+	}
+	a->next = h->a_head;
+	h->a_head = a;
+	h->bytes += AR_SIZE(a);
+	if (h == &global_heap)
+		UNLOCK(&heap_lock);
 
 #ifdef DEBUG
 	if (trace_activations > 1) {
@@ -49,7 +91,6 @@ activation_new_on_heap(int size, struct activation *caller, struct activation *e
 	activations_allocated++;
 #endif
 
-	a_count++;
 	return(a);
 }
 
@@ -58,19 +99,27 @@ activation_new_on_stack(int size, struct activation *caller,
 			struct activation *enclosing, struct vm *vm)
 {
 	struct activation *a;
+#ifndef NO_AR_STACK
+	size_t n;
+	int i;
+#endif
 
 #ifdef NO_AR_STACK
 	a = activation_new_on_heap(size, caller, enclosing);
 #else
-	a = (struct activation *)vm->astack_ptr;
-	vm->astack_ptr += sizeof(struct activation) + sizeof(struct value) * size;
-	if (vm->astack_ptr > vm->astack_hi)
-		vm->astack_hi = vm->astack_ptr;
+	n = display_size(enclosing) +
+	    sizeof(struct activation) + sizeof(struct value) * size;
+	if (vm->astack_ptr + n > vm->astack_end)
+		vm_astack_grow(vm, n);
+	a = (struct activation *)(vm->astack_ptr + display_size(enclosing));
+	vm->astack_ptr += n;
 
 	a->size = size;
 	a->admin = AR_ADMIN_ON_STACK;
 	a->caller = caller;
-	a->enclosing = enclosing;
+	activation_set_display(a, enclosing);
+	for (i = 0; i < size; i++)
+		V_SET_NULL(VALARY(a, i));
 
 #ifdef DEBUG
 	if (trace_activations > 1) {
@@ -96,14 +145,23 @@ activation_free_from_heap(struct activation *a)
 	activations_freed++;
 #endif
 
-	bhuna_free(a);
-	a_count--;
+	pool_free((unsigned char *)a - AR_DISPLAY_SIZE(a), AR_SIZE(a));
 }
 
+/*
+ * Nothing but its vm can see a record on the stack, so when it is
+ * freed, what is in its locals is uncounted (see V_REF.)
+ */
 void
 activation_free_from_stack(struct activation *a, struct vm *vm)
 {
 #ifndef NO_AR_STACK
+	int i;
+
+	if (!(a->admin & AR_ADMIN_UNCOUNTED)) {
+		for (i = 0; i < a->size; i++)
+			V_UNREF(VALARY(a, i));
+	}
 #ifdef DEBUG
 	if (trace_activations > 1) {
 		printf("[ARC] freeing from STACK ");
@@ -113,8 +171,10 @@ activation_free_from_stack(struct activation *a, struct vm *vm)
 	activations_freed++;
 #endif
 
-	vm->astack_ptr -= (sizeof(struct activation) +
+	vm->astack_ptr -= (AR_DISPLAY_SIZE(a) + sizeof(struct activation) +
 			   sizeof(struct value) * a->size);
+	if (vm->astack_ptr == vm->astack_big)
+		vm_astack_shrink(vm);
 #endif
 }
 
@@ -122,10 +182,8 @@ struct value
 activation_get_value(struct activation *a, int index, int upcount)
 {
 	assert(a != NULL);
-	for (; upcount > 0; upcount--) {
-		a = a->enclosing;
-		assert(a != NULL);
-	}
+	assert(upcount <= a->depth);
+	a = AR_LEVEL(a, upcount);
 #ifdef DEBUG
 	assert(index < a->size);
 #endif
@@ -137,10 +195,8 @@ activation_set_value(struct activation *a, int index, int upcount,
 		     struct value v)
 {
 	assert(a != NULL);
-	for (; upcount > 0; upcount--) {
-		a = a->enclosing;
-		assert(a != NULL);
-	}
+	assert(upcount <= a->depth);
+	a = AR_LEVEL(a, upcount);
 
 #ifdef DEBUG
 /*
@@ -150,11 +206,7 @@ activation_set_value(struct activation *a, int index, int upcount,
 */
 	assert(index < a->size);
 #endif
-	/*
-	v->refcount++;
-	VALARY(a, index)->refcount--;
-	*/
-	VALARY(a, index) = v;
+	AR_STORE(a, index, v);
 }
 
 void
@@ -163,7 +215,7 @@ activation_initialize_value(struct activation *a, int index,
 {
 	assert(a != NULL);
 	assert(index < a->size);
-	VALARY(a, index) = v;
+	AR_STORE(a, index, v);
 }
 
 void
@@ -182,7 +234,7 @@ activation_dump(struct activation *a, int detail)
 	if (detail > 0) {
 		for (i = 0; i < a->size; i++) {
 			printf(" ");
-			if (VALARY(a, i).type == VALUE_CLOSURE) {
+			if (V_TYPE(VALARY(a, i)) == VALUE_CLOSURE) {
 				printf("(closure) ");
 			} else {
 				value_print(VALARY(a, i));
@@ -190,9 +242,9 @@ activation_dump(struct activation *a, int detail)
 		}
 	}
 	
-	if (a->enclosing != NULL) {
+	if (AR_ENCLOSING(a) != NULL) {
 		printf(" --> {");
-		activation_dump(a->enclosing, 0);
+		activation_dump(AR_ENCLOSING(a), 0);
 		printf("}");
 	}
 	if (a->caller != NULL) {
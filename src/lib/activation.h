@@ -3,20 +3,26 @@
 struct vm;
 
 #define	AR_ADMIN_MARKED		1
+#define	AR_ADMIN_SHARED		2	/* other processes may see it */
 #define	AR_ADMIN_ON_STACK	4
+#define	AR_ADMIN_OLD		8	/* survived a collection, unwritten since */
+#define	AR_ADMIN_UNCOUNTED	16	/* a builtin's arguments (see AR_STORE) */
 
 /*
  * Structure of an activation record.
  * This is actually only the header;
  * the frame itself (containing local variables)
  * follows immediately in memory.
+ * It is preceded in memory by its display: pointers to the depth
+ * activation records lexically enclosing it, nearest last, so
+ * that a variable any number of levels out is one step away.
  */
 struct activation {
-	struct activation	*next;		/* global list of all act recs */
+	struct activation	*next;		/* in its heap (see gc.c) */
 	unsigned short int	 admin;
 	unsigned short int	 size;
+	unsigned short int	 depth;		/* number of enclosing act recs */
 	struct activation	*caller;	/* recursively shallower activation record */
-	struct activation	*enclosing;	/* lexically enclosing activation record */
 	/*
 	struct value		  value[];
 	*/
@@ -25,6 +31,47 @@ struct activation {
 #define VALARY(a,i)	\
 	((struct value *)((unsigned char *)a + sizeof(struct activation)))[i]
 
+/*
+ * Store v as local i of a.  A shared record may only refer to what is
+ * shared, an old one which is written to must be remembered, and what
+ * is put in a marked one must be marked (see gc.c), so a structured
+ * value put in any of them goes past the barrier.  What is put in a
+ * local is counted, and what was in it uncounted (see V_REF), except in
+ * a shared record, where another process may have overwritten the same
+ * value at the same time, and it would be uncounted twice.  A builtin
+ * never copies its arguments on write, so the record it gets them in
+ * isn't counted at all.
+ */
+#define	AR_BARRIERED	(AR_ADMIN_SHARED | AR_ADMIN_OLD | AR_ADMIN_MARKED)
+
+#define AR_STORE(a,i,v)	do {						\
+	if (V_IS_STRUCTURED(v)) {					\
+		if ((a)->admin & AR_BARRIERED)				\
+			activation_barrier(a, v);			\
+		if (!((a)->admin & AR_ADMIN_UNCOUNTED))			\
+			V_REF(v);					\
+	}								\
+	if (!((a)->admin & (AR_ADMIN_SHARED | AR_ADMIN_UNCOUNTED)))	\
+		V_UNREF(VALARY(a, i));					\
+	VALARY(a, i) = (v);						\
+} while (0)
+
+/*
+ * The activation record upcount levels out from a (a itself if 0.)
+ */
+#define AR_LEVEL(a,upcount)	\
+	((upcount) == 0 ? (a) : ((struct activation **)(a))[-(upcount)])
+
+#define AR_DISPLAY_SIZE(a)	(sizeof(struct activation *) * (a)->depth)
+#define AR_SIZE(a)		(AR_DISPLAY_SIZE(a) +			\
+				 sizeof(struct activation) +		\
+				 sizeof(struct value) * (a)->size)
+
+/*
+ * The lexically enclosing activation record, or NULL.
+ */
+#define AR_ENCLOSING(a)		((a)->depth == 0 ? NULL : AR_LEVEL(a, 1))
+
 struct activation	*activation_new_on_heap(int, struct activation *, struct activation *);
 struct activation	*activation_new_on_stack(int, struct activation *, struct activation *, struct vm *);
 void			 activation_free_from_heap(struct activation *);
@@ -34,4 +81,6 @@ struct value		 activation_get_value(struct activation *, int, int);
 void			 activation_set_value(struct activation *, int, int, struct value);
 void			 activation_initialize_value(struct activation *, int, struct value);
 
+void			 activation_barrier(struct activation *, struct value);
+
 void			 activation_dump(struct activation *, int);
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,6 +7,7 @@
 #include "list.h"
 #include "value.h"
 #include "builtin.h"
+#include "closure.h"
 #include "activation.h"
 #include "vm.h"
 #include "type.h"
@@ -29,6 +31,7 @@ ast_new(int type)
 	a->sc = NULL;
 	a->label = NULL;
 	a->datatype = NULL;
+	a->may_err = 1;
 
 	return(a);
 }
@@ -141,6 +144,7 @@ ast_new_builtin(struct scan_st *sc, struct builtin *bi, struct ast *right)
 					     g->u.arg.left->u.value.value);
 			}
 			v = bi->fn(ar);
+			value_deregister(v);	/* it is part of the program now */
 		} else {
 			a = NULL;
 		}
@@ -232,6 +236,9 @@ ast_new_routine(struct ast *body)
 
 	a = ast_new(AST_ROUTINE);
 	a->u.routine.body = body;
+	a->u.routine.escapes = 0;
+	a->u.routine.ret_err = 0;
+	a->u.routine.arg_errs = 0;
 	
 	if (a->u.routine.body != NULL)
 		a->datatype = a->u.routine.body->datatype;
@@ -500,6 +507,395 @@ ast_count_args(struct ast *a)
 	return(ac);
 }
 
+static int
+max(int a, int b)
+{
+	return(a > b ? a : b);
+}
+
+/*
+ * Return the most values the vm stack can have on it at once while
+ * the code for this tree runs, not counting the bodies of closures,
+ * which are run by calls of their own.  Statements leave the stack
+ * as they found it; each argument and other expression leaves one value.
+ */
+int
+ast_stack_need(struct ast *a)
+{
+	int n;
+
+	if (a == NULL)
+		return(0);
+	switch (a->type) {
+	case AST_LOCAL:
+	case AST_VALUE:
+		return(1);
+	case AST_BUILTIN:
+		n = ast_count_args(a->u.builtin.right);
+		if (a->u.builtin.bi->arity == -1)
+			n++;
+		return(max(ast_stack_need(a->u.builtin.right),
+		    max(n, a->u.builtin.bi->retval)));
+	case AST_APPLY:
+		n = ast_count_args(a->u.apply.right);
+		return(max(ast_stack_need(a->u.apply.right),
+		    max(n + ast_stack_need(a->u.apply.left), 1)));
+	case AST_ARG:
+		return(max(ast_stack_need(a->u.arg.left),
+		    1 + ast_stack_need(a->u.arg.right)));
+	case AST_ROUTINE:
+		return(ast_stack_need(a->u.routine.body));
+	case AST_STATEMENT:
+		return(max(ast_stack_need(a->u.statement.left),
+		    ast_stack_need(a->u.statement.right)));
+	case AST_ASSIGNMENT:
+		return(ast_stack_need(a->u.assignment.right));
+	case AST_CONDITIONAL:
+		n = max(ast_stack_need(a->u.conditional.yes),
+		    ast_stack_need(a->u.conditional.no));
+		return(max(ast_stack_need(a->u.conditional.test), n));
+	case AST_WHILE_LOOP:
+		return(max(ast_stack_need(a->u.while_loop.test),
+		    ast_stack_need(a->u.while_loop.body)));
+	case AST_RETR:
+		return(ast_stack_need(a->u.retr.body));
+	}
+	return(0);
+}
+
+#ifdef INLINE_BUILTINS
+/*
+ * Finding which expressions may evaluate to an error value.
+ *
+ * An error has the static type of what it stands in for, so the
+ * unchecked integer instructions may only be used where neither operand
+ * can be one (see ast_unchecked_opcode() in icode.c.)  Errors come from
+ * builtins (a division by zero, an out-of-bounds Fetch, a message,
+ * anything given an error), and flow through variables, arguments and
+ * return values.  This follows that flow over the whole program,
+ * without regard to the order things happen in: a variable may hold an
+ * error if anything which may be one is assigned to it anywhere, and an
+ * argument may be one if any call of the closure may pass one, or if
+ * the closure may be called from somewhere not seen here (it is passed
+ * to a builtin, stored, or assigned to a variable which is.)  It starts
+ * by supposing nothing is an error and marks what may be until nothing
+ * more is marked, so what is left unmarked never is.
+ *
+ * A closure's body is looked at where its literal is, with the
+ * closures around it in a chain of err_frames, so that a local found
+ * upcount frames out, among the first arity locals there, is known to
+ * be that closure's argument.  A local which is neither an argument nor
+ * assigned anywhere may be anything.  Of the builtins, only Add, Sub
+ * and Mul of integers which are not errors are known not to give one,
+ * and a closure which may run off its end without returning may give
+ * anything.
+ */
+
+struct err_frame {
+	struct err_frame	*up;
+	struct closure		*k;		/* NULL for the program */
+};
+
+static int err_changed;
+
+#define	ERR_MARK(lvalue, bits) do {					\
+	if (((lvalue) | (bits)) != (lvalue)) {				\
+		(lvalue) |= (bits);					\
+		err_changed = 1;					\
+	}								\
+} while (0)
+
+static struct closure *
+ast_closure(struct ast *a)
+{
+	if (a != NULL && a->type == AST_VALUE &&
+	    V_TYPE(a->u.value.value) == VALUE_CLOSURE)
+		return(V_SV(a->u.value.value)->v.k);
+	return(NULL);
+}
+
+/*
+ * The closure whose argument local a is, if it is one.
+ */
+static struct closure *
+err_argument_of(struct ast *a, struct err_frame *f)
+{
+	int i;
+
+	for (i = 0; f != NULL && i < a->u.local.upcount; i++)
+		f = f->up;
+	if (f == NULL || f->k == NULL || a->u.local.index >= f->k->arity)
+		return(NULL);
+	return(f->k);
+}
+
+/*
+ * Whether control can reach the end of a routine body without
+ * returning (and so return nothing in particular.)
+ */
+static int
+ast_falls_through(struct ast *a)
+{
+	if (a == NULL)
+		return(1);
+	switch (a->type) {
+	case AST_RETR:
+		return(0);
+	case AST_STATEMENT:
+		return(ast_falls_through(a->u.statement.left) &&
+		    ast_falls_through(a->u.statement.right));
+	case AST_CONDITIONAL:
+		return(a->u.conditional.no == NULL ||
+		    ast_falls_through(a->u.conditional.yes) ||
+		    ast_falls_through(a->u.conditional.no));
+	}
+	return(1);
+}
+
+static void err_shape(struct ast *, struct err_frame *);
+
+static void
+err_shape_closure(struct closure *k, struct err_frame *f)
+{
+	struct err_frame inner;
+
+	inner.up = f;
+	inner.k = k;
+	if (ast_falls_through(k->ast->u.routine.body))
+		k->ast->u.routine.ret_err = 1;
+	err_shape(k->ast->u.routine.body, &inner);
+}
+
+/*
+ * First, which closure each variable may hold, and which closures and
+ * variables escape.  An argument assigned a closure may still hold
+ * the one it was passed, so is UNKNOWN.
+ */
+static void
+err_shape(struct ast *a, struct err_frame *f)
+{
+	struct closure *k;
+	struct symbol *sym;
+
+	if (a == NULL)
+		return;
+	a->may_err = 0;
+	switch (a->type) {
+	case AST_LOCAL:
+		a->u.local.sym->flow |= SYM_FLOW_ESCAPES;
+		break;
+	case AST_VALUE:
+		if ((k = ast_closure(a)) != NULL) {
+			k->ast->u.routine.escapes = 1;
+			err_shape_closure(k, f);
+		}
+		break;
+	case AST_BUILTIN:
+		err_shape(a->u.builtin.right, f);
+		break;
+	case AST_APPLY:
+		if ((k = ast_closure(a->u.apply.left)) != NULL)
+			err_shape_closure(k, f);
+		else if (a->u.apply.left == NULL ||
+		    a->u.apply.left->type != AST_LOCAL)
+			err_shape(a->u.apply.left, f);
+		err_shape(a->u.apply.right, f);
+		break;
+	case AST_ARG:
+		err_shape(a->u.arg.left, f);
+		err_shape(a->u.arg.right, f);
+		break;
+	case AST_STATEMENT:
+		err_shape(a->u.statement.left, f);
+		err_shape(a->u.statement.right, f);
+		break;
+	case AST_ASSIGNMENT:
+		sym = a->u.assignment.left->u.local.sym;
+		sym->flow |= SYM_FLOW_ASSIGNED;
+		if ((k = ast_closure(a->u.assignment.right)) == NULL ||
+		    err_argument_of(a->u.assignment.left, f) != NULL ||
+		    (sym->routine != NULL && sym->routine != k)) {
+			sym->flow |= SYM_FLOW_UNKNOWN;
+			err_shape(a->u.assignment.right, f);
+		} else {
+			sym->routine = k;
+			err_shape_closure(k, f);
+		}
+		break;
+	case AST_CONDITIONAL:
+		err_shape(a->u.conditional.test, f);
+		err_shape(a->u.conditional.yes, f);
+		err_shape(a->u.conditional.no, f);
+		break;
+	case AST_WHILE_LOOP:
+		err_shape(a->u.while_loop.test, f);
+		err_shape(a->u.while_loop.body, f);
+		break;
+	case AST_RETR:
+		err_shape(a->u.retr.body, f);
+		break;
+	}
+}
+
+static int err_flow(struct ast *, struct err_frame *);
+
+/*
+ * Mark the errors the arguments of a call to k may pass it.
+ */
+static void
+err_call(struct closure *k, struct ast *args, struct err_frame *f)
+{
+	unsigned long errs = 0;
+	int n;
+
+	for (n = 0; args != NULL && args->type == AST_ARG;
+	     args = args->u.arg.right, n++) {
+		if (err_flow(args->u.arg.left, f) &&
+		    n < (int)(sizeof(errs) * CHAR_BIT))
+			errs |= 1UL << n;
+	}
+	if (n != k->arity)
+		errs = ~0UL;
+	ERR_MARK(k->ast->u.routine.arg_errs, errs);
+}
+
+static void
+err_flow_closure(struct closure *k, struct err_frame *f)
+{
+	struct err_frame inner;
+
+	inner.up = f;
+	inner.k = k;
+	err_flow(k->ast->u.routine.body, &inner);
+}
+
+/*
+ * Then, over and over, which expressions may be errors; returns
+ * whether a may be, having marked it if so.
+ */
+static int
+err_flow(struct ast *a, struct err_frame *f)
+{
+	struct closure *k;
+	struct symbol *sym;
+	struct ast *args;
+	int err = 1, l, r, index;
+
+	if (a == NULL)
+		return(0);
+	switch (a->type) {
+	case AST_LOCAL:
+		sym = a->u.local.sym;
+		if ((k = err_argument_of(a, f)) != NULL) {
+			index = a->u.local.index;
+			err = k->ast->u.routine.escapes ||
+			    index >= (int)(sizeof(unsigned long) * CHAR_BIT) ||
+			    (k->ast->u.routine.arg_errs >> index) & 1;
+		} else {
+			err = !(sym->flow & SYM_FLOW_ASSIGNED);
+		}
+		err = err || (sym->flow & SYM_FLOW_MAY_ERR);
+		break;
+	case AST_VALUE:
+		if ((k = ast_closure(a)) != NULL) {
+			err_flow_closure(k, f);
+			err = 0;
+		} else {
+			err = V_TYPE(a->u.value.value) == VALUE_ERROR;
+		}
+		break;
+	case AST_BUILTIN:
+		args = a->u.builtin.right;
+		l = r = 1;
+		for (index = 0; args != NULL && args->type == AST_ARG;
+		     args = args->u.arg.right, index++) {
+			if (err_flow(args->u.arg.left, f) == 0 &&
+			    args->u.arg.left->datatype != NULL &&
+			    type_representative(args->u.arg.left->datatype)->tclass
+			    == TYPE_INTEGER) {
+				if (index == 0)
+					l = 0;
+				else if (index == 1)
+					r = 0;
+			}
+		}
+		index = a->u.builtin.bi->index;
+		err = l || r || (index != INDEX_BUILTIN_ADD &&
+		    index != INDEX_BUILTIN_SUB && index != INDEX_BUILTIN_MUL);
+		break;
+	case AST_APPLY:
+		k = NULL;
+		if (a->u.apply.left != NULL &&
+		    a->u.apply.left->type == AST_LOCAL) {
+			sym = a->u.apply.left->u.local.sym;
+			if (!(sym->flow & SYM_FLOW_UNKNOWN))
+				k = sym->routine;
+		} else if ((k = ast_closure(a->u.apply.left)) != NULL) {
+			err_flow_closure(k, f);
+		} else {
+			err_flow(a->u.apply.left, f);
+		}
+		if (k != NULL) {
+			err_call(k, a->u.apply.right, f);
+			err = k->ast->u.routine.ret_err;
+		} else {
+			err_flow(a->u.apply.right, f);
+		}
+		break;
+	case AST_ARG:
+		err_flow(a->u.arg.left, f);
+		err_flow(a->u.arg.right, f);
+		break;
+	case AST_STATEMENT:
+		err_flow(a->u.statement.left, f);
+		err_flow(a->u.statement.right, f);
+		break;
+	case AST_ASSIGNMENT:
+		sym = a->u.assignment.left->u.local.sym;
+		if (err_flow(a->u.assignment.right, f))
+			ERR_MARK(sym->flow, SYM_FLOW_MAY_ERR);
+		if ((k = ast_closure(a->u.assignment.right)) != NULL &&
+		    sym->flow & (SYM_FLOW_UNKNOWN | SYM_FLOW_ESCAPES))
+			ERR_MARK(k->ast->u.routine.escapes, 1);
+		break;
+	case AST_CONDITIONAL:
+		err_flow(a->u.conditional.test, f);
+		err_flow(a->u.conditional.yes, f);
+		err_flow(a->u.conditional.no, f);
+		break;
+	case AST_WHILE_LOOP:
+		err_flow(a->u.while_loop.test, f);
+		err_flow(a->u.while_loop.body, f);
+		break;
+	case AST_RETR:
+		if (err_flow(a->u.retr.body, f) && f != NULL && f->k != NULL)
+			ERR_MARK(f->k->ast->u.routine.ret_err, 1);
+		break;
+	}
+	if (err)
+		ERR_MARK(a->may_err, 1);
+	return(err);
+}
+
+/*
+ * Mark each expression in the program which may evaluate to an error
+ * (its may_err.)  The symbols it refers to must still be around.
+ */
+void
+ast_find_errors(struct ast *a)
+{
+	struct err_frame top;
+
+	top.up = NULL;
+	top.k = NULL;
+	err_shape(a, &top);
+	do {
+		err_changed = 0;
+		err_flow(a, &top);
+	} while (err_changed);
+}
+#endif /* INLINE_BUILTINS */
+
 /*
  * This is a rather specialized function to find the l-value of a store builtin.
  */
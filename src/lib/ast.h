@@ -38,6 +38,9 @@ struct ast_arg {
 
 struct ast_routine {
 	struct ast		*body;
+	int			 escapes;	/* may be called from anywhere */
+	int			 ret_err;	/* may return an error */
+	unsigned long		 arg_errs;	/* bit n: argument n may be one */
 };
 
 struct ast_statement {
@@ -98,6 +101,7 @@ struct ast {
 	struct scan_st			*sc;
 	struct type			*datatype;
 	vm_label_t			 label;
+	int				 may_err;	/* see ast_find_errors() */
 	union ast_union			 u;
 };
 
@@ -117,6 +121,8 @@ void			 ast_free(struct ast *);
 struct ast		*ast_find_local(struct ast *);
 int			 ast_is_constant(struct ast *);
 int			 ast_count_args(struct ast *);
+int			 ast_stack_need(struct ast *);
+void			 ast_find_errors(struct ast *);
 
 void			 ast_dump(struct ast *, int);
 char			*ast_name(struct ast *);
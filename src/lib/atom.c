@@ -27,3 +27,18 @@ atom_resolve(wchar_t *lexeme)
 
 	return(ae->atom);
 }
+
+/*
+ * The lexeme of an atom, or NULL if there is no such atom.
+ */
+wchar_t *
+atom_name(int atom)
+{
+	struct atom_entry *ae;
+
+	for (ae = atom_entry_head; ae != NULL; ae = ae->next) {
+		if (ae->atom == atom)
+			return(ae->lexeme);
+	}
+	return(NULL);
+}
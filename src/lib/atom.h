@@ -15,5 +15,6 @@ struct atom_entry {
 };
 
 int atom_resolve(wchar_t *);
+wchar_t *atom_name(int);
 
 #endif /* !__ATOM_H_ */
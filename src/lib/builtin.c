@@ -13,10 +13,12 @@
 #include "type.h"
 #include "symbol.h"
 #include "utf8.h"
+#include "atom.h"
 
 #include "ast.h"
 #include "vm.h"
 #include "process.h"
+#include "gc.h"
 
 /*
  * Built-in operations.
@@ -46,6 +48,9 @@ struct builtin builtins[] = {
 	{L"Send",	builtin_send,	btype_send,		 2, 0, 0, 1, 20},
 	{L"Recv",	builtin_recv,	btype_recv,		 1, 1, 0, 1, 21},
 	{L"Self",	builtin_self,	btype_self,		 0, 1, 0, 1, 22},
+	{L"Sleep",	builtin_sleep,	btype_sleep,		 1, 0, 0, 1, 23},
+	{L"Pick",	builtin_pick,	btype_pick,		 2, 1, 0, 1, 24},
+	{L"Freeze",	builtin_freeze,	btype_freeze,		 1, 1, 0, 1, 25},
 	{NULL,		NULL,		NULL,			 0, 0, 0, 0, 0}
 };
 
@@ -58,15 +63,19 @@ builtin_print(struct activation *ar)
 	for (i = 0; i < ar->size; i++) {
 		v = activation_get_value(ar, i, 0);
 
-		switch (v.type) {
+		switch (V_TYPE(v)) {
 		case VALUE_INTEGER:
-			printf("%d", v.v.i);
+			printf("%d", V_INT(v));
 			break;
 		case VALUE_BOOLEAN:
-			printf("%s", v.v.b ? "true" : "false");
+			printf("%s", V_BOOL(v) ? "true" : "false");
+			break;
+		case VALUE_ATOM:
+			if (atom_name(V_ATOM(v)) != NULL)
+				fputsu8(stdout, atom_name(V_ATOM(v)));
 			break;
 		case VALUE_STRING:
-			fputsu8(stdout, v.v.s->v.s);
+			fputsu8(stdout, V_SV(v)->v.s);
 			break;
 		case VALUE_LIST:
 			/*
@@ -74,25 +83,25 @@ builtin_print(struct activation *ar)
 			for (l = v->v.l; l != NULL; l = l->next) {
 			*/
 				
-			list_dump(v.v.s->v.l);
+			list_dump(V_SV(v)->v.l);
 			break;
 		case VALUE_ERROR:
-			printf("#ERR<%s>", v.v.s->v.e);
+			printf("#ERR<%s>", V_SV(v)->v.e);
 			break;
 		case VALUE_BUILTIN:
-			printf("#BIF<%08lx>", (unsigned long)v.v.bi);
+			printf("#BIF<%08lx>", (unsigned long)V_BI(v));
 			break;
 		case VALUE_CLOSURE:
-			closure_dump(v.v.s->v.k);
+			closure_dump(V_SV(v)->v.k);
 			break;
 		case VALUE_DICT:
-			dict_dump(v.v.s->v.d);
+			dict_dump(V_SV(v)->v.d);
 			break;
 		case VALUE_OPAQUE:
-			printf("#OPAQUE<%08lx>", (unsigned long)v.v.ptr);
+			printf("#OPAQUE<%08lx>", (unsigned long)V_PTR(v));
 			break;
 		default:
-			printf("???unknown(%d)???", v.type);
+			printf("???unknown(%d)???", V_TYPE(v));
 			break;
 		}
 	}
@@ -106,8 +115,8 @@ builtin_not(struct activation *ar)
 {
 	struct value q = activation_get_value(ar, 0, 0);
 
-	if (q.type == VALUE_BOOLEAN) {
-		return(value_new_boolean(!q.v.b));
+	if (V_TYPE(q) == VALUE_BOOLEAN) {
+		return(value_new_boolean(!V_BOOL(q)));
 	} else {
 		return(value_new_error("type mismatch"));
 	}
@@ -119,8 +128,8 @@ builtin_and(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_BOOLEAN && r.type == VALUE_BOOLEAN) {
-		return(value_new_boolean(l.v.b && r.v.b));
+	if (V_TYPE(l) == VALUE_BOOLEAN && V_TYPE(r) == VALUE_BOOLEAN) {
+		return(value_new_boolean(V_BOOL(l) && V_BOOL(r)));
 	} else {
 		return(value_new_error("type mismatch"));
 	}
@@ -132,8 +141,8 @@ builtin_or(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_BOOLEAN && r.type == VALUE_BOOLEAN) {
-		return(value_new_boolean(l.v.b || r.v.b));
+	if (V_TYPE(l) == VALUE_BOOLEAN && V_TYPE(r) == VALUE_BOOLEAN) {
+		return(value_new_boolean(V_BOOL(l) || V_BOOL(r)));
 	} else {
 		return(value_new_error("type mismatch"));
 	}
@@ -147,10 +156,13 @@ builtin_equ(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i == r.v.i);
-	} else if (l.type == VALUE_OPAQUE && r.type == VALUE_OPAQUE) {
-		return value_new_boolean(l.v.ptr == r.v.ptr);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) == V_INT(r));
+	} else if (V_TYPE(l) == VALUE_OPAQUE && V_TYPE(r) == VALUE_OPAQUE) {
+		return value_new_boolean(V_PTR(l) == V_PTR(r));
+	} else if (V_TYPE(l) == VALUE_ATOM || V_TYPE(r) == VALUE_ATOM) {
+		return value_new_boolean(V_TYPE(l) == V_TYPE(r) &&
+		    V_ATOM(l) == V_ATOM(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -162,8 +174,11 @@ builtin_neq(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i != r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) != V_INT(r));
+	} else if (V_TYPE(l) == VALUE_ATOM || V_TYPE(r) == VALUE_ATOM) {
+		return value_new_boolean(V_TYPE(l) != V_TYPE(r) ||
+		    V_ATOM(l) != V_ATOM(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -175,8 +190,8 @@ builtin_gt(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i > r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) > V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -188,8 +203,8 @@ builtin_lt(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i < r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) < V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -201,8 +216,8 @@ builtin_gte(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i >= r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) >= V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -214,8 +229,8 @@ builtin_lte(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_boolean(l.v.i <= r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_boolean(V_INT(l) <= V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -229,8 +244,8 @@ builtin_add(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_integer(l.v.i + r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_integer(V_INT(l) + V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -250,8 +265,8 @@ builtin_mul(struct activation *ar)
 	printf("\n");
 #endif
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_integer(l.v.i * r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_integer(V_INT(l) * V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -263,8 +278,8 @@ builtin_sub(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		return value_new_integer(l.v.i - r.v.i);
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		return value_new_integer(V_INT(l) - V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -276,11 +291,11 @@ builtin_div(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		if (r.v.i == 0)
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		if (V_INT(r) == 0)
 			return value_new_error("division by zero");
 		else
-			return value_new_integer(l.v.i / r.v.i);
+			return value_new_integer(V_INT(l) / V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -292,11 +307,11 @@ builtin_mod(struct activation *ar)
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
 
-	if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-		if (r.v.i == 0)
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+		if (V_INT(r) == 0)
 			return value_new_error("modulo by zero");
 		else
-			return value_new_integer(l.v.i % r.v.i);
+			return value_new_integer(V_INT(l) % V_INT(r));
 	} else {
 		return value_new_error("type mismatch");
 	}
@@ -307,17 +322,7 @@ builtin_mod(struct activation *ar)
 struct value
 builtin_list(struct activation *ar)
 {
-	int i;
-	struct value v, x;
-
-	v = value_new_list();
-
-	for (i = ar->size - 1; i >= 0; i--) {
-		x = activation_get_value(ar, i, 0);
-		value_list_append(v, x);
-	}
-
-	return(v);
+	return(value_new_list_of(&VALARY(ar, 0), ar->size));
 }
 
 struct value
@@ -325,29 +330,26 @@ builtin_fetch(struct activation *ar)
 {
 	struct value l = activation_get_value(ar, 0, 0);
 	struct value r = activation_get_value(ar, 1, 0);
-	int count;
 	struct list *li;
 
-	if (l.type == VALUE_CLOSURE && r.type == VALUE_INTEGER) {
-		int i = r.v.i - 1;
+	if (V_TYPE(l) == VALUE_CLOSURE && V_TYPE(r) == VALUE_INTEGER) {
+		int i = V_INT(r) - 1;
 		/*
 		 * This is _EVIL_!
 		 */
-		if (i >= 0 && i < l.v.s->v.k->ar->size) {
-			return(activation_get_value(l.v.s->v.k->ar, i, 0));
+		if (i >= 0 && i < V_SV(l)->v.k->ar->size) {
+			return(activation_get_value(V_SV(l)->v.k->ar, i, 0));
 		} else {
 			return(value_new_error("out of bounds"));
 		}
-	} else if (l.type == VALUE_DICT) {
-		return(dict_fetch(l.v.s->v.d, r));
-	} else if (l.type == VALUE_LIST && r.type == VALUE_INTEGER) {
-		li = l.v.s->v.l;
-		for (count = 1; li != NULL && count < r.v.i; count++)
-			li = li->next;
-		if (li == NULL)
+	} else if (V_TYPE(l) == VALUE_DICT) {
+		return(dict_fetch(V_SV(l)->v.d, r));
+	} else if (V_TYPE(l) == VALUE_LIST && V_TYPE(r) == VALUE_INTEGER) {
+		li = V_SV(l)->v.l;
+		if (V_INT(r) < 1 || (size_t)V_INT(r) > LIST_LENGTH(li))
 			return value_new_error("out of bounds");
 		else {
-			return li->value;
+			return li->value[V_INT(r) - 1];
 		}
 	} else {
 		return value_new_error("type mismatch");
@@ -360,20 +362,38 @@ builtin_store(struct activation *ar)
 	struct value d = activation_get_value(ar, 0, 0);
 	struct value i = activation_get_value(ar, 1, 0);
 	struct value p = activation_get_value(ar, 2, 0);
-	int count;
+	struct value old;
 	struct list *li;
 
-	if (d.type == VALUE_DICT) {
-		dict_store(d.v.s->v.d, i, p);
+	if (V_IS_STRUCTURED(d) && (V_SV(d)->admin & ADMIN_FROZEN)) {
+		return(value_new_error("frozen"));
+	}
+	if (V_IS_STRUCTURED(d) &&
+	    (V_SV(d)->admin & (ADMIN_SHARED | ADMIN_OLD | ADMIN_MARKED))) {
+		/* see gc.c */
+		value_barrier(V_SV(d), i);
+		value_barrier(V_SV(d), p);
+	}
+	if (V_TYPE(d) == VALUE_DICT) {
+		old = dict_store(V_SV(d)->v.d, i, p);
+		if (!(V_SV(d)->admin & ADMIN_SHARED))
+			V_UNREF(old);
 		return(d);
-	} else if (d.type == VALUE_LIST && i.type == VALUE_INTEGER) {
-		li = d.v.s->v.l;
-		for (count = 1; li != NULL && count < i.v.i; count++)
-			li = li->next;
-		if (li == NULL)
+	} else if (V_TYPE(d) == VALUE_LIST && V_TYPE(i) == VALUE_INTEGER) {
+		li = V_SV(d)->v.l;
+		if ((size_t)V_INT(i) == LIST_LENGTH(li) + 1) {
+			/* one past the end makes it one longer */
+			value_list_append(d, p);
+			return(d);
+		} else if (V_INT(i) < 1 || (size_t)V_INT(i) > LIST_LENGTH(li))
 			return(value_new_error("no such element"));
 		else {
-			li->value = p;
+			V_REF(p);
+			old = li->value[V_INT(i) - 1];
+			li->value[V_INT(i) - 1] = p;
+			/* others may have overwritten it too (see V_REF) */
+			if (!(V_SV(d)->admin & ADMIN_SHARED))
+				V_UNREF(old);
 			return(d);
 		}
 	} else {
@@ -402,6 +422,18 @@ builtin_dict(struct activation *ar)
 	return(v);
 }
 
+/*
+ * Freeze a value for good, so that it can be sent without being copied.
+ */
+struct value
+builtin_freeze(struct activation *ar)
+{
+	struct value v = activation_get_value(ar, 0, 0);
+
+	value_freeze(v);
+	return(v);
+}
+
 /*** multiprocessing ***/
 
 struct value
@@ -410,8 +442,8 @@ builtin_spawn(struct activation *ar)
 	struct value q = activation_get_value(ar, 0, 0);
 	struct process *p;
 
-	if (q.type == VALUE_CLOSURE) {
-		p = process_spawn(q.v.s->v.k);
+	if (V_TYPE(q) == VALUE_CLOSURE) {
+		p = process_spawn(V_SV(q)->v.k);
 		return value_new_opaque(p);
 	} else {
 		return value_new_error("type mismatch");
@@ -425,8 +457,8 @@ builtin_send(struct activation *ar)
 	struct value mv = activation_get_value(ar, 1, 0);
 	struct process *p;
 
-	if (pv.type == VALUE_OPAQUE) {
-		p = (struct process *)pv.v.ptr;
+	if (V_TYPE(pv) == VALUE_OPAQUE) {
+		p = (struct process *)V_PTR(pv);
 		process_send(p, mv);
 		return value_null();
 	} else {
@@ -436,6 +468,7 @@ builtin_send(struct activation *ar)
 
 /*
  * This can't really be done here - it should be done in the vm.
+ * Since it can't wait, it times out at once if there is no message.
  */
 struct value
 builtin_recv(struct activation *ar)
@@ -443,14 +476,57 @@ builtin_recv(struct activation *ar)
 	struct value tv = activation_get_value(ar, 0, 0);
 	struct value rv = value_null();
 
-	if (tv.type == VALUE_INTEGER) {
-		process_recv(&rv);
+	if (V_TYPE(tv) == VALUE_INTEGER) {
+		if (process_picking())
+			return(value_new_error("receive in Pick predicate"));
+		if (!process_recv(&rv))
+			rv = value_new_atom(process_timeout);
 		return(rv);
 	} else {
 		return value_new_error("type mismatch");
 	}
 }
 
+/*
+ * This can't really be done here - it should be done in the vm.
+ * (Nor can it wait here, so it doesn't.)
+ */
+struct value
+builtin_sleep(struct activation *ar)
+{
+	struct value tv = activation_get_value(ar, 0, 0);
+
+	if (V_TYPE(tv) == VALUE_INTEGER) {
+		return(value_null());
+	} else {
+		return value_new_error("type mismatch");
+	}
+}
+
+/*
+ * This can't really be done here - it should be done in the vm.
+ * Like Recv, it can't wait, so it times out at once if nothing matches.
+ */
+struct value
+builtin_pick(struct activation *ar)
+{
+	struct value pv = activation_get_value(ar, 0, 0);
+	struct value tv = activation_get_value(ar, 1, 0);
+	struct value rv = value_null();
+
+	if (V_TYPE(tv) == VALUE_INTEGER) {
+		if (process_picking())
+			return(value_new_error("receive in Pick predicate"));
+		switch (process_pick(pv, &rv)) {
+		case 1:
+			return(rv);
+		case 0:
+			return(value_new_atom(process_timeout));
+		}
+	}
+	return value_new_error("type mismatch");
+}
+
 /*
  * This can't really be done here - it should be done in the vm.
  */
@@ -570,6 +646,14 @@ btype_dict(void)
 	return(NULL);
 }
 
+struct type *
+btype_freeze(void)
+{
+	struct type *t = type_new_var(14);
+
+	return(type_new_closure(t, t));
+}
+
 struct type *
 btype_spawn(void)
 {
@@ -620,6 +704,31 @@ btype_self(void)
 	);
 }
 
+struct type *
+btype_sleep(void)
+{
+	return(
+	  type_new_closure(
+	    type_new(TYPE_INTEGER),
+	    type_new(TYPE_VOID)
+	  )
+	);
+}
+
+struct type *
+btype_pick(void)
+{
+	return(
+	  type_new_closure(
+	    type_new_arg(
+		type_new_var(12),
+		type_new(TYPE_INTEGER)
+	    ),
+	    type_new_var(13)
+	  )
+	);
+}
+
 /*** REGISTRATION ***/
 
 struct symbol *
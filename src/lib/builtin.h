@@ -43,6 +43,9 @@ struct builtin {
 #define INDEX_BUILTIN_SEND	20
 #define INDEX_BUILTIN_RECV	21
 #define INDEX_BUILTIN_SELF	22
+#define INDEX_BUILTIN_SLEEP	23
+#define INDEX_BUILTIN_PICK	24
+#define INDEX_BUILTIN_FREEZE	25
 
 #define	INDEX_BUILTIN_LAST	127
 
@@ -72,11 +75,14 @@ struct value builtin_fetch(struct activation *);
 struct value builtin_store(struct activation *);
 
 struct value builtin_dict(struct activation *);
+struct value builtin_freeze(struct activation *);
 
 struct value builtin_spawn(struct activation *);
 struct value builtin_send(struct activation *);
 struct value builtin_recv(struct activation *);
 struct value builtin_self(struct activation *);
+struct value builtin_sleep(struct activation *);
+struct value builtin_pick(struct activation *);
 
 struct type		*btype_print(void);
 struct type		*btype_unary_logic(void);
@@ -88,11 +94,14 @@ struct type		*btype_list(void);
 struct type		*btype_fetch(void);
 struct type		*btype_store(void);
 struct type		*btype_dict(void);
+struct type		*btype_freeze(void);
 
 struct type		*btype_spawn(void);
 struct type		*btype_send(void);
 struct type		*btype_recv(void);
 struct type		*btype_self(void);
+struct type		*btype_sleep(void);
+struct type		*btype_pick(void);
 
 struct symbol		*register_builtin(struct symbol_table *, struct builtin *);
 void			 register_std_builtins(struct symbol_table *);
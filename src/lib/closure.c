@@ -3,6 +3,7 @@
 #include <stdlib.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "closure.h"
 #include "symbol.h"
 #include "ast.h"
@@ -16,7 +17,7 @@ closure_new(struct ast *a, struct activation *ar, int arity, int locals, int cc)
 {
 	struct closure *c;
 
-	c = bhuna_malloc(sizeof(struct closure));
+	c = pool_alloc(sizeof(struct closure));
 
 	c->ast = a;
 	c->icode = NULL;
@@ -26,6 +27,8 @@ closure_new(struct ast *a, struct activation *ar, int arity, int locals, int cc)
 	c->arity = arity;
 	c->locals = locals;
 	c->cc = cc;
+	c->entries = 0;
+	c->need = 0;
 
 	return(c);
 }
@@ -33,7 +36,7 @@ closure_new(struct ast *a, struct activation *ar, int arity, int locals, int cc)
 void
 closure_free(struct closure *c)
 {
-	bhuna_free(c);
+	pool_free(c, sizeof(struct closure));
 }
 
 void
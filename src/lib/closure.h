@@ -15,6 +15,8 @@ struct closure {
 	int			 arity;	/* takes this many arguments */
 	int			 locals;/* has this many local variables */
 	int			 cc;	/* contains this many closures */
+	int			 entries;/* times called (counted for the jit) */
+	int			 need;	/* values its body may push (vm_reserve) */
 };
 
 struct closure	*closure_new(struct ast *, struct activation *, int, int, int);
@@ -10,6 +10,7 @@
 #include <stdio.h>
 
 #include "mem.h"
+#include "pool.h"
 
 #include "dict.h"
 #include "value.h"
@@ -25,7 +26,7 @@ dict_new(void)
 	struct dict *d;
 	int i;
 
-	d = bhuna_malloc(sizeof(struct dict));
+	d = pool_alloc(sizeof(struct dict));
 	d->num_buckets = 31;
 	d->bucket = bhuna_malloc(sizeof(struct chain *) * d->num_buckets);
 	for (i = 0; i < d->num_buckets; i++) {
@@ -43,11 +44,13 @@ chain_dup(struct chain *f)
 	struct chain *c, *n, *p = NULL, *h = NULL;
 
 	for (c = f; c != NULL; c = c->next) {
-		n = bhuna_malloc(sizeof(struct chain));
+		n = pool_alloc(sizeof(struct chain));
 
 		n->next = NULL;
 		n->key = c->key;
 		n->value = c->value;
+		V_REF(n->key);
+		V_REF(n->value);
 
 		if (h == NULL)
 			h = n;
@@ -66,8 +69,8 @@ dict_dup(struct dict *f)
 	struct dict *d;
 	int i;
 
-	d = bhuna_malloc(sizeof(struct dict));
-	d->num_buckets = 31;
+	d = pool_alloc(sizeof(struct dict));
+	d->num_buckets = f->num_buckets;
 	d->bucket = bhuna_malloc(sizeof(struct chain *) * d->num_buckets);
 	for (i = 0; i < d->num_buckets; i++) {
 		d->bucket[i] = chain_dup(f->bucket[i]);
@@ -85,14 +88,18 @@ chain_free(struct chain *c)
 {
 	assert(c != NULL);
 
-	bhuna_free(c);
+	pool_free(c, sizeof(struct chain));
 }
 
-void
+/*
+ * Returns how many bytes were freed.
+ */
+size_t
 dict_free(struct dict *d)
 {
 	struct chain *c;
 	size_t bucket_no;
+	size_t n = sizeof(struct dict) + d->num_buckets * sizeof(struct chain *);
 
 	for (bucket_no = 0; bucket_no < d->num_buckets; bucket_no++) {
 		c = d->bucket[bucket_no];
@@ -100,9 +107,12 @@ dict_free(struct dict *d)
 			d->bucket[bucket_no] = c->next;
 			chain_free(c);
 			c = d->bucket[bucket_no];
+			n += sizeof(struct chain);
 		}
 	}
-	bhuna_free(d);
+	bhuna_free(d->bucket);
+	pool_free(d, sizeof(struct dict));
+	return(n);
 }
 
 /*** UTILITIES ***/
@@ -115,16 +125,18 @@ static size_t
 hashpjw(struct value key, size_t table_size) {
 	char *p;
 	unsigned long int h = 0, g;
+	int i;
 
 	/*
 	 * XXX ecks ecks ecks XXX
 	 * This is naff... for certain values this will work.
 	 * For others, it won't...
 	 */
-	if (key.type == VALUE_INTEGER ||
-	    key.type == VALUE_BOOLEAN ||
-	    key.type == VALUE_ATOM) {
-		for (p = (char *)&key.v.i; p - (char *)&key.v.i < sizeof(int); p++) {
+	if (V_TYPE(key) == VALUE_INTEGER ||
+	    V_TYPE(key) == VALUE_BOOLEAN ||
+	    V_TYPE(key) == VALUE_ATOM) {
+		i = V_INT(key);
+		for (p = (char *)&i; p - (char *)&i < sizeof(int); p++) {
 			h = (h << 4) + (*p);
 			if ((g = h & 0xf0000000))
 				h = (h ^ (g >> 24)) ^ g;
@@ -144,11 +156,13 @@ chain_new(struct value key, struct value value)
 {
 	struct chain *c;
 
-	c = bhuna_malloc(sizeof(struct chain));
+	c = pool_alloc(sizeof(struct chain));
 
 	c->next = NULL;
 	c->key = key;
 	c->value = value;
+	V_REF(key);
+	V_REF(value);
 
 	return(c);
 }
@@ -188,11 +202,13 @@ dict_fetch(struct dict *d, struct value k)
 }
 
 /*
- * Insert a value into a dictionary.
+ * Insert a value into a dictionary.  Returns the value it replaced, for
+ * the caller to uncount (see V_REF), or null if there was none.
  */
-void
+struct value
 dict_store(struct dict *d, struct value k, struct value v)
 {
+	struct value old = value_null();
 	struct chain *c;
 	size_t i;
 
@@ -204,8 +220,11 @@ dict_store(struct dict *d, struct value k, struct value v)
 		d->bucket[i] = c;
 	} else {
 		/* Chain already exists, replace the value. */
+		V_REF(v);
+		old = c->value;
 		c->value = v;
 	}
+	return(old);
 }
 
 int
@@ -214,7 +233,7 @@ dict_exists(struct dict *d, struct value key)
 	struct value v;
 
 	v = dict_fetch(d, key);
-	return(v.type != VALUE_NULL);
+	return(V_TYPE(v) != VALUE_NULL);
 }
 
 /*
@@ -24,11 +24,11 @@ struct chain {
 
 struct dict		*dict_new(void);
 struct dict		*dict_dup(struct dict *);
-void			 dict_free(struct dict *);
+size_t			 dict_free(struct dict *);
 
 struct value		 dict_fetch(struct dict *, struct value);
 int			 dict_exists(struct dict *, struct value);
-void			 dict_store(struct dict *, struct value, struct value);
+struct value		 dict_store(struct dict *, struct value, struct value);
 
 void			 dict_rewind(struct dict *);
 int			 dict_eof(struct dict *);
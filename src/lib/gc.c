@@ -1,28 +1,350 @@
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <err.h>
+#include <sysexits.h>
+#include <time.h>
+#ifdef THREADS
+#include <sched.h>
+#endif
 
 #include "mem.h"
 #include "activation.h"
 #include "value.h"
 
 #include "list.h"
+#include "dict.h"
 #include "closure.h"
 #include "gc.h"
+#include "gcstat.h"
 #include "vm.h"
 #include "process.h"
+#include "thread.h"
 
 #ifdef DEBUG
 extern int trace_gc;
 #endif
 
-int gc_trigger = DEFAULT_GC_TRIGGER;
-int gc_target;
+size_t gc_trigger = DEFAULT_GC_TRIGGER;	/* bytes; least a heap grows by */
+int gc_growth = DEFAULT_GC_GROWTH;	/* percent, over what was live */
+int gc_cpu = DEFAULT_GC_CPU;		/* percent of a process's time */
+int gc_max_pause = 0;		/* microseconds; 0 = mark all at once */
+int gc_threads = 1;		/* to collect a stopped world with */
+
+bhuna_lock_t heap_lock = LOCK_INITIALIZER;
+
+/*
+ * Heaps.  Each process allocates into a heap of its own, and collects
+ * it by itself, from its own roots, whenever it has allocated enough
+ * since its last collection (see below); the other processes carry on
+ * meanwhile.  Nothing in a process's heap is ever seen by another
+ * process, with the exception of what it has shared, which is:
+ *
+ *   - the environment of a closure it spawns or sends,
+ *   - frozen values it sends (others it sends are copied), and
+ *   - anything put into something which was already shared.
+ *
+ * Sharing a value or activation record shares everything it refers to,
+ * so nothing shared ever refers to anything which isn't.  A process's
+ * own collection never looks inside what is shared, and at the end of
+ * it moves what is into the global heap, where the rest of what is
+ * shared lives: what was allocated when no process was running (the
+ * program's constants, and the global activation record), and what
+ * was left shared by processes which have ended.
+ *
+ * When the global heap has grown enough since it was last collected,
+ * the world is stopped and everything, in every heap, is collected at
+ * once.  When a process ends, its heap is freed, all but what it
+ * shared, without being looked at.
+ *
+ * The heap of the running process is current_heap, and only it ever
+ * touches that heap, so it needs no lock; the global heap (the current
+ * heap when no process is running) is guarded by heap_lock.
+ *
+ * A process's heap has two generations.  What it allocates is young,
+ * and most of that is garbage by its next collection, which is minor:
+ * it marks from the process's roots only as far as what is young, and
+ * sweeps only what is young, making old (AR_ADMIN_OLD, ADMIN_OLD) what
+ * survives.  Only once the old generation has doubled since it was
+ * last swept is a collection major, marking and sweeping everything.
+ *
+ * A minor collection would miss what is young and referred to only by
+ * something old, so storing a young value into an old record or value
+ * (AR_STORE, builtin_store()) goes through a barrier, which takes the
+ * old flag off it and remembers it, and the next minor collection marks
+ * what it refers to.  Nothing old refers to anything young after a
+ * collection, when all that survived is old, so then the remembered
+ * are forgotten, and flagged old again.
+ *
+ * With gc_max_pause (-P), a major collection of a process's heap is
+ * incremental: its marking is done gc_max_pause microseconds at a time,
+ * at the start of the process's timeslices, and whenever it has
+ * allocated a quarter of its nursery more, while the process carries
+ * on in between.  What is marked (black) has to stay marked, so whatever is
+ * stored into it is made grey too (the same barriers; jitted code
+ * leaves stores into marked records to the vm.)  Nothing in its roots
+ * has a barrier, so once nothing is left grey they are marked again,
+ * and what that turns up, all at once, before the heap is swept.
+ *
+ * What a process moves into the global heap is kept there in segments
+ * of at most SEGMENT_SIZE, which a stop-the-world collection sweeps one
+ * at a time, on as many threads as it has (see gc().)  What is allocated
+ * into the global heap directly is not, there being little of it.
+ *
+ * Sweeping is lazy: the world is only stopped for as long as it takes
+ * to mark.  What was marked is then swept a little at a time: each
+ * process sweeps its own heap before it next runs, and the segments of
+ * the global heap are swept one at a time by processes as they go on
+ * allocating.  Whatever has not been swept by the next stop-the-world
+ * collection is swept by it before it marks.
+ *
+ * Heaps are sized in bytes: what a record or value takes up, with what
+ * it owns (a list its cells, a dict its buckets and chains), is counted
+ * against the current heap as it is allocated or grows (HEAP_CHARGE),
+ * and what survives a collection is counted as it is marked (or, where
+ * it wasn't, swept.)  A minor collection is due once the nursery has
+ * been allocated: gc_trigger (-G) bytes, or, while minor collections
+ * take longer than gc_max_pause (-P), half as many each time, down to
+ * NURSERY_MIN.  A bigger nursery would be collected less often, but it
+ * would take just as long to sweep all it held, so it is no cheaper.
+ *
+ * A major collection is due once the old generation has grown by the
+ * heap's growth percent over what was live after the last one, plus
+ * gc_trigger, and it is marking the old generation which takes less
+ * of the time the more it may grow.  Growth starts at gc_growth (-H);
+ * after each major collection taking more than gc_cpu (-C) percent of
+ * the time since the last, it is doubled, up to GROWTH_MAX, and after
+ * each taking less than a quarter of that, halved, down to gc_growth.
+ * The global heap always grows by gc_growth.
+ *
+ * Every pause, and what was marked and freed in it, is counted (see
+ * gcstat.c.)
+ */
+#define	SEGMENT_SIZE	4096
+#define	NURSERY_MIN	(gc_trigger / 16)
+#define	GROWTH_MAX	(16 * gc_growth)
+#define	GROWN(n, g)	((n) + (n) / 100 * (g))
+
+struct heap global_heap = {
+	NULL, NULL, NULL, NULL, 0, DEFAULT_GC_TRIGGER, DEFAULT_GC_TRIGGER,
+	0, DEFAULT_GC_TRIGGER, DEFAULT_GC_GROWTH, 0, 0,
+	{ NULL, 0, 0 }, { NULL, 0, 0 }, 0, 0, { NULL, 0, 0 }
+};
+static struct segment *global_segments;	/* what was moved in */
+struct segment *global_unswept;
+THREAD_LOCAL struct heap *current_heap = &global_heap;
+
+void
+heap_init(struct heap *h)
+{
+	h->a_head = NULL;
+	h->sv_head = NULL;
+	h->old_a_head = NULL;
+	h->old_sv_head = NULL;
+	h->bytes = 0;
+	h->target = gc_trigger;
+	h->nursery = gc_trigger;
+	h->old_bytes = 0;
+	h->old_target = gc_trigger;
+	h->growth = gc_growth;
+	h->collected = 0;
+	h->live = 0;
+	h->ar_written.ptr = NULL;
+	h->ar_written.n = h->ar_written.size = 0;
+	h->sv_written.ptr = NULL;
+	h->sv_written.n = h->sv_written.size = 0;
+	h->marking = 0;
+	h->grey.ptr = NULL;
+	h->grey.n = h->grey.size = 0;
+	h->lazy = 0;
+}
+
+/*
+ * Make h the current heap; returns the one which was.
+ */
+struct heap *
+heap_enter(struct heap *h)
+{
+	struct heap *old = current_heap;
+
+	current_heap = h;
+	return(old);
+}
+
+/*
+ * Add the structured values chained from sv, bytes in all, which are
+ * in no heap yet (see process_send()), to h.
+ */
+void
+heap_take(struct heap *h, struct s_value *sv, size_t bytes)
+{
+	struct s_value *sv_next;
+
+	for (; sv != NULL; sv = sv_next) {
+		sv_next = sv->next;
+		sv->next = h->sv_head;
+		h->sv_head = sv;
+	}
+	h->bytes += bytes;
+}
+
+/*
+ * Worklists.  Sharing and marking go through what is to be shared or
+ * marked by taking it off a worklist, never by recursion, which a
+ * list of lists as long as the C stack is deep would overflow.  A
+ * worklist holds structured values, and activation records with WL_AR
+ * set in their (at least word-aligned) address.
+ */
+#define	WL_AR		((uintptr_t)1)
+#define	WL_IS_AR(p)	((uintptr_t)(p) & WL_AR)
+#define	WL_TO_AR(p)	((struct activation *)((uintptr_t)(p) & ~WL_AR))
+#define	AR_TO_WL(a)	((void *)((uintptr_t)(a) | WL_AR))
+
+static void
+worklist_push(struct worklist *r, void *p)
+{
+	if (r->n == r->size) {
+		r->size = r->size == 0 ? 64 : r->size * 2;
+		if ((r->ptr = realloc(r->ptr, r->size * sizeof(void *))) == NULL)
+			err(EX_UNAVAILABLE, "realloc()");
+	}
+	r->ptr[r->n++] = p;
+}
+
+static void
+worklist_free(struct worklist *r)
+{
+	if (r->ptr != NULL)
+		free(r->ptr);
+	r->ptr = NULL;
+	r->n = r->size = 0;
+}
+
+/*
+ * Sharing.
+ */
+static THREAD_LOCAL struct worklist sharing;
+
+static void
+share_drain(void)
+{
+	struct activation *a;
+	struct s_value *sv;
+	struct list *l;
+	struct chain *c;
+	void *p;
+	size_t j;
+	int i;
+
+	while (sharing.n > 0) {
+		p = sharing.ptr[--sharing.n];
+		if (WL_IS_AR(p)) {
+			a = WL_TO_AR(p);
+			if (a->admin & AR_ADMIN_SHARED)
+				continue;
+			assert(!(a->admin & AR_ADMIN_ON_STACK));
+			a->admin |= AR_ADMIN_SHARED;
+			if (a->depth > 0)
+				worklist_push(&sharing, AR_TO_WL(AR_ENCLOSING(a)));
+			for (i = 0; i < a->size; i++) {
+				if (V_IS_STRUCTURED(VALARY(a, i)))
+					worklist_push(&sharing, V_SV(VALARY(a, i)));
+			}
+			continue;
+		}
+		sv = p;
+		if (sv->admin & ADMIN_SHARED)
+			continue;
+		sv->admin |= ADMIN_SHARED;
+		switch (sv->type) {
+		case VALUE_LIST:
+			l = sv->v.l;
+			for (j = 0; j < LIST_LENGTH(l); j++) {
+				if (V_IS_STRUCTURED(l->value[j]))
+					worklist_push(&sharing, V_SV(l->value[j]));
+			}
+			break;
+		case VALUE_CLOSURE:
+			if (sv->v.k->ar != NULL)
+				worklist_push(&sharing, AR_TO_WL(sv->v.k->ar));
+			break;
+		case VALUE_DICT:
+			for (i = 0; i < sv->v.d->num_buckets; i++) {
+				for (c = sv->v.d->bucket[i]; c != NULL; c = c->next) {
+					if (V_IS_STRUCTURED(c->key))
+						worklist_push(&sharing, V_SV(c->key));
+					if (V_IS_STRUCTURED(c->value))
+						worklist_push(&sharing, V_SV(c->value));
+				}
+			}
+			break;
+		}
+	}
+}
 
-extern struct activation *a_head;
+void
+value_share(struct value v)
+{
+	if (!V_IS_STRUCTURED(v) || V_SV(v)->admin & ADMIN_SHARED)
+		return;
+	worklist_push(&sharing, V_SV(v));
+	share_drain();
+}
 
-extern struct s_value *sv_head;
+/*
+ * Share a, the records enclosing it, and what is in them.  Not its
+ * caller, which is only ever looked at by its own process.
+ */
+void
+activation_share(struct activation *a)
+{
+	if (a == NULL || a->admin & AR_ADMIN_SHARED)
+		return;
+	worklist_push(&sharing, AR_TO_WL(a));
+	share_drain();
+}
+
+/*
+ * Write barriers, for storing v in sv or a, which are shared, old or
+ * marked.  Something which isn't shared is in the heap of the process
+ * storing.
+ */
+#define	YOUNG(v)	\
+	(!(V_SV(v)->admin & (ADMIN_OLD | ADMIN_SHARED)))
+
+void
+value_barrier(struct s_value *sv, struct value v)
+{
+	if (!V_IS_STRUCTURED(v))
+		return;
+	if (sv->admin & ADMIN_SHARED) {
+		value_share(v);
+		return;
+	}
+	if (sv->admin & ADMIN_OLD && YOUNG(v)) {
+		sv->admin &= ~ADMIN_OLD;
+		worklist_push(&current_heap->sv_written, sv);
+	}
+	if (sv->admin & ADMIN_MARKED && current_heap->marking)
+		worklist_push(&current_heap->grey, V_SV(v));
+}
+
+void
+activation_barrier(struct activation *a, struct value v)
+{
+	if (a->admin & AR_ADMIN_SHARED) {
+		value_share(v);
+		return;
+	}
+	if (a->admin & AR_ADMIN_OLD && YOUNG(v)) {
+		a->admin &= ~AR_ADMIN_OLD;
+		worklist_push(&current_heap->ar_written, a);
+	}
+	if (a->admin & AR_ADMIN_MARKED && current_heap->marking)
+		worklist_push(&current_heap->grey, V_SV(v));
+}
 
 /*
  * Garbage collector.  Not a cheesy little reference counter, but
@@ -30,112 +352,534 @@ extern struct s_value *sv_head;
  * because an activation record can contain a closure which contain
  * an activation record, and refcounts can't handle that cycle.)
  *
- * This is not particularly sophisticated; I'm more concerned with
- * correctness than performance here.
+ * What is found to be reachable is grey, and pushed on a worklist
+ * (grey: the heap's own in a process's collection, the global heap's
+ * in a stop-the-world one) without being looked at.  Taking it off
+ * again, it is marked and what it refers to is pushed in turn, which
+ * makes it black.  Marking stops at what is already marked, in a
+ * process's own collection at what is shared, and in a minor one at
+ * what is old.  A process's own collection counts the bytes of what it
+ * blackens in live, which saves measuring it again as it is swept.
  */
-static void activation_mark(struct activation *a);
+static THREAD_LOCAL unsigned char sv_stop;
+static THREAD_LOCAL unsigned short ar_stop;
+static THREAD_LOCAL struct worklist *grey;
+static THREAD_LOCAL size_t *live;
+
+#ifdef THREADS
+/*
+ * A stop-the-world collection may mark on several threads (see gc()),
+ * each a marker, blackening from a worklist of its own (grey.)  Every
+ * so often, if another marker has run out, a marker gives the older
+ * half of its worklist to a deque of its own, which the others steal
+ * from the top of; and when its worklist runs out, it takes back from
+ * its deque, or steals.  Two markers may find the same thing at once,
+ * so while more than one is marking, the mark is set by an atomic or,
+ * and only the one which set it blackens it.
+ */
+struct marker {
+	bhuna_lock_t	 lock;		/* guards deque and top */
+	struct worklist	 deque;
+	int		 top;		/* next to be stolen */
+	int		 avail;		/* in the deque, to peek at */
+	struct worklist	 own;
+	pthread_t	 thread;
+};
+
+static struct marker		*markers = NULL;
+static int			 nmarkers = 1;
+static int			 together = 1;	/* markers marking */
+static int			 idle;		/* markers run out */
+static THREAD_LOCAL struct marker *marker = NULL;
+
+static void	marker_give(struct marker *);
+
+#define	CLAIM(admin, bit)						\
+	(together > 1 ? !(ATOMIC_FETCH_OR(&(admin), (bit)) & (bit)) :	\
+	    ((admin) |= (bit), 1))
+#else
+#define	CLAIM(admin, bit)	((admin) |= (bit), 1)
+#endif
 
 static void
 value_mark(struct value v)
+{
+	if (V_IS_STRUCTURED(v))
+		worklist_push(grey, V_SV(v));
+}
+
+static void
+activation_mark(struct activation *a)
+{
+	if (a != NULL)
+		worklist_push(grey, AR_TO_WL(a));
+}
+
+static void
+activation_mark_contents(struct activation *a)
+{
+	int i;
+
+	activation_mark(AR_ENCLOSING(a));
+	for (i = 0; i < a->size; i++) {
+		value_mark(VALARY(a, i));
+	}
+}
+
+static void
+activation_blacken(struct activation *a)
+{
+	if (a->admin & ar_stop) {
+#ifdef DEBUG
+		if (trace_gc > 1) {
+			printf("[GC] ar ");
+			activation_dump(a, 0);
+			printf(" aready marked\n");
+		}
+#endif
+		return;
+	}
+
+#ifdef DEBUG
+	if (trace_gc > 1) {
+		printf("[GC] MARKING AR ");
+		activation_dump(a, 0);
+		printf(" AS REACHABLE\n");
+	}
+#endif
+
+	if (!CLAIM(a->admin, AR_ADMIN_MARKED))
+		return;
+	if (live != NULL)
+		*live += AR_SIZE(a);
+	GCSTAT_MARKED(GCSTAT_AR, AR_SIZE(a));
+	activation_mark_contents(a);
+}
+
+static void
+s_value_blacken(struct s_value *sv)
 {
 	struct list *l;
+	struct chain *c;
+	size_t n = sizeof(struct s_value), j;
+	int i;
 
-	if (!(v.type & VALUE_STRUCTURED) || v.v.s->admin & ADMIN_MARKED)
+	if (sv->admin & sv_stop)
 		return;
 
 #ifdef DEBUG
 	if (trace_gc > 1) {
+		struct value v;
+
+		V_SET_PTR(v, sv->type, sv);
 		printf("[GC] MARKING VALUE ");
 		value_print(v);
 		printf(" AS REACHABLE\n");
 	}
 #endif
 
-	v.v.s->admin |= ADMIN_MARKED;
-	switch (v.type) {
+	if (!CLAIM(sv->admin, ADMIN_MARKED))
+		return;
+	switch (sv->type) {
 	case VALUE_LIST:
-		for (l = v.v.s->v.l; l != NULL; l = l->next) {
-			value_mark(l->value);
-		}
+		l = sv->v.l;
+		for (j = 0; j < LIST_LENGTH(l); j++)
+			value_mark(l->value[j]);
+		n += list_size(l);
 		break;
 	case VALUE_CLOSURE:
-		activation_mark(v.v.s->v.k->ar);
+		activation_mark(sv->v.k->ar);
+		n += sizeof(struct closure);
 		break;
 	case VALUE_DICT:
-		/* XXX for each key in v->v.d, value_mark(d[k]) */
+		n += sizeof(struct dict) +
+		    sv->v.d->num_buckets * sizeof(struct chain *);
+		for (i = 0; i < sv->v.d->num_buckets; i++) {
+			for (c = sv->v.d->bucket[i]; c != NULL; c = c->next) {
+				value_mark(c->key);
+				value_mark(c->value);
+				n += sizeof(struct chain);
+			}
+		}
 		break;
 	default:
 		/*
 		 * No need to go through other values as they
 		 * are not containers.
 		 */
+		n = s_value_size(sv);
 		break;
 	}
+	if (live != NULL)
+		*live += n;
+	GCSTAT_MARKED(GCSTAT_KIND(sv->type), n);
+}
+
+/*
+ * Blacken what is grey, for at most budget microseconds, or until there
+ * is none left if budget is 0.  Returns nonzero if none is left.  What
+ * is taken off the worklist waits in ahead[] while MARK_AHEAD more are,
+ * so that it has been fetched by the time it is marked.  A marker gives
+ * some of what is grey away now and then, if others have run out.
+ */
+#define	MARK_AHEAD	8
+
+#ifdef __GNUC__
+#define	PREFETCH(p)	__builtin_prefetch((p), 1)
+#else
+#define	PREFETCH(p)
+#endif
+
+static int
+mark_drain(long budget)
+{
+	void *ahead[MARK_AHEAD], *p;
+	long start = budget > 0 ? gcstat_now() : 0;
+	int first = 0, n = 0, count = 0;
+
+	for (;;) {
+		while (n < MARK_AHEAD && grey->n > 0) {
+			p = grey->ptr[--grey->n];
+			PREFETCH(WL_TO_AR(p));
+			ahead[(first + n++) % MARK_AHEAD] = p;
+		}
+		if (n == 0)
+			return(1);
+		p = ahead[first];
+		first = (first + 1) % MARK_AHEAD;
+		n--;
+		if (WL_IS_AR(p))
+			activation_blacken(WL_TO_AR(p));
+		else
+			s_value_blacken(p);
+		if ((++count & 0x3f) != 0)
+			continue;
+#ifdef THREADS
+		if (marker != NULL && ATOMIC_LOAD(&idle) > 0)
+			marker_give(marker);
+#endif
+		if (budget > 0 && gcstat_now() - start >= budget) {
+			while (n > 0)
+				worklist_push(grey, ahead[(first + --n) % MARK_AHEAD]);
+			return(0);
+		}
+	}
 }
 
+#ifdef THREADS
+/*
+ * Give the older half of m's worklist to its deque, if that is empty.
+ */
 static void
-activation_mark(struct activation *a)
+marker_give(struct marker *m)
 {
-	int i;
+	int i, k = m->own.n / 2;
 
-	if (a == NULL)
+	if (k == 0 || ATOMIC_LOAD(&m->avail) > 0)
 		return;
-	if (a->admin & AR_ADMIN_MARKED) {
-#ifdef DEBUG
-		if (trace_gc > 1) {
-			printf("[GC] ar ");
-			activation_dump(a, 0);
-			printf(" aready marked\n");
+	LOCK(&m->lock);
+	for (i = 0; i < k; i++)
+		worklist_push(&m->deque, m->own.ptr[i]);
+	ATOMIC_STORE(&m->avail, m->deque.n - m->top);
+	UNLOCK(&m->lock);
+	memmove(m->own.ptr, m->own.ptr + k, (m->own.n - k) * sizeof(void *));
+	m->own.n -= k;
+}
+
+/*
+ * Take half (at least one) of what is in the deque of from, oldest
+ * first, onto m's worklist.  Returns nonzero if there was any.
+ */
+static int
+marker_take(struct marker *m, struct marker *from)
+{
+	int k;
+
+	if (ATOMIC_LOAD(&from->avail) == 0)
+		return(0);
+	LOCK(&from->lock);
+	k = (from->deque.n - from->top + 1) / 2;
+	while (k-- > 0)
+		worklist_push(&m->own, from->deque.ptr[from->top++]);
+	if (from->top == from->deque.n)
+		from->top = from->deque.n = 0;
+	ATOMIC_STORE(&from->avail, from->deque.n - from->top);
+	UNLOCK(&from->lock);
+	return(m->own.n > 0);
+}
+
+/*
+ * m has run out.  Wait for another marker to give something away, and
+ * steal it; returns 0 if instead they all run out, when marking is done.
+ * A marker only runs out once its deque is empty, and only it puts
+ * anything there, so once all have, none will have anything again.
+ */
+static int
+marker_wait(struct marker *m)
+{
+	struct marker *o;
+
+	ATOMIC_ADD(&idle, 1);
+	while (ATOMIC_LOAD(&idle) < nmarkers) {
+		for (o = markers; o < markers + nmarkers; o++) {
+			if (o == m || ATOMIC_LOAD(&o->avail) == 0)
+				continue;
+			ATOMIC_ADD(&idle, -1);
+			if (marker_take(m, o))
+				return(1);
+			ATOMIC_ADD(&idle, 1);
 		}
-#endif
+		sched_yield();
+	}
+	return(0);
+}
+
+/*
+ * Mark, as one of nmarkers, until none of them has anything left.
+ */
+static void
+mark_together(void)
+{
+	struct marker *m = marker;
+
+	grey = &m->own;
+	sv_stop = ADMIN_MARKED;
+	ar_stop = AR_ADMIN_MARKED;
+	for (;;) {
+		mark_drain(0);
+		if (!marker_take(m, m) && !marker_wait(m))
+			break;
+	}
+}
+
+/*
+ * The gang which collects a stopped world: the thread calling gc(),
+ * which is markers[0], and gc_threads - 1 helpers, started the first
+ * time it is needed, which otherwise wait to be given something to do.
+ */
+static bhuna_lock_t	 gang_lock = LOCK_INITIALIZER;
+static pthread_cond_t	 gang_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	 gang_done_cv = PTHREAD_COND_INITIALIZER;
+static unsigned		 gang_gen = 0;
+static int		 gang_busy = 0;
+static void		(*gang_fn)(void);
+
+static void *
+helper_main(void *arg)
+{
+	unsigned gen = 0;
+
+	marker = arg;
+	for (;;) {
+		LOCK(&gang_lock);
+		while (gang_gen == gen)
+			pthread_cond_wait(&gang_cv, &gang_lock);
+		gen = gang_gen;
+		UNLOCK(&gang_lock);
+		GCSTAT_IN(GCSTAT_WORLD);
+		gang_fn();
+		gcstat_flush();
+		LOCK(&gang_lock);
+		if (--gang_busy == 0)
+			pthread_cond_signal(&gang_done_cv);
+		UNLOCK(&gang_lock);
+	}
+	return(NULL);
+}
+
+static void
+gang_start(void)
+{
+	int n;
+
+	if (markers != NULL || gc_threads <= 1)
 		return;
+	nmarkers = gc_threads;
+	markers = bhuna_malloc(sizeof(struct marker) * nmarkers);
+	memset(markers, 0, sizeof(struct marker) * nmarkers);
+	for (n = 0; n < nmarkers; n++)
+		LOCK_INIT(&markers[n].lock);
+	for (n = 1; n < nmarkers; n++) {
+		if (pthread_create(&markers[n].thread, NULL,
+		    helper_main, &markers[n]) != 0)
+			err(EX_OSERR, "pthread_create()");
 	}
+}
+#endif
 
-#ifdef DEBUG
-	if (trace_gc > 1) {
-		printf("[GC] MARKING AR ");
-		activation_dump(a, 0);
-		printf(" AS REACHABLE\n");
+/*
+ * Run fn on every thread of the gang, and wait for them all to be done.
+ */
+static void
+gang_run(void (*fn)(void))
+{
+#ifdef THREADS
+	if (nmarkers > 1) {
+		LOCK(&gang_lock);
+		gang_fn = fn;
+		gang_busy = nmarkers - 1;
+		gang_gen++;
+		pthread_cond_broadcast(&gang_cv);
+		UNLOCK(&gang_lock);
+		marker = &markers[0];
+		fn();
+		marker = NULL;
+		LOCK(&gang_lock);
+		while (gang_busy > 0)
+			pthread_cond_wait(&gang_done_cv, &gang_lock);
+		UNLOCK(&gang_lock);
+		return;
 	}
 #endif
+	fn();
+}
 
-	a->admin |= AR_ADMIN_MARKED;
-	activation_mark(a->caller);
-	activation_mark(a->enclosing);
-	for (i = 0; i < a->size; i++) {
-		value_mark(VALARY(a, i));
+/*
+ * The records a vm is in the middle of are found by following their
+ * callers from its current one.  Those on its stack can only be found
+ * this way, so they are not marked, which would only have to be undone.
+ */
+static void
+vm_mark(struct vm *vm)
+{
+	struct activation *a;
+	struct value *vsc;
+
+	for (a = vm->current_ar; a != NULL; a = a->caller) {
+		if (a->admin & AR_ADMIN_ON_STACK)
+			activation_mark_contents(a);
+		else
+			activation_mark(a);
 	}
+	for (vsc = vm->vstack; vsc < vm->vstack_ptr; vsc++)
+		value_mark(*vsc);
 }
 
-void
-gc(void)
+/*
+ * A process, running or waiting, holds on to its activation records,
+ * what is on its stack and the messages it has put aside, and those of
+ * the vm running a Pick predicate for it, if there is one.  Messages
+ * still in its mailbox are in no heap until it receives them; they only
+ * refer to what is shared, or to copies made for them (see process_send().)
+ */
+static void
+process_mark_own(struct process *p)
 {
-	struct process *p;
-	struct activation *a, *a_next;
-	struct activation *ta_head = NULL;
+	vm_mark(p->vm);
+	if (p->pick_vm != NULL)
+		vm_mark(p->pick_vm);
+	process_walk_aside(p, value_mark);
+}
 
-	struct value *vsc;
-	struct s_value *sv, *sv_next, *tsv_head = NULL;
+static void
+process_mark(struct process *p)
+{
+	process_mark_own(p);
+	process_walk_mailbox(p, value_mark);
+}
+
+/*
+ * Take the marks off everything in h, giving up any marking under way.
+ */
+static void
+heap_unmark(struct heap *h)
+{
+	struct activation *a;
+	struct s_value *sv;
+	int i;
 
-	/*
-	 * Mark...
-	 */
-	for (p = run_head; p != NULL; p = p->next) {
-		activation_mark(p->vm->current_ar);
-		for (vsc = p->vm->vstack; vsc < p->vm->vstack_ptr; vsc++)
-			value_mark(*vsc);
+	if (!h->marking)
+		return;
+	for (i = 0; i < 2; i++) {
+		for (a = i ? h->old_a_head : h->a_head; a != NULL; a = a->next)
+			a->admin &= ~AR_ADMIN_MARKED;
+		for (sv = i ? h->old_sv_head : h->sv_head; sv != NULL; sv = sv->next)
+			sv->admin &= ~ADMIN_MARKED;
 	}
+	h->grey.n = 0;
+	h->marking = 0;
+}
+
+/*
+ * Sweeping.  What survives in a process's heap becomes old, or, if it
+ * is shared, is moved to the global heap, in segments.
+ */
+struct sweep {
+	int			 all;	/* free even what is shared */
+	int			 local;	/* not the global heap */
+	int			 measure; /* kept wasn't counted in live */
+	struct activation	*a_head, *a_tail;	/* kept */
+	struct s_value		*sv_head, *sv_tail;
+	int			 kept;
+	size_t			 bytes;	/* of what was kept */
+	struct segment		*moved;
+	size_t			 moved_bytes;
+};
 
-	/*
-	 * ...and sweep
-	 */
-	for (a = a_head; a != NULL; a = a_next) {
+static struct segment *
+segment_new(void)
+{
+	struct segment *g;
+
+	g = bhuna_malloc(sizeof(struct segment));
+	memset(g, 0, sizeof(struct segment));
+	return(g);
+}
+
+/*
+ * Put what is in g at the end of to, and free g.
+ */
+static void
+segment_join(struct segment *to, struct segment *g)
+{
+	if (g->a_head != NULL) {
+		if (to->a_head == NULL)
+			to->a_head = g->a_head;
+		else
+			to->a_tail->next = g->a_head;
+		to->a_tail = g->a_tail;
+	}
+	if (g->sv_head != NULL) {
+		if (to->sv_head == NULL)
+			to->sv_head = g->sv_head;
+		else
+			to->sv_tail->next = g->sv_head;
+		to->sv_tail = g->sv_tail;
+	}
+	to->count += g->count;
+	to->bytes += g->bytes;
+	bhuna_free(g);
+}
+
+/*
+ * The segment to move one more, of n bytes, into.
+ */
+static struct segment *
+sweep_moving(struct sweep *s, size_t n)
+{
+	struct segment *g = s->moved;
+
+	if (g == NULL || g->count == SEGMENT_SIZE) {
+		g = segment_new();
+		g->next = s->moved;
+		s->moved = g;
+	}
+	g->count++;
+	g->bytes += n;
+	s->moved_bytes += n;
+	return(g);
+}
+
+static void
+activation_sweep(struct sweep *s, struct activation *a)
+{
+	struct activation *a_next;
+	struct segment *g;
+
+	for (; a != NULL; a = a_next) {
 		a_next = a->next;
-		if (a->admin & AR_ADMIN_MARKED) {
-			a->admin &= ~AR_ADMIN_MARKED;
-			a->next = ta_head;
-			ta_head = a;
-		} else {
+		if (!(a->admin & AR_ADMIN_MARKED) &&
+		    (s->all || !(a->admin & AR_ADMIN_SHARED))) {
 #ifdef DEBUG
 			if (trace_gc > 1) {
 				printf("[GC] FOUND UNREACHABLE AR ");
@@ -143,19 +887,47 @@ gc(void)
 				printf("\n");
 			}
 #endif
+			GCSTAT_FREED(GCSTAT_AR, AR_SIZE(a));
 			activation_free_from_heap(a);
+			continue;
+		}
+		a->admin &= ~AR_ADMIN_MARKED;
+		if (!s->local) {
+			if (s->a_tail == NULL)
+				s->a_tail = a;
+			a->next = s->a_head;
+			s->a_head = a;
+			s->kept++;
+			s->bytes += AR_SIZE(a);
+		} else if (a->admin & AR_ADMIN_SHARED) {
+			a->admin &= ~AR_ADMIN_OLD;
+			g = sweep_moving(s, AR_SIZE(a));
+			if (g->a_tail == NULL)
+				g->a_tail = a;
+			a->next = g->a_head;
+			g->a_head = a;
+		} else {
+			a->admin |= AR_ADMIN_OLD;
+			a->next = s->a_head;
+			s->a_head = a;
+			s->kept++;
+			if (s->measure)
+				s->bytes += AR_SIZE(a);
 		}
 	}
+}
 
-	a_head = ta_head;
+static void
+s_value_sweep(struct sweep *s, struct s_value *sv)
+{
+	struct s_value *sv_next;
+	struct segment *g;
+	int kind;
 
-	for (sv = sv_head; sv != NULL; sv = sv_next) {
+	for (; sv != NULL; sv = sv_next) {
 		sv_next = sv->next;
-		if (sv->admin & ADMIN_MARKED || sv->admin & ADMIN_PERMANENT) {
-			sv->admin &= ~ADMIN_MARKED;
-			sv->next = tsv_head;
-			tsv_head = sv;
-		} else {
+		if (!(sv->admin & (ADMIN_MARKED | ADMIN_PERMANENT)) &&
+		    (s->all || !(sv->admin & ADMIN_SHARED))) {
 #ifdef DEBUG
 			if (trace_gc > 1) {
 				printf("[GC] FOUND UNREACHABLE VALUE ");
@@ -163,9 +935,557 @@ gc(void)
 				printf("\n");
 			}
 #endif
-			s_value_free(sv);
+			kind = GCSTAT_KIND(sv->type);
+			GCSTAT_FREED(kind, s_value_free(sv));
+			continue;
+		}
+#ifdef THREADS
+		/* another process may be freezing it */
+		if (sv->admin & ADMIN_SHARED)
+			ATOMIC_FETCH_AND(&sv->admin, ~(ADMIN_MARKED | ADMIN_OLD));
+		else
+#endif
+		sv->admin &= ~(ADMIN_MARKED | ADMIN_OLD);
+		if (!s->local) {
+			if (s->sv_tail == NULL)
+				s->sv_tail = sv;
+			sv->next = s->sv_head;
+			s->sv_head = sv;
+			s->kept++;
+			s->bytes += s_value_size(sv);
+		} else if (sv->admin & ADMIN_SHARED) {
+			g = sweep_moving(s, s_value_size(sv));
+			if (g->sv_tail == NULL)
+				g->sv_tail = sv;
+			sv->next = g->sv_head;
+			g->sv_head = sv;
+		} else {
+			sv->admin |= ADMIN_OLD;
+			sv->next = s->sv_head;
+			s->sv_head = sv;
+			s->kept++;
+			if (s->measure)
+				s->bytes += s_value_size(sv);
+		}
+	}
+}
+
+/*
+ * Free what isn't marked from g, a segment of the global heap (or what
+ * was allocated into it directly), and take the marks off the rest.
+ */
+static void
+segment_sweep(struct segment *g)
+{
+	struct sweep s;
+
+	memset(&s, 0, sizeof(s));
+	s.all = 1;
+	activation_sweep(&s, g->a_head);
+	s_value_sweep(&s, g->sv_head);
+	g->a_head = s.a_head;
+	g->a_tail = s.a_tail;
+	g->sv_head = s.sv_head;
+	g->sv_tail = s.sv_tail;
+	g->count = s.kept;
+	g->bytes = s.bytes;
+}
+
+/*
+ * Drop the segments of the global heap which sweeping has emptied, and
+ * join those which, side by side, fit in one.  Returns how many bytes
+ * are left in them.
+ */
+static size_t
+segments_compact(void)
+{
+	struct segment *g, **gp;
+	size_t bytes = 0;
+
+	for (gp = &global_segments; (g = *gp) != NULL; ) {
+		if (g->count == 0) {
+			*gp = g->next;
+			bhuna_free(g);
+			continue;
+		}
+		while (g->next != NULL &&
+		    g->count + g->next->count <= SEGMENT_SIZE) {
+			struct segment *g_next = g->next;
+
+			g->next = g_next->next;
+			segment_join(g, g_next);
+		}
+		bytes += g->bytes;
+		gp = &g->next;
+	}
+	return(bytes);
+}
+
+/*
+ * Move the segments chained from g, n bytes in all, into the global
+ * heap, filling up the one last moved in first, if they fit.
+ */
+static void
+segments_add(struct segment *g, size_t n)
+{
+	struct segment *g_next;
+
+	LOCK(&heap_lock);
+	for (; g != NULL; g = g_next) {
+		g_next = g->next;
+		if (global_segments != NULL &&
+		    global_segments->count + g->count <= SEGMENT_SIZE) {
+			segment_join(global_segments, g);
+			continue;
+		}
+		g->next = global_segments;
+		global_segments = g;
+	}
+	global_heap.bytes += n;
+	UNLOCK(&heap_lock);
+}
+
+/*
+ * Free what isn't marked (or, unless all, shared) from the young
+ * generation of h, the heap of a process, or, if major, from both, and
+ * take the marks off the rest.
+ */
+static void
+heap_sweep(struct heap *h, int all, int major)
+{
+	struct sweep s;
+
+	memset(&s, 0, sizeof(s));
+	s.all = all;
+	s.local = 1;
+	if (!major) {
+		s.a_head = h->old_a_head;
+		s.sv_head = h->old_sv_head;
+		s.bytes = h->old_bytes;
+	}
+	if (all)
+		s.measure = 1;
+	else
+		s.bytes += h->live;
+	activation_sweep(&s, h->a_head);
+	s_value_sweep(&s, h->sv_head);
+	if (major) {
+		activation_sweep(&s, h->old_a_head);
+		s_value_sweep(&s, h->old_sv_head);
+	}
+
+	h->a_head = NULL;
+	h->sv_head = NULL;
+	h->bytes = 0;
+	h->old_a_head = s.a_head;
+	h->old_sv_head = s.sv_head;
+	h->old_bytes = s.bytes;
+	if (major)
+		h->old_target = GROWN(h->old_bytes, h->growth) + gc_trigger;
+
+	if (s.moved != NULL)
+		segments_add(s.moved, s.moved_bytes);
+}
+
+/*
+ * What was remembered is old, and refers to nothing young once a
+ * collection has made everything which survived it old.
+ */
+static void
+heap_forget(struct heap *h)
+{
+	struct activation *a;
+	struct s_value *sv;
+	int i;
+
+	for (i = 0; i < h->ar_written.n; i++) {
+		a = h->ar_written.ptr[i];
+		a->admin = (a->admin & ~AR_ADMIN_MARKED) | AR_ADMIN_OLD;
+	}
+	for (i = 0; i < h->sv_written.n; i++) {
+		sv = h->sv_written.ptr[i];
+		sv->admin = (sv->admin & ~ADMIN_MARKED) | ADMIN_OLD;
+	}
+	h->ar_written.n = 0;
+	h->sv_written.n = 0;
+}
+
+/*
+ * Give up the heap of a process which has ended.  Nothing else can
+ * see what in it isn't shared, so that is all freed.
+ */
+void
+heap_free(struct heap *h)
+{
+	long start = gcstat_now();
+
+	GCSTAT_IN(GCSTAT_WORLD);
+	if (h->lazy) {
+		h->lazy = 0;
+		heap_sweep(h, 1, 1);
+	}
+	GCSTAT_IN(GCSTAT_EXIT);
+	heap_unmark(h);
+	heap_sweep(h, 0, 1);
+	worklist_free(&h->ar_written);
+	worklist_free(&h->sv_written);
+	worklist_free(&h->grey);
+	gcstat_pause(GCSTAT_EXIT, gcstat_now() - start);
+}
+
+/*
+ * Go on with the incremental marking of the heap of p, which is the
+ * process calling, in a pause which began at start, and, when it is
+ * done, sweep.
+ */
+static void
+step(struct process *p, long start)
+{
+	struct heap *h = &p->heap;
+
+	GCSTAT_IN(GCSTAT_MAJOR);
+	sv_stop = ADMIN_MARKED | ADMIN_SHARED;
+	ar_stop = AR_ADMIN_MARKED | AR_ADMIN_SHARED;
+	grey = &h->grey;
+	live = &h->live;
+	if (!mark_drain(gc_max_pause)) {
+		h->target = h->bytes + h->nursery / 4;
+		gcstat_pause(GCSTAT_STEP, gcstat_now() - start);
+		return;
+	}
+#ifdef DEBUG
+	if (trace_gc > 0)
+		printf("[GC] process #%d done marking, sweeping %luK young and %luK old\n",
+		    p->number, (unsigned long)h->bytes / 1024,
+		    (unsigned long)h->old_bytes / 1024);
+#endif
+	process_mark_own(p);
+	mark_drain(0);
+	h->marking = 0;
+	h->ar_written.n = 0;
+	h->sv_written.n = 0;
+	heap_sweep(h, 0, 1);
+	h->target = h->nursery;
+	h->collected = gcstat_now();
+	gcstat_pause(GCSTAT_STEP, h->collected - start);
+}
+
+void
+gc_step(struct process *p)
+{
+	step(p, gcstat_now());
+}
+
+/*
+ * Sweep the next of the segments of the global heap which the last
+ * stop-the-world collection left marked, if there are any left.
+ * Returns 0 if there weren't.
+ */
+static int
+segment_sweep_lazily(void)
+{
+	struct segment *g;
+	size_t n;
+
+	LOCK(&heap_lock);
+	if ((g = global_unswept) != NULL)
+		global_unswept = g->next;
+	UNLOCK(&heap_lock);
+	if (g == NULL)
+		return(0);
+	GCSTAT_IN(GCSTAT_WORLD);
+	n = g->bytes;
+	segment_sweep(g);
+	g->next = NULL;
+	LOCK(&heap_lock);
+	global_heap.bytes -= n;
+	global_heap.target -= GROWN(n - g->bytes, gc_growth);
+	UNLOCK(&heap_lock);
+	segments_add(g, g->bytes);
+	return(1);
+}
+
+/*
+ * Size the nursery of h again after a minor collection of it which
+ * took pause microseconds (see above.)
+ */
+static void
+nursery_size(struct heap *h, long pause)
+{
+	if (pause > gc_max_pause)
+		h->nursery /= 2;
+	else if (pause < gc_max_pause / 2)
+		h->nursery *= 2;
+	if (h->nursery < NURSERY_MIN)
+		h->nursery = NURSERY_MIN;
+	if (h->nursery > gc_trigger)
+		h->nursery = gc_trigger;
+}
+
+/*
+ * Let the old generation of h grow more, or less, before its next
+ * major collection, after one which started at start (see above.)
+ * Until h has had one, there is nothing to tell how long the process
+ * ran in between.
+ */
+static void
+heap_size(struct heap *h, long start)
+{
+	long now = gcstat_now();
+	long pause = now - start;
+	long ran = now - h->collected;
+
+	if (h->collected != 0 && pause * 100 > gc_cpu * ran)
+		h->growth *= 2;
+	else if (h->collected != 0 && pause * 400 < gc_cpu * ran)
+		h->growth /= 2;
+	if (h->growth < gc_growth)
+		h->growth = gc_growth;
+	if (h->growth > GROWTH_MAX)
+		h->growth = GROWTH_MAX;
+#ifdef DEBUG
+	if (trace_gc > 0)
+		printf("[GC] %ld microseconds marking and sweeping, %ld since the last; growing by %d%%\n",
+		    pause, h->collected != 0 ? ran : 0L, h->growth);
+#endif
+	h->collected = now;
+	h->old_target = GROWN(h->old_bytes, h->growth) + gc_trigger;
+}
+
+/*
+ * Collect the heap of p, which is the process calling.  Nothing else
+ * need stop.  A minor collection marks from what was remembered as
+ * well as from p's roots.  Then one more segment of the global heap is
+ * swept, if the last stop-the-world collection left any unswept.
+ */
+void
+gc_local(struct process *p)
+{
+	struct heap *h = &p->heap;
+	long start = gcstat_now();
+	int what;
+	int i;
+
+	if (h->marking) {
+		step(p, start);
+		return;
+	}
+	if (h->old_bytes > h->old_target && gc_max_pause > 0) {
+#ifdef DEBUG
+		if (trace_gc > 0)
+			printf("[GC] process #%d marking incrementally\n",
+			    p->number);
+#endif
+		h->marking = 1;
+		h->live = 0;
+		grey = &h->grey;
+		process_mark_own(p);
+		step(p, start);
+		return;
+	}
+	sv_stop = ADMIN_MARKED | ADMIN_SHARED;
+	ar_stop = AR_ADMIN_MARKED | AR_ADMIN_SHARED;
+	grey = &h->grey;
+	h->live = 0;
+	live = &h->live;
+	if (h->old_bytes > h->old_target) {
+		what = GCSTAT_MAJOR;
+		GCSTAT_IN(what);
+		h->ar_written.n = 0;
+		h->sv_written.n = 0;
+		process_mark_own(p);
+		mark_drain(0);
+		heap_sweep(h, 0, 1);
+		heap_size(h, start);
+	} else {
+		what = GCSTAT_MINOR;
+		GCSTAT_IN(what);
+		sv_stop |= ADMIN_OLD;
+		ar_stop |= AR_ADMIN_OLD;
+		process_mark_own(p);
+		for (i = 0; i < h->ar_written.n; i++)
+			activation_mark(h->ar_written.ptr[i]);
+		for (i = 0; i < h->sv_written.n; i++)
+			worklist_push(grey, h->sv_written.ptr[i]);
+		mark_drain(0);
+		heap_sweep(h, 0, 0);
+		heap_forget(h);
+		if (gc_max_pause > 0)
+			nursery_size(h, gcstat_now() - start);
+	}
+	h->target = h->nursery;
+	segment_sweep_lazily();
+	gcstat_pause(what, gcstat_now() - start);
+}
+
+static void
+s_value_unmark(struct s_value *sv)
+{
+	sv->admin &= ~ADMIN_MARKED;
+}
+
+static void
+process_unmark(struct process *p)
+{
+	heap_unmark(&p->heap);
+}
+
+static void
+process_unmark_copies(struct process *p)
+{
+	process_walk_copies(p, s_value_unmark);
+}
+
+static void
+process_set_lazy(struct process *p)
+{
+	p->heap.lazy = 1;
+}
+
+static void
+process_sweep(struct process *p)
+{
+	p->heap.lazy = 0;
+	p->heap.ar_written.n = 0;
+	p->heap.sv_written.n = 0;
+	heap_sweep(&p->heap, 1, 1);
+	p->heap.target = p->heap.nursery;
+}
+
+/*
+ * Sweeping together: each thread of the gang sweeps the next of tasks,
+ * until there are none left.
+ */
+static struct worklist	 tasks;
+static int		 next_task;
+
+static void *
+task_next(void)
+{
+	int i = ATOMIC_ADD(&next_task, 1) - 1;
+
+	return(i < tasks.n ? tasks.ptr[i] : NULL);
+}
+
+static void
+task_add_lazy(struct process *p)
+{
+	if (p->heap.lazy)
+		worklist_push(&tasks, p);
+}
+
+static void
+sweep_segments(void)
+{
+	struct segment *g;
+
+	while ((g = task_next()) != NULL)
+		segment_sweep(g);
+}
+
+static void
+sweep_processes(void)
+{
+	struct process *p;
+
+	while ((p = task_next()) != NULL)
+		process_sweep(p);
+}
+
+/*
+ * Sweep what the last stop-the-world collection left marked in the
+ * heap of p, the process calling, if it hasn't been yet, and one more
+ * of the segments of the global heap.
+ */
+void
+gc_sweep(struct process *p)
+{
+	long start = gcstat_now();
+	int swept = 0;
+
+	GCSTAT_IN(GCSTAT_WORLD);
+	if (p != NULL && p->heap.lazy) {
+		process_sweep(p);
+		swept = 1;
+	}
+	if (segment_sweep_lazily() || swept)
+		gcstat_pause(GCSTAT_SWEEP, gcstat_now() - start);
+}
+
+/*
+ * Collect every heap.  Only while the world is stopped (see
+ * process_stop_world().)  Any incremental marking is given up, and any
+ * sweeping the last one left undone is done first.  Marking is done by
+ * the gang of gc_threads threads together, each starting from its share
+ * of the roots.  What was allocated into the global heap directly is
+ * swept then and there; every segment of it, and every process's heap,
+ * is left marked, to be swept lazily (see gc_sweep().)
+ */
+void
+gc(void)
+{
+	struct segment direct, *g;
+	size_t bytes;
+	long start = gcstat_now();
+	int i;
+#ifdef THREADS
+	struct marker *m;
+#endif
+
+	GCSTAT_IN(GCSTAT_WORLD);
+	tasks.n = 0;
+	process_walk(task_add_lazy);
+	next_task = 0;
+	if (tasks.n > 0)
+		gang_run(sweep_processes);
+	tasks.n = 0;
+	for (g = global_unswept; g != NULL; g = g->next)
+		worklist_push(&tasks, g);
+	next_task = 0;
+	if (tasks.n > 0) {
+		gang_run(sweep_segments);
+		for (i = 0; i < tasks.n; i++) {
+			g = tasks.ptr[i];
+			g->next = global_segments;
+			global_segments = g;
 		}
+		global_unswept = NULL;
 	}
+	bytes = segments_compact();
+
+	sv_stop = ADMIN_MARKED;
+	ar_stop = AR_ADMIN_MARKED;
+	grey = &global_heap.grey;
+	live = NULL;
+	process_walk(process_unmark);
+	process_walk(process_mark);
+#ifdef THREADS
+	gang_start();
+	if (nmarkers > 1) {
+		for (i = 0; i < grey->n; i++)
+			worklist_push(&markers[i % nmarkers].deque, grey->ptr[i]);
+		grey->n = 0;
+		for (m = markers; m < markers + nmarkers; m++)
+			m->avail = m->deque.n - m->top;
+		idle = 0;
+		together = nmarkers;
+		gang_run(mark_together);
+		together = 1;
+	} else
+#endif
+	mark_drain(0);
 
-	sv_head = tsv_head;
+	process_walk(process_unmark_copies);
+	memset(&direct, 0, sizeof(direct));
+	direct.a_head = global_heap.a_head;
+	direct.sv_head = global_heap.sv_head;
+	segment_sweep(&direct);
+	global_heap.a_head = direct.a_head;
+	global_heap.sv_head = direct.sv_head;
+	global_unswept = global_segments;
+	global_segments = NULL;
+	global_heap.bytes = direct.bytes + bytes;
+	global_heap.target = GROWN(global_heap.bytes, gc_growth) + gc_trigger;
+	process_walk(process_set_lazy);
+	gcstat_pause(GCSTAT_WORLD, gcstat_now() - start);
 }
@@ -2,6 +2,99 @@
  * gc.h
  */
 
-#define DEFAULT_GC_TRIGGER	8192
+#ifndef __GC_H_
+#define __GC_H_
 
+#include "value.h"
+#include "thread.h"
+
+#define DEFAULT_GC_TRIGGER	(256 * 1024)	/* bytes */
+#define DEFAULT_GC_GROWTH	100		/* percent */
+#define DEFAULT_GC_CPU		10		/* percent */
+
+struct activation;
+struct process;
+
+/*
+ * A growable list of records or values, for the collector to come
+ * back to (see gc.c.)
+ */
+struct worklist {
+	void			**ptr;
+	int			  n;
+	int			  size;
+};
+
+/*
+ * A segment of the global heap: at most SEGMENT_SIZE of its records
+ * and values, which can be swept apart from the rest (see gc.c.)
+ */
+struct segment {
+	struct segment		*next;
+	struct activation	*a_head;
+	struct activation	*a_tail;
+	struct s_value		*sv_head;
+	struct s_value		*sv_tail;
+	int			 count;
+	size_t			 bytes;
+};
+
+/*
+ * A heap: the activation records and structured values which one
+ * process has allocated, young and old, or, for the global heap,
+ * those which any process may see (see gc.c.)
+ */
+struct heap {
+	struct activation	*a_head;	/* young */
+	struct s_value		*sv_head;
+	struct activation	*old_a_head;
+	struct s_value		*old_sv_head;
+	size_t			 bytes;		/* young (see gc.c) */
+	size_t			 target;	/* collect when bytes passes */
+	size_t			 nursery;	/* what target is, after one */
+	size_t			 old_bytes;
+	size_t			 old_target;	/* collect old when it passes */
+	int			 growth;	/* percent, over old_bytes */
+	long			 collected;	/* last major, in microseconds */
+	size_t			 live;		/* bytes marked in it, since */
+	struct worklist		 ar_written;	/* old, but written to */
+	struct worklist		 sv_written;
+	int			 marking;	/* incrementally, for a major */
+	int			 lazy;		/* left marked by gc() */
+	struct worklist		 grey;		/* found, not yet marked */
+};
+
+/*
+ * Every process embeds a heap, so what only the global heap needs,
+ * its segments, is kept apart from it (see gc.c.)
+ */
+extern struct heap global_heap;
+extern struct segment *global_unswept;	/* left marked by gc() */
+extern THREAD_LOCAL struct heap *current_heap;
+
+/*
+ * Count n more bytes, owned by something already in the current heap,
+ * against it.  What is allocated into the global heap directly is
+ * counted only as its records and values are.
+ */
+#define	HEAP_CHARGE(n)	do {						\
+		if (current_heap != &global_heap)			\
+			current_heap->bytes += (n);			\
+	} while (0)
+
+void			 heap_init(struct heap *);
+struct heap		*heap_enter(struct heap *);
+void			 heap_take(struct heap *, struct s_value *, size_t);
+void			 heap_free(struct heap *);
+
+void			 value_share(struct value);
+void			 activation_share(struct activation *);
+
+void			 value_barrier(struct s_value *, struct value);
+
+void			 gc_local(struct process *);
+void			 gc_step(struct process *);
+void			 gc_sweep(struct process *);
 void			 gc(void);
+
+#endif /* !__GC_H_ */
@@ -0,0 +1,295 @@
+/*
+ * gcstat.c
+ * What the garbage collector has done, counted as it goes.
+ *
+ * Always on, so it has to be cheap.  As it marks and sweeps, each
+ * thread counts what it marked and freed, by kind, in gcstat, which is
+ * its own, against the collection it is in; when the collection (or the
+ * thread's share of it) is over, gcstat_pause() adds that into the
+ * totals, under a lock, and notes how long it took.
+ *
+ * How long each pause took is kept in a histogram of buckets 1/16th of
+ * a power of two wide (the first sixteen are a microsecond each), which
+ * is to say the count of pauses of any length is kept to within about
+ * 6%, in a fixed amount of space, however many there are and however
+ * long they take.
+ *
+ * It is all written out by gcstat_dump(), at the end if asked to (see
+ * -T), and whenever the process gets a SIGUSR1, once a worker comes by
+ * to notice (see process.c); one record to a line, tab-separated, each
+ * kind of record described by a comment line before the first of them.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define	_POSIX_C_SOURCE	200112L	/* sigaction(), clock_gettime(), even with ANSI=1 */
+#endif
+
+#include <sys/types.h>
+
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gcstat.h"
+#include "thread.h"
+
+#define	SUB_BITS	4
+#define	SUBS		(1 << SUB_BITS)
+#define	BUCKETS		((40 - SUB_BITS + 1) * SUBS)
+
+struct pauses {
+	unsigned long	 count;
+	unsigned long	 total;		/* microseconds */
+	unsigned long	 max;
+	unsigned long	 bucket[BUCKETS];
+};
+
+THREAD_LOCAL struct gcstat_tally gcstat;
+volatile sig_atomic_t gcstat_wanted = 0;
+
+static bhuna_lock_t		 stat_lock = LOCK_INITIALIZER;
+static struct gcstat_counts	 totals[GCSTAT_COLLECTIONS];
+static struct pauses		 pauses[GCSTAT_PAUSES];
+static const char		*dump_path = NULL;
+static long			 started;
+
+static const char *pause_name[GCSTAT_PAUSES] = {
+	"minor", "major", "world", "exit", "step", "sweep"
+};
+
+static const char *kind_name[GCSTAT_KINDS] = {
+	"string", "list", "error", "closure", "dict", "activation"
+};
+
+static int
+bucket_of(unsigned long us)
+{
+	int e;
+
+	if (us < SUBS)
+		return((int)us);
+	for (e = SUB_BITS; e < 40 && (us >> (e + 1)) != 0; e++)
+		;
+	if (e == 40)
+		return(BUCKETS - 1);
+	return((e - SUB_BITS + 1) * SUBS +
+	    (int)((us >> (e - SUB_BITS)) & (SUBS - 1)));
+}
+
+/*
+ * The least number of microseconds counted in bucket b.
+ */
+static unsigned long
+bucket_floor(int b)
+{
+	if (b < SUBS)
+		return((unsigned long)b);
+	return((unsigned long)(SUBS + b % SUBS) << (b / SUBS - 1));
+}
+
+/*
+ * The most microseconds that at least pct percent of the pauses p
+ * counted took; to within the width of a bucket.
+ */
+static unsigned long
+percentile(struct pauses *p, int pct)
+{
+	unsigned long want, seen = 0;
+	int b;
+
+	want = (p->count * pct + 99) / 100;
+	for (b = 0; b < BUCKETS; b++) {
+		seen += p->bucket[b];
+		if (seen >= want)
+			break;
+	}
+	if (b >= BUCKETS - 1 || bucket_floor(b + 1) - 1 > p->max)
+		return(p->max);
+	return(bucket_floor(b + 1) - 1);
+}
+
+static void
+wanted(int sig)
+{
+	(void)sig;
+	gcstat_wanted = 1;
+}
+
+/*
+ * Start counting, and dump what has been counted to path (or, if it is
+ * NULL, stderr) on SIGUSR1.
+ */
+void
+gcstat_init(const char *path)
+{
+	struct sigaction sa;
+
+	dump_path = path;
+	started = gcstat_now();
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = wanted;
+	sigemptyset(&sa.sa_mask);
+#ifdef SA_RESTART
+	sa.sa_flags = SA_RESTART;
+#endif
+	sigaction(SIGUSR1, &sa, NULL);
+}
+
+long
+gcstat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return(ts.tv_sec * 1000000L + ts.tv_nsec / 1000);
+}
+
+static void
+flush(void)
+{
+	struct gcstat_counts *c, *t;
+	int i, k;
+
+	for (i = 0; i < GCSTAT_COLLECTIONS; i++) {
+		c = &gcstat.c[i];
+		t = &totals[i];
+		for (k = 0; k < GCSTAT_KINDS; k++) {
+			t->marked[k] += c->marked[k];
+			t->marked_bytes[k] += c->marked_bytes[k];
+			t->freed[k] += c->freed[k];
+			t->freed_bytes[k] += c->freed_bytes[k];
+		}
+	}
+	memset(gcstat.c, 0, sizeof(gcstat.c));
+}
+
+/*
+ * Add what this thread has counted into the totals.
+ */
+void
+gcstat_flush(void)
+{
+	LOCK(&stat_lock);
+	flush();
+	UNLOCK(&stat_lock);
+}
+
+/*
+ * Note that a pause for what took us microseconds, and add what this
+ * thread counted in it into the totals.
+ */
+void
+gcstat_pause(int what, long us)
+{
+	struct pauses *p = &pauses[what];
+
+	if (us < 0)
+		us = 0;
+	LOCK(&stat_lock);
+	flush();
+	p->count++;
+	p->total += us;
+	if ((unsigned long)us > p->max)
+		p->max = us;
+	p->bucket[bucket_of(us)]++;
+	UNLOCK(&stat_lock);
+}
+
+/*
+ * Dump, if a SIGUSR1 has come since the last time.
+ */
+void
+gcstat_poll(void)
+{
+	int dump;
+
+	LOCK(&stat_lock);
+	dump = gcstat_wanted;
+	gcstat_wanted = 0;
+	UNLOCK(&stat_lock);
+	if (dump)
+		gcstat_dump();
+}
+
+static void
+dump(FILE *f)
+{
+	struct pauses *p;
+	struct gcstat_counts *t;
+	size_t marked, freed;
+	int i, k, b;
+
+	fprintf(f, "# bhuna gc telemetry\tpid %ld\t%ld us since starting\n",
+	    (long)getpid(), gcstat_now() - started);
+
+	fprintf(f, "# pause\tfor\tcount\ttotal us\tmax us\t"
+	    "p50 us\tp90 us\tp99 us\n");
+	for (i = 0; i < GCSTAT_PAUSES; i++) {
+		p = &pauses[i];
+		fprintf(f, "pause\t%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\n",
+		    pause_name[i], p->count, p->total, p->max,
+		    percentile(p, 50), percentile(p, 90), percentile(p, 99));
+	}
+
+	fprintf(f, "# histogram\tfor\tfrom us\tbelow us\tcount\n");
+	for (i = 0; i < GCSTAT_PAUSES; i++) {
+		p = &pauses[i];
+		for (b = 0; b < BUCKETS; b++) {
+			if (p->bucket[b] == 0)
+				continue;
+			fprintf(f, "histogram\t%s\t%lu\t%lu\t%lu\n",
+			    pause_name[i], bucket_floor(b),
+			    bucket_floor(b + 1), p->bucket[b]);
+		}
+	}
+
+	fprintf(f, "# kind\tcollection\tkind\tmarked\tmarked bytes\t"
+	    "freed\tfreed bytes\n");
+	for (i = 0; i < GCSTAT_COLLECTIONS; i++) {
+		t = &totals[i];
+		for (k = 0; k < GCSTAT_KINDS; k++) {
+			fprintf(f, "kind\t%s\t%s\t%lu\t%lu\t%lu\t%lu\n",
+			    pause_name[i], kind_name[k],
+			    t->marked[k], (unsigned long)t->marked_bytes[k],
+			    t->freed[k], (unsigned long)t->freed_bytes[k]);
+		}
+	}
+
+	fprintf(f, "# survival\tcollection\tmarked bytes\tfreed bytes\t"
+	    "ratio\n");
+	for (i = 0; i < GCSTAT_COLLECTIONS; i++) {
+		t = &totals[i];
+		marked = freed = 0;
+		for (k = 0; k < GCSTAT_KINDS; k++) {
+			marked += t->marked_bytes[k];
+			freed += t->freed_bytes[k];
+		}
+		fprintf(f, "survival\t%s\t%lu\t%lu\t%.4f\n", pause_name[i],
+		    (unsigned long)marked, (unsigned long)freed,
+		    marked + freed == 0 ? 0.0 :
+		    (double)marked / (double)(marked + freed));
+	}
+}
+
+/*
+ * Write out everything counted so far, over what was written last.
+ */
+void
+gcstat_dump(void)
+{
+	FILE *f = stderr;
+
+	if (dump_path != NULL && (f = fopen(dump_path, "w")) == NULL) {
+		perror(dump_path);
+		return;
+	}
+	LOCK(&stat_lock);
+	dump(f);
+	UNLOCK(&stat_lock);
+	if (f != stderr)
+		fclose(f);
+	else
+		fflush(f);
+}
@@ -0,0 +1,74 @@
+/*
+ * gcstat.h
+ * What the garbage collector has done, counted as it goes.
+ */
+
+#ifndef __GCSTAT_H_
+#define __GCSTAT_H_
+
+#include <sys/types.h>
+
+#include <signal.h>
+
+#include "thread.h"
+
+/*
+ * What a pause was for.  What is marked and freed is counted against
+ * the first four, the collections: an incremental step counts towards
+ * a major collection, and a lazy sweep towards the stop-the-world one
+ * which left it, but each is timed on its own.
+ */
+#define	GCSTAT_MINOR	0	/* a process's young generation */
+#define	GCSTAT_MAJOR	1	/* all of a process's heap */
+#define	GCSTAT_WORLD	2	/* every heap, the world stopped */
+#define	GCSTAT_EXIT	3	/* the heap of a process which ended */
+#define	GCSTAT_STEP	4	/* some of an incremental major */
+#define	GCSTAT_SWEEP	5	/* some of what WORLD left to sweep */
+
+#define	GCSTAT_COLLECTIONS	4
+#define	GCSTAT_PAUSES		6
+
+/*
+ * What was marked or freed: a structured value, by its type less
+ * VALUE_STRUCTURED (see value.h), or an activation record.
+ */
+#define	GCSTAT_KIND(type)	((type) & 7)
+#define	GCSTAT_AR		5
+#define	GCSTAT_KINDS		6
+
+struct gcstat_counts {
+	unsigned long	 marked[GCSTAT_KINDS];
+	size_t		 marked_bytes[GCSTAT_KINDS];
+	unsigned long	 freed[GCSTAT_KINDS];
+	size_t		 freed_bytes[GCSTAT_KINDS];
+};
+
+/*
+ * What this thread has counted since it last called gcstat_pause(),
+ * against the collection it is in.
+ */
+struct gcstat_tally {
+	int			 in;	/* GCSTAT_MINOR etc. */
+	struct gcstat_counts	 c[GCSTAT_COLLECTIONS];
+};
+
+extern THREAD_LOCAL struct gcstat_tally gcstat;
+
+#define	GCSTAT_IN(what)		(gcstat.in = (what))
+#define	GCSTAT_MARKED(kind, n)						\
+	(gcstat.c[gcstat.in].marked[kind]++,				\
+	 gcstat.c[gcstat.in].marked_bytes[kind] += (n))
+#define	GCSTAT_FREED(kind, n)						\
+	(gcstat.c[gcstat.in].freed[kind]++,				\
+	 gcstat.c[gcstat.in].freed_bytes[kind] += (n))
+
+extern volatile sig_atomic_t gcstat_wanted;
+
+void		 gcstat_init(const char *);
+long		 gcstat_now(void);
+void		 gcstat_flush(void);
+void		 gcstat_pause(int, long);
+void		 gcstat_poll(void);
+void		 gcstat_dump(void);
+
+#endif
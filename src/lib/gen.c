@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mem.h"
 #include "vm.h"
 #include "ast.h"
 #include "value.h"
@@ -328,65 +329,86 @@ ast_gen(vm_label_t *given_prog, struct ast *a)
 	*gptr++ = INSTR_HALT;
 }
 
-#else
-#define gen(x)	*gptr++ = x
 #endif
 
 /*** gen VM from iprogram ***/
 
-void
-iprogram_gen(vm_label_t *given_prog, struct iprogram *ip)
+static void
+gen_opcode(int opcode)
+{
+#ifdef DIRECT_THREADING
+	void **table = vm_dispatch_table();
+	void **hptr = (void **)gptr;
+	struct builtin **biptr;
+
+	if (table[opcode] == NULL) {
+		/*
+		 * A builtin with no handler of its own in vm_run();
+		 * thread it through INSTR_EXTERNAL, which calls it
+		 * through the builtin pointer that follows.
+		 */
+		assert(opcode <= INDEX_BUILTIN_LAST);
+		*hptr++ = table[INSTR_EXTERNAL];
+		biptr = (struct builtin **)hptr;
+		*biptr++ = &builtins[opcode];
+		gptr = (vm_label_t)biptr;
+		return;
+	}
+	*hptr++ = table[opcode];
+	gptr = (vm_label_t)hptr;
+#else
+	*gptr++ = (unsigned char)opcode;
+#endif
+}
+
+/*
+ * Return an upper bound on the size of the vm program that
+ * iprogram_gen() will generate from the given iprogram.
+ */
+size_t
+iprogram_gen_size(struct iprogram *ip)
 {
 	struct icode *ic;
-	struct {
-		vm_label_t label;
-		struct icode *icode;
-	} bp[2048];
-	int bpi = 0;
-	struct closure *k[2048];
-	int ki = 0;
-        struct value *vptr;
-        struct builtin **biptr;
+	size_t size = 0;
+
+	for (ic = ip->head; ic != NULL; ic = ic->next)
+		size += sizeof(vm_opcode_t) + sizeof(struct value) + sizeof(vm_label_t);
+
+	return(size);
+}
+
+/*
+ * Branches to backpatch, and closures whose labels to resolve,
+ * once the whole program has been generated.
+ */
+static struct backpatch {
+	vm_label_t label;
+	struct icode *icode;
+} *bp;
+static int bpi;
+static struct closure **k;
+static int ki;
+
+static void
+gen_start(vm_label_t *given_prog, struct iprogram *ip)
+{
+	struct icode *ic;
+	int n = 0;
+
+	for (ic = ip->head; ic != NULL; ic = ic->next)
+		n++;
+	bp = bhuna_malloc(sizeof(struct backpatch) * n);
+	bpi = 0;
+	k = bhuna_malloc(sizeof(struct closure *) * n);
+	ki = 0;
 
 	program = *given_prog;
 	gptr = *given_prog;
+}
 
-	for (ic = ip->head; ic != NULL; ic = ic->next) {
-		ic->label = gptr;
-		gen(ic->opcode);
-		switch (ic->opcode) {
-		case INSTR_PUSH_VALUE:
-			if (ic->operand.value.type == VALUE_CLOSURE) {
-				k[ki++] = ic->operand.value.v.s->v.k;
-			}
-                        vptr = (struct value *)gptr;
-			*vptr = ic->operand.value;
-                        vptr++;
-                        gptr = (vm_label_t)vptr;
-			break;
-		case INSTR_PUSH_LOCAL:
-		case INSTR_POP_LOCAL:
-		case INSTR_COW_LOCAL:
-		case INSTR_INIT_LOCAL:
-			*gptr++ = (unsigned char)ic->operand.local.index;
-			*gptr++ = (unsigned char)ic->operand.local.upcount;
-			break;
-		case INSTR_JZ:
-		case INSTR_JMP:
-			bp[bpi].label = gptr;
-			bp[bpi].icode = ic->operand.branch;
-			bpi++;
-			gptr += sizeof(vm_label_t);
-			break;
-		case INSTR_EXTERNAL:
-                        biptr = (struct builtin **)gptr;
-			*biptr = ic->operand.builtin;
-                        biptr++;
-                        gptr = (vm_label_t)biptr;
-			break;
-		}
-	}
-
+static void
+gen_finish(void)
+{
 	/* Backpatching run. */
 	bpi--;
 	while (bpi >= 0) {
@@ -400,4 +422,333 @@ iprogram_gen(vm_label_t *given_prog, struct iprogram *ip)
 		k[ki]->label = k[ki]->icode->label;
 		ki--;
 	}
+
+	bhuna_free(bp);
+	bhuna_free(k);
+}
+
+static void
+gen_branch(struct icode *target)
+{
+	bp[bpi].label = gptr;
+	bp[bpi].icode = target;
+	bpi++;
+	gptr += sizeof(vm_label_t);
+}
+
+/*
+ * Generate the stack machine instruction for a single icode.
+ */
+static void
+gen_icode(struct icode *ic)
+{
+        struct value *vptr;
+        struct builtin **biptr;
+
+	gen_opcode(ic->opcode);
+	switch (ic->opcode) {
+	case INSTR_PUSH_VALUE:
+		if (V_TYPE(ic->operand.value) == VALUE_CLOSURE) {
+			k[ki++] = V_SV(ic->operand.value)->v.k;
+		}
+                vptr = (struct value *)gptr;
+		*vptr = ic->operand.value;
+                vptr++;
+                gptr = (vm_label_t)vptr;
+		break;
+	case INSTR_PUSH_LOCAL:
+	case INSTR_POP_LOCAL:
+	case INSTR_COW_LOCAL:
+	case INSTR_INIT_LOCAL:
+		*gptr++ = (unsigned char)ic->operand.local.index;
+		*gptr++ = (unsigned char)ic->operand.local.upcount;
+		break;
+	case INSTR_EXTERNAL:
+                biptr = (struct builtin **)gptr;
+		*biptr = ic->operand.builtin;
+                biptr++;
+                gptr = (vm_label_t)biptr;
+		break;
+	case INSTR_PUSH_LOCAL2:
+	case INSTR_EQU_LOCAL_LOCAL_JZ:
+	case INSTR_NEQ_LOCAL_LOCAL_JZ:
+	case INSTR_GT_LOCAL_LOCAL_JZ:
+	case INSTR_LT_LOCAL_LOCAL_JZ:
+	case INSTR_GTE_LOCAL_LOCAL_JZ:
+	case INSTR_LTE_LOCAL_LOCAL_JZ:
+		*gptr++ = (unsigned char)ic->fused.local[0].index;
+		*gptr++ = (unsigned char)ic->fused.local[0].upcount;
+		*gptr++ = (unsigned char)ic->fused.local[1].index;
+		*gptr++ = (unsigned char)ic->fused.local[1].upcount;
+		break;
+	case INSTR_ADD_LOCAL_IMM:
+	case INSTR_EQU_LOCAL_IMM_JZ:
+	case INSTR_NEQ_LOCAL_IMM_JZ:
+	case INSTR_GT_LOCAL_IMM_JZ:
+	case INSTR_LT_LOCAL_IMM_JZ:
+	case INSTR_GTE_LOCAL_IMM_JZ:
+	case INSTR_LTE_LOCAL_IMM_JZ:
+		*gptr++ = (unsigned char)ic->fused.local[0].index;
+		*gptr++ = (unsigned char)ic->fused.local[0].upcount;
+		*(int *)gptr = ic->fused.imm;
+		gptr += sizeof(int);
+		break;
+	}
+	if (icode_is_branch(ic))
+		gen_branch(ic->operand.branch);
+}
+
+void
+iprogram_gen(vm_label_t *given_prog, struct iprogram *ip)
+{
+	struct icode *ic;
+
+	gen_start(given_prog, ip);
+	for (ic = ip->head; ic != NULL; ic = ic->next) {
+		ic->label = gptr;
+		gen_icode(ic);
+	}
+	gen_finish();
+}
+
+/*** gen register-machine code from iprogram ***/
+
+/*
+ * Pushes of locals and small constants are not generated right away;
+ * they are held here, and when the instruction that consumes them comes
+ * along, it is generated in register form, naming them as its operands
+ * directly.  Anything left over is generated as ordinary pushes.
+ * Values on the stack at runtime are always below the pending ones.
+ */
+#define MAX_PENDING	16
+
+static struct icode *pending[MAX_PENDING];
+static int npending;
+
+static int
+reg_small_int(struct icode *ic, int *i)
+{
+	switch (ic->opcode) {
+	case INSTR_PUSH_ZERO:
+		*i = 0;
+		return(1);
+	case INSTR_PUSH_ONE:
+		*i = 1;
+		return(1);
+	case INSTR_PUSH_TWO:
+		*i = 2;
+		return(1);
+	case INSTR_PUSH_VALUE:
+		if (V_TYPE(ic->operand.value) == VALUE_INTEGER &&
+		    V_INT(ic->operand.value) >= -128 &&
+		    V_INT(ic->operand.value) <= 127) {
+			*i = V_INT(ic->operand.value);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Generate the oldest n pending pushes as stack instructions.
+ */
+static void
+reg_flush(int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		gen_icode(pending[i]);
+	for (i = n; i < npending; i++)
+		pending[i - n] = pending[i];
+	npending -= n;
+}
+
+/*
+ * Generate an operand: the newest pending push if there is one,
+ * otherwise the top of the stack.
+ */
+static void
+reg_operand(void)
+{
+	struct icode *ic;
+	int i;
+
+	if (npending == 0) {
+		*gptr++ = 0;
+		*gptr++ = REG_STACK;
+		return;
+	}
+	ic = pending[--npending];
+	if (ic->opcode == INSTR_PUSH_LOCAL) {
+		*gptr++ = (unsigned char)ic->operand.local.index;
+		*gptr++ = (unsigned char)ic->operand.local.upcount;
+	} else {
+		reg_small_int(ic, &i);
+		*gptr++ = (unsigned char)(signed char)i;
+		*gptr++ = REG_CONST;
+	}
+}
+
+/*
+ * Generate a register instruction with the given destination
+ * (a local, or the stack if dest is NULL) and arity sources.
+ * The sources are generated last-first, which is also the order
+ * they will be popped in if they come from the stack; so for
+ * INSTR_R_SUB D A B, B is generated before A but read first.
+ */
+static void
+reg_gen(int opcode, struct icode *dest, int arity)
+{
+	vm_label_t operands;
+	unsigned char t[2];
+	int i;
+
+	/* pushes below our operands must happen first */
+	if (npending > arity)
+		reg_flush(npending - arity);
+
+	gen_opcode(opcode);
+	if (opcode < INSTR_R_JZ) {
+		if (dest == NULL) {
+			*gptr++ = 0;
+			*gptr++ = REG_STACK;
+		} else {
+			*gptr++ = (unsigned char)dest->operand.local.index;
+			*gptr++ = (unsigned char)(dest->opcode == INSTR_INIT_LOCAL ?
+			    0 : dest->operand.local.upcount);
+		}
+	}
+	operands = gptr;
+	for (i = 0; i < arity; i++)
+		reg_operand();
+	if (arity == 2) {
+		/* put them in A B order */
+		t[0] = operands[0];
+		t[1] = operands[1];
+		operands[0] = operands[2];
+		operands[1] = operands[3];
+		operands[2] = t[0];
+		operands[3] = t[1];
+	}
+}
+
+#ifdef INLINE_BUILTINS
+/*
+ * If the icode following ic stores the result of ic in a local,
+ * and nothing branches to it, return it.
+ */
+static struct icode *
+reg_dest(struct icode *ic)
+{
+	struct icode *n = ic->next;
+
+	if (n != NULL && n->referrers == NULL &&
+	    (n->opcode == INSTR_POP_LOCAL || n->opcode == INSTR_INIT_LOCAL))
+		return(n);
+	return(NULL);
+}
+#endif
+
+void
+iprogram_gen_registers(vm_label_t *given_prog, struct iprogram *ip)
+{
+	struct icode *ic;
+	int i;
+#ifdef INLINE_BUILTINS
+	struct icode *dest;
+	int arity;
+#endif
+
+	gen_start(given_prog, ip);
+	npending = 0;
+
+	for (ic = ip->head; ic != NULL; ic = ic->next) {
+		/*
+		 * Every path into a branch target must leave the
+		 * stack in the same state, so nothing can be pending.
+		 */
+		if (ic->referrers != NULL)
+			reg_flush(npending);
+		ic->label = gptr;
+
+		if (ic->opcode == INSTR_PUSH_LOCAL || reg_small_int(ic, &i)) {
+			if (npending == MAX_PENDING)
+				reg_flush(1);
+			pending[npending++] = ic;
+			continue;
+		}
+
+		switch (ic->opcode) {
+		case INSTR_POP_LOCAL:
+		case INSTR_INIT_LOCAL:
+			if (npending == 0)
+				break;
+			reg_gen(INSTR_R_MOVE, ic, 1);
+			continue;
+		case INSTR_JZ:
+			if (npending == 0)
+				break;
+			reg_gen(INSTR_R_JZ, NULL, 1);
+			gen_branch(ic->operand.branch);
+			continue;
+#ifdef INLINE_BUILTINS
+		case INDEX_BUILTIN_EQU:
+		case INDEX_BUILTIN_NEQ:
+		case INDEX_BUILTIN_GT:
+		case INDEX_BUILTIN_LT:
+		case INDEX_BUILTIN_GTE:
+		case INDEX_BUILTIN_LTE:
+		case INSTR_IEQU:
+		case INSTR_INEQ:
+		case INSTR_IGT:
+		case INSTR_ILT:
+		case INSTR_IGTE:
+		case INSTR_ILTE:
+			if (ic->next != NULL && ic->next->referrers == NULL &&
+			    ic->next->opcode == INSTR_JZ) {
+				reg_gen(INSTR_R_EQU_JZ +
+				    (icode_builtin_index(ic) - INDEX_BUILTIN_EQU),
+				    NULL, 2);
+				ic = ic->next;
+				ic->label = gptr;
+				gen_branch(ic->operand.branch);
+				continue;
+			}
+			/* FALLTHROUGH */
+		case INDEX_BUILTIN_NOT:
+		case INDEX_BUILTIN_AND:
+		case INDEX_BUILTIN_OR:
+		case INDEX_BUILTIN_ADD:
+		case INDEX_BUILTIN_SUB:
+		case INDEX_BUILTIN_MUL:
+		case INDEX_BUILTIN_DIV:
+		case INDEX_BUILTIN_MOD:
+		case INSTR_IADD:
+		case INSTR_ISUB:
+		case INSTR_IMUL:
+			/*
+			 * Only worth it if it saves a push or a pop.
+			 * (The register instructions check their operands'
+			 * types whether or not the icode was unchecked;
+			 * the check is cheap next to decoding operands.)
+			 */
+			dest = reg_dest(ic);
+			if (npending == 0 && dest == NULL)
+				break;
+			arity = ic->opcode == INDEX_BUILTIN_NOT ? 1 : 2;
+			reg_gen(INSTR_R_MOVE + icode_builtin_index(ic), dest, arity);
+			if (dest != NULL) {
+				ic = ic->next;
+				ic->label = gptr;
+			}
+			continue;
+#endif
+		}
+
+		reg_flush(npending);
+		gen_icode(ic);
+	}
+
+	gen_finish();
 }
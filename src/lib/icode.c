@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -9,6 +10,7 @@
 #include "builtin.h"
 #include "value.h"
 #include "closure.h"
+#include "type.h"
 #include "utf8.h"
 
 /*** iprograms ***/
@@ -70,6 +72,8 @@ icode_new(struct iprogram *ip, int opcode)
 	ic->opcode = opcode;
 	ic->referrers = NULL;
 	ic->label = NULL;
+	ic->native = NULL;
+	ic->stub = NULL;
 
 	/* leave operand unitialized */
 
@@ -142,7 +146,7 @@ icode_free(struct iprogram *ip, struct icode *ic)
 
 	if (ic == NULL) return;
 
-	if (ic->opcode == INSTR_JMP || ic->opcode == INSTR_JZ) {
+	if (icode_is_branch(ic)) {
 		referrer_unwire(ic, ic->operand.branch);
 	}
 
@@ -168,6 +172,31 @@ icode_free(struct iprogram *ip, struct icode *ic)
 
 /*** util ***/
 
+/*
+ * Return nonzero if the icode's operand.branch refers to another icode.
+ */
+int
+icode_is_branch(struct icode *ic)
+{
+	return(ic->opcode == INSTR_JMP || ic->opcode == INSTR_JZ ||
+	    (ic->opcode >= INSTR_EQU_LOCAL_IMM_JZ &&
+	     ic->opcode <= INSTR_LTE_LOCAL_LOCAL_JZ));
+}
+
+/*
+ * If the icode performs an inline builtin, checked or not, return
+ * the builtin's index; otherwise return -1.
+ */
+int
+icode_builtin_index(struct icode *ic)
+{
+	if (ic->opcode < INSTR_HALT)
+		return(ic->opcode);
+	if (ic->opcode >= INSTR_IEQU && ic->opcode <= INSTR_IMUL)
+		return(ic->opcode - INSTR_IEQU + INDEX_BUILTIN_EQU);
+	return(-1);
+}
+
 void
 icode_set_branch(struct icode *ic, struct icode *branch)
 {
@@ -196,11 +225,51 @@ icode_set_closure_entry_point(struct closure *k, struct icode *ic)
 
 /*************** intermediate code generator ****************/
 
+#ifdef INLINE_BUILTINS
+/*
+ * Return nonzero if type inference has proven that the expression
+ * evaluates to an integer, and ast_find_errors() that it can't be an
+ * error standing in for one.
+ */
+static int
+ast_is_integer(struct ast *a)
+{
+	return(a != NULL && a->datatype != NULL && !a->may_err &&
+	    type_representative(a->datatype)->tclass == TYPE_INTEGER);
+}
+#endif
+
+/*
+ * If the given builtin application is integer arithmetic or comparison
+ * on operands proven to be integers, return the unchecked instruction
+ * for it; otherwise return -1.  (EQU and NEQ are polymorphic, so this
+ * leaves them checked wherever their operands might not be integers.)
+ */
+static int
+ast_unchecked_opcode(struct ast *a)
+{
+#ifdef INLINE_BUILTINS
+	struct ast *args = a->u.builtin.right;
+	int index = a->u.builtin.bi->index;
+
+	if (index >= INDEX_BUILTIN_EQU && index <= INDEX_BUILTIN_MUL &&
+	    args != NULL && args->type == AST_ARG &&
+	    args->u.arg.right != NULL && args->u.arg.right->type == AST_ARG &&
+	    ast_is_integer(args->u.arg.left) &&
+	    ast_is_integer(args->u.arg.right->u.arg.left))
+		return(INSTR_IEQU + (index - INDEX_BUILTIN_EQU));
+#else
+	(void)a;
+#endif
+	return(-1);
+}
+
 static void
 ast_gen_r(struct iprogram *ip, struct ast *a)
 {
 	struct icode *ic1, *ic2, *ic3, *ic4;
 	struct value v;
+	int opcode;
 
 	if (a == NULL)
 		return;
@@ -213,12 +282,14 @@ ast_gen_r(struct iprogram *ip, struct ast *a)
 		break;
 	case AST_VALUE:
 		icode_new_value(ip, INSTR_PUSH_VALUE, a->u.value.value);
-		if (a->u.value.value.type == VALUE_CLOSURE) {
+		if (V_TYPE(a->u.value.value) == VALUE_CLOSURE) {
 			icode_new(ip, INSTR_SET_ACTIVATION);
 			ic1 = icode_new(ip, INSTR_JMP);
 			ic2 = icode_new(ip, INSTR_NOP);
-			icode_set_closure_entry_point(a->u.value.value.v.s->v.k, ic2);
-			ast_gen_r(ip, a->u.value.value.v.s->v.k->ast);
+			icode_set_closure_entry_point(V_SV(a->u.value.value)->v.k, ic2);
+			V_SV(a->u.value.value)->v.k->need =
+			    ast_stack_need(V_SV(a->u.value.value)->v.k->ast);
+			ast_gen_r(ip, V_SV(a->u.value.value)->v.k->ast);
 			icode_new(ip, INSTR_RET);
 			ic3 = icode_new(ip, INSTR_NOP);
 			icode_set_branch(ic1, ic3);
@@ -238,7 +309,9 @@ ast_gen_r(struct iprogram *ip, struct ast *a)
 			value_deregister(v);
 			icode_new_value(ip, INSTR_PUSH_VALUE, v);
 		}
-		icode_new_builtin(ip, a->u.builtin.bi);
+		ic1 = icode_new_builtin(ip, a->u.builtin.bi);
+		if ((opcode = ast_unchecked_opcode(a)) != -1)
+			ic1->opcode = opcode;
 		break;
 	case AST_APPLY:
 		ast_gen_r(ip, a->u.apply.right);
@@ -329,6 +402,49 @@ icode_addr(struct icode *ic, vm_label_t program)
 	return(s);
 }
 	
+static const char *instr_names[] = {
+	"HALT", "PUSH_VALUE", "PUSH_LOCAL", "POP_LOCAL", "JZ", "JMP",
+	"CALL", "RET", "GOTO", "SET_ACTIVATION", "COW_LOCAL", "EXTERNAL",
+	"NOP", "PUSH_ZERO", "PUSH_ONE", "PUSH_TWO", "INIT_LOCAL",
+	"PUSH_LOCAL2", "ADD_LOCAL_IMM",
+	"EQU_LOCAL_IMM_JZ", "NEQ_LOCAL_IMM_JZ", "GT_LOCAL_IMM_JZ",
+	"LT_LOCAL_IMM_JZ", "GTE_LOCAL_IMM_JZ", "LTE_LOCAL_IMM_JZ",
+	"EQU_LOCAL_LOCAL_JZ", "NEQ_LOCAL_LOCAL_JZ", "GT_LOCAL_LOCAL_JZ",
+	"LT_LOCAL_LOCAL_JZ", "GTE_LOCAL_LOCAL_JZ", "LTE_LOCAL_LOCAL_JZ"
+};
+
+static const char *reg_instr_names[] = {
+	"R_MOVE", "R_NOT", "R_AND", "R_OR", "R_EQU", "R_NEQ", "R_GT", "R_LT",
+	"R_GTE", "R_LTE", "R_ADD", "R_SUB", "R_MUL", "R_DIV", "R_MOD", "R_JZ",
+	"R_EQU_JZ", "R_NEQ_JZ", "R_GT_JZ", "R_LT_JZ", "R_GTE_JZ", "R_LTE_JZ"
+};
+
+static const char *int_instr_names[] = {
+	"IEQU", "INEQ", "IGT", "ILT", "IGTE", "ILTE", "IADD", "ISUB", "IMUL"
+};
+
+/*
+ * Print the mnemonic (only) of the given opcode.
+ */
+void
+opcode_print(int opcode)
+{
+	if (opcode >= INSTR_HALT &&
+	    opcode < INSTR_HALT + (int)(sizeof(instr_names) / sizeof(instr_names[0]))) {
+		printf("%s", instr_names[opcode - INSTR_HALT]);
+	} else if (opcode >= INSTR_R_MOVE && opcode <= INSTR_R_LTE_JZ) {
+		printf("%s", reg_instr_names[opcode - INSTR_R_MOVE]);
+	} else if (opcode >= INSTR_IEQU && opcode <= INSTR_IMUL) {
+		printf("%s", int_instr_names[opcode - INSTR_IEQU]);
+	} else if (opcode < INSTR_HALT) {
+		printf("BUILTIN `");
+		fputsu8(stdout, builtins[opcode].name);
+		printf("'");
+	} else {
+		printf("?%d", opcode);
+	}
+}
+
 void
 iprogram_dump(struct iprogram *ip, vm_label_t program)
 {
@@ -350,70 +466,49 @@ iprogram_dump(struct iprogram *ip, vm_label_t program)
 			}
 			printf("} ");
 		}
+		opcode_print(ic->opcode);
 		switch (ic->opcode) {
-		case INSTR_HALT:
-			printf("HALT");
-			break;
-		case INSTR_PUSH_ZERO:
-			printf("PUSH_ZERO");
-			break;
-		case INSTR_PUSH_ONE:
-			printf("PUSH_ONE");
-			break;
-		case INSTR_PUSH_TWO:
-			printf("PUSH_TWO");
-			break;
 		case INSTR_PUSH_VALUE:
-			printf("PUSH_VALUE ");
+			printf(" ");
 			value_print(ic->operand.value);
 			break;
 		case INSTR_PUSH_LOCAL:
-			printf("PUSH_LOCAL (%d,%d)",
-			    ic->operand.local.index, ic->operand.local.upcount);
-			break;
 		case INSTR_POP_LOCAL:
-			printf("POP_LOCAL (%d,%d)",
-			    ic->operand.local.index, ic->operand.local.upcount);
-			break;
 		case INSTR_INIT_LOCAL:
-			printf("INIT_LOCAL (%d,%d)",
-			    ic->operand.local.index, ic->operand.local.upcount);
-			break;
-		case INSTR_JZ:
-			printf("JZ %s", icode_addr(ic->operand.branch, program));
-			break;
-		case INSTR_JMP:
-			printf("JMP %s", icode_addr(ic->operand.branch, program));
-			break;
-		case INSTR_CALL:
-			printf("CALL");
-			break;
-		case INSTR_RET:
-			printf("RET");
-			break;
-		case INSTR_GOTO:
-			printf("GOTO");
-			break;
-		case INSTR_SET_ACTIVATION:
-			printf("SET_ACTIVATION");
-			break;
 		case INSTR_COW_LOCAL:
-			printf("COW_LOCAL (%d,%d)",
+			printf(" (%d,%d)",
 			    ic->operand.local.index, ic->operand.local.upcount);
+			break;
 		case INSTR_EXTERNAL:
-			printf("EXTERNAL `"),
+			printf(" `");
 			fputsu8(stdout, ic->operand.builtin->name);
 			printf("'");
 			break;
-		case INSTR_NOP:
-			printf("NOP");
+		case INSTR_PUSH_LOCAL2:
+		case INSTR_EQU_LOCAL_LOCAL_JZ:
+		case INSTR_NEQ_LOCAL_LOCAL_JZ:
+		case INSTR_GT_LOCAL_LOCAL_JZ:
+		case INSTR_LT_LOCAL_LOCAL_JZ:
+		case INSTR_GTE_LOCAL_LOCAL_JZ:
+		case INSTR_LTE_LOCAL_LOCAL_JZ:
+			printf(" (%d,%d) (%d,%d)",
+			    ic->fused.local[0].index, ic->fused.local[0].upcount,
+			    ic->fused.local[1].index, ic->fused.local[1].upcount);
+			break;
+		case INSTR_ADD_LOCAL_IMM:
+		case INSTR_EQU_LOCAL_IMM_JZ:
+		case INSTR_NEQ_LOCAL_IMM_JZ:
+		case INSTR_GT_LOCAL_IMM_JZ:
+		case INSTR_LT_LOCAL_IMM_JZ:
+		case INSTR_GTE_LOCAL_IMM_JZ:
+		case INSTR_LTE_LOCAL_IMM_JZ:
+			printf(" (%d,%d) %d",
+			    ic->fused.local[0].index, ic->fused.local[0].upcount,
+			    ic->fused.imm);
 			break;
-
-		default:
-			printf("BUILTIN `");
-			fputsu8(stdout, builtins[ic->opcode].name);
-			printf("'");
 		}
+		if (icode_is_branch(ic))
+			printf(" %s", icode_addr(ic->operand.branch, program));
 		printf("\n");
 	}
 }
@@ -528,8 +623,8 @@ iprogram_optimize_push_small_ints(struct iprogram *ip)
 	for (ic = ip->head; ic != NULL; ic = ic_next) {
 		ic_next = ic->next;
 		if (ic->opcode == INSTR_PUSH_VALUE &&
-		    ic->operand.value.type == VALUE_INTEGER) {
-			switch (ic->operand.value.v.i) {
+		    V_TYPE(ic->operand.value) == VALUE_INTEGER) {
+			switch (V_INT(ic->operand.value)) {
 			case 0:
 				ic->opcode = INSTR_PUSH_ZERO;
 				break;
@@ -570,3 +665,135 @@ iprogram_eliminate_useless_jumps(struct iprogram *ip)
 		}
 	}
 }
+
+/*
+ * If the icode pushes a small integer constant, store it in *imm
+ * and return nonzero.
+ */
+static int
+icode_get_imm(struct icode *ic, int *imm)
+{
+	switch (ic->opcode) {
+	case INSTR_PUSH_ZERO:
+		*imm = 0;
+		return(1);
+	case INSTR_PUSH_ONE:
+		*imm = 1;
+		return(1);
+	case INSTR_PUSH_TWO:
+		*imm = 2;
+		return(1);
+	case INSTR_PUSH_VALUE:
+		if (V_TYPE(ic->operand.value) == VALUE_INTEGER) {
+			*imm = V_INT(ic->operand.value);
+			return(1);
+		}
+	}
+	return(0);
+}
+
+/*
+ * Return nonzero if the icode adds or subtracts the top two values.
+ * (Subtracting INT_MIN can't be turned into adding its negation.)
+ */
+static int
+icode_is_add(struct icode *ic)
+{
+	int imm;
+
+	if (icode_builtin_index(ic) == INDEX_BUILTIN_ADD)
+		return(1);
+	return(icode_builtin_index(ic) == INDEX_BUILTIN_SUB &&
+	    !(icode_get_imm(ic->prev, &imm) && imm == INT_MIN));
+}
+
+/*
+ * Return nonzero if the n icodes following ic exist and
+ * nothing branches into them, i.e. they can be folded into ic.
+ */
+static int
+icode_fusable(struct icode *ic, int n)
+{
+	for (; n > 0; n--) {
+		ic = ic->next;
+		if (ic == NULL || ic->referrers != NULL)
+			return(0);
+	}
+	return(1);
+}
+
+/*
+ * Turn ic into the given superinstruction, absorbing the n icodes
+ * which follow it.  If the last of those is a JZ, ic takes over its
+ * branch.
+ */
+static void
+icode_fuse(struct iprogram *ip, struct icode *ic, int opcode, int n)
+{
+	struct icode *last;
+
+	for (last = ic; n > 0; n--)
+		last = last->next;
+	ic->opcode = opcode;
+	if (last->opcode == INSTR_JZ)
+		icode_set_branch(ic, last->operand.branch);
+	while (ic->next != last)
+		icode_free(ip, ic->next);
+	icode_free(ip, last);
+}
+
+/*
+ * Replace common sequences with superinstructions.  The set was
+ * chosen from the pair and triple counts dumped by -f (in a DEBUG
+ * build) on the programs in eg/: nearly all the time goes into
+ * comparing a local against a constant or another local and
+ * branching, and into stepping a local by a constant.
+ * This should run after all other optimizations.
+ */
+void
+iprogram_fuse_superinstructions(struct iprogram *ip)
+{
+	struct icode *ic, *n1, *n2, *n3;
+	int imm, local2, bi;
+
+	for (ic = ip->head; ic != NULL; ic = ic->next) {
+		if (ic->opcode != INSTR_PUSH_LOCAL || !icode_fusable(ic, 1))
+			continue;
+		n1 = ic->next;
+		imm = 0;
+		if (n1->opcode == INSTR_PUSH_LOCAL)
+			local2 = 1;
+		else if (icode_get_imm(n1, &imm))
+			local2 = 0;
+		else
+			continue;
+
+		ic->fused.local[0].index = ic->operand.local.index;
+		ic->fused.local[0].upcount = ic->operand.local.upcount;
+		ic->fused.local[1].index = n1->operand.local.index;
+		ic->fused.local[1].upcount = n1->operand.local.upcount;
+		ic->fused.imm = imm;
+
+		n2 = n1->next;
+		n3 = n2 != NULL ? n2->next : NULL;
+		bi = n2 != NULL ? icode_builtin_index(n2) : -1;
+		if (icode_fusable(ic, 3) &&
+		    bi >= INDEX_BUILTIN_EQU && bi <= INDEX_BUILTIN_LTE &&
+		    n3->opcode == INSTR_JZ) {
+			icode_fuse(ip, ic, (local2 ?
+			    INSTR_EQU_LOCAL_LOCAL_JZ : INSTR_EQU_LOCAL_IMM_JZ) +
+			    (bi - INDEX_BUILTIN_EQU), 3);
+		} else if (local2) {
+			/*
+			 * Leave n1 for an ADD_LOCAL_IMM if it starts one.
+			 */
+			if (!(icode_fusable(n1, 2) &&
+			    icode_get_imm(n2, &imm) && icode_is_add(n3)))
+				icode_fuse(ip, ic, INSTR_PUSH_LOCAL2, 1);
+		} else if (icode_fusable(ic, 2) && icode_is_add(n2)) {
+			if (bi == INDEX_BUILTIN_SUB)
+				ic->fused.imm = -imm;
+			icode_fuse(ip, ic, INSTR_ADD_LOCAL_IMM, 2);
+		}
+	}
+}
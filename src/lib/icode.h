@@ -47,16 +47,28 @@ struct icode {
 	vm_label_t		 label;		/* corresponding instr in vm */
 	unsigned char		 opcode;
 	union icode_operand	 operand;
+	struct {				/* for superinstructions; */
+		struct {			/* branch stays in operand */
+			int index;
+			int upcount;
+		}		 local[2];
+		int		 imm;
+	}			 fused;
+	unsigned char		*native;	/* compiled code (jit), if any */
+	vm_label_t		 stub;		/* vm code entering native, if any */
 };
 
 struct iprogram	*iprogram_new(void);
 void		 iprogram_free(struct iprogram *);
 void		 iprogram_dump(struct iprogram *, vm_label_t);
+void		 opcode_print(int);
 
 struct icode	*icode_new(struct iprogram *, int);
 struct icode	*icode_new_local(struct iprogram *, int, int, int);
 struct icode	*icode_new_value(struct iprogram *, int, struct value);
 struct icode	*icode_new_builtin(struct iprogram *, struct builtin *);
+int		 icode_is_branch(struct icode *);
+int		 icode_builtin_index(struct icode *);
 
 void		 icode_free(struct iprogram *, struct icode *);
 
@@ -69,6 +81,7 @@ void		 iprogram_eliminate_dead_code(struct iprogram *);
 void		 iprogram_optimize_tail_calls(struct iprogram *);
 void		 iprogram_optimize_push_small_ints(struct iprogram *);
 void		 iprogram_eliminate_useless_jumps(struct iprogram *);
+void		 iprogram_fuse_superinstructions(struct iprogram *);
 
 void		 referrer_unwire(struct icode *, struct icode *);
 void		 referrers_rewire(struct icode *, struct icode *);
@@ -0,0 +1,880 @@
+/*
+ * jit.c
+ * Baseline native code generator for hot closures.  x86-64 only.
+ *
+ * Once a closure has been called jit_threshold times, the icode of its
+ * body is translated, one icode at a time, into machine code which does
+ * what the vm would do, on the vm's own stack and activation records,
+ * but without the dispatch.  Locals, small integer arithmetic and
+ * comparisons, and branches are done inline; calls, tail calls and
+ * returns go through vm_call(), vm_goto() and vm_return().  Anything
+ * else, or operands of a type the native code doesn't expect, makes it
+ * return to the interpreter at that icode's label, to carry on from
+ * there.  So this only works for code generated by iprogram_gen().
+ *
+ * Native code is entered from the vm through stubs: INSTR_NATIVE
+ * instructions which live outside the program.  The closure's label is
+ * pointed at one, and calls made from native code push one as their
+ * return address, so nothing else needs to know what has been compiled.
+ *
+ * Inside native code, rbx holds the vm, r12 the top of the vm stack
+ * (written back whenever we leave), r13 the current activation record
+ * (which only changes when we leave), and r14 counts down backward
+ * branches until the vm should get a chance to poll.
+ */
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "jit.h"
+#include "vm.h"
+#include "icode.h"
+#include "closure.h"
+#include "activation.h"
+#include "builtin.h"
+#include "value.h"
+#include "thread.h"
+
+#ifdef JIT
+
+#define	JIT_CODE_SIZE	(4 * 1024 * 1024)	/* room for all native code */
+#define	JIT_BUDGET	1024		/* backward branches between polls */
+#define	JIT_PENDING	((unsigned char *)1)	/* reachable, not compiled yet */
+#define	JIT_RESUME	20		/* see gen_entry() */
+
+static bhuna_lock_t jit_lock = LOCK_INITIALIZER;
+
+int jit_threshold = DEFAULT_JIT_THRESHOLD;
+
+#define	RAX	0
+#define	RCX	1
+#define	RDX	2
+#define	RBX	3
+#define	RSP	4
+#define	RSI	6
+#define	RDI	7
+#define	R12	12
+#define	R13	13
+#define	R14	14
+
+#define	CC_E	0x4
+#define	CC_NE	0x5
+#define	CC_L	0xc
+#define	CC_GE	0xd
+#define	CC_LE	0xe
+#define	CC_G	0xf
+#define	CC_NONE	(-1)
+
+#define	VSP	((int)offsetof(struct vm, vstack_ptr))
+#define	CAR	((int)offsetof(struct vm, current_ar))
+#define	DISPLAY(n)	(-(int)sizeof(struct activation *) * (n))
+#define	SZ	((int)sizeof(struct value))
+#define	SLOT(i)	((int)sizeof(struct activation) + SZ * (i))
+#define	VAL	8	/* offset of v within struct value; checked below */
+#define	TOP(n)	(-SZ * (n))	/* nth value down from the top of stack */
+
+/*
+ * Native code is never writable and executable at once.  Without
+ * THREADS it is made writable while compiling, and executable again
+ * after.  With THREADS, other workers may be running what was compiled
+ * before meanwhile, so it is mapped twice instead, executable at code
+ * and writable at wcode, and emit() and patch() write through W().
+ */
+static unsigned char *code = NULL;	/* all native code lives here */
+static unsigned char *wcode;		/* where it is written */
+static unsigned char *cp;		/* next free byte in it */
+#define	W(p)	(wcode + ((p) - code))
+static int full;			/* ran out of room while compiling */
+static unsigned char *exit_at;		/* write back r12, return rax */
+static unsigned char *leave_at;		/* just return rax */
+
+/*
+ * Places in the code being compiled which jump to something
+ * not yet generated.
+ */
+#define	FIX_BRANCH	0	/* the native code for the icode */
+#define	FIX_BAIL	1	/* return to the vm at the icode */
+#define	FIX_POLL	2	/* return to the vm at the icode's stub */
+
+static struct fixup {
+	unsigned char	*at;	/* rel32 to patch */
+	struct icode	*icode;
+	int		 kind;
+} *fix;
+static int fixi;
+
+/*
+ * Icodes which were given stubs during this compile.
+ */
+static struct icode **entry;
+static int entryi;
+
+/*** emitting machine code ***/
+
+static void
+emit(int b)
+{
+	if (cp < code + JIT_CODE_SIZE)
+		*W(cp++) = (unsigned char)b;
+	else
+		full = 1;
+}
+
+static void
+emit32(int x)
+{
+	emit(x);
+	emit(x >> 8);
+	emit(x >> 16);
+	emit(x >> 24);
+}
+
+static void
+emit64(unsigned long x)
+{
+	emit32((int)x);
+	emit32((int)(x >> 32));
+}
+
+static void
+patch(unsigned char *at, unsigned char *target)
+{
+	int rel = (int)(target - (at + 4));
+
+	if (!full)
+		memcpy(W(at), &rel, 4);
+}
+
+static void
+rex(int w, int reg, int rm)
+{
+	int r = (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+
+	if (r != 0)
+		emit(0x40 | r);
+}
+
+static void
+opcode(int op)
+{
+	if (op > 0xff)
+		emit(op >> 8);
+	emit(op & 0xff);
+}
+
+/*
+ * Instruction op with register (or /digit) reg
+ * and memory operand [base + disp].
+ */
+static void
+op_mem(int w, int op, int reg, int base, int disp)
+{
+	rex(w, reg, base);
+	opcode(op);
+	emit(0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		emit(0x24);
+	emit32(disp);
+}
+
+/*
+ * Instruction op with register (or /digit) reg and register rm.
+ */
+static void
+op_reg(int w, int op, int reg, int rm)
+{
+	rex(w, reg, rm);
+	opcode(op);
+	emit(0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+#define	LOAD(r, b, d)		op_mem(1, 0x8b, r, b, d)
+#define	STORE(b, d, r)		op_mem(1, 0x89, r, b, d)
+#define	LOAD32(r, b, d)		op_mem(0, 0x8b, r, b, d)
+#define	STORE32(b, d, r)	op_mem(0, 0x89, r, b, d)
+#define	MOVE(d, s)		op_reg(1, 0x89, s, d)
+
+static void
+store8_imm(int base, int disp, int imm)
+{
+	op_mem(0, 0xc6, 0, base, disp);
+	emit(imm);
+}
+
+static void
+store32_imm(int base, int disp, int imm)
+{
+	op_mem(0, 0xc7, 0, base, disp);
+	emit32(imm);
+}
+
+static void
+cmp8_imm(int base, int disp, int imm)
+{
+	op_mem(0, 0x80, 7, base, disp);
+	emit(imm);
+}
+
+static void
+test8_imm(int base, int disp, int imm)
+{
+	op_mem(0, 0xf6, 0, base, disp);
+	emit(imm);
+}
+
+static void
+cmp32_imm(int base, int disp, int imm)
+{
+	op_mem(0, 0x81, 7, base, disp);
+	emit32(imm);
+}
+
+static void
+move_imm64(int reg, unsigned long imm)
+{
+	rex(1, 0, reg);
+	emit(0xb8 + (reg & 7));
+	emit64(imm);
+}
+
+/*
+ * Adjust the top of the vm stack by n values, leaving the flags alone.
+ */
+static void
+adjust_stack(int n)
+{
+	op_mem(1, 0x8d, R12, R12, SZ * n);	/* lea */
+}
+
+/*
+ * Jump (if cc is CC_NONE) or jump on condition cc; returns
+ * where the displacement goes, or NULL if target is given.
+ */
+static unsigned char *
+jump(int cc, unsigned char *target)
+{
+	unsigned char *at;
+
+	if (cc == CC_NONE) {
+		emit(0xe9);
+	} else {
+		emit(0x0f);
+		emit(0x80 | cc);
+	}
+	at = cp;
+	emit32(0);
+	if (target == NULL)
+		return(at);
+	patch(at, target);
+	return(NULL);
+}
+
+static void
+fixup(unsigned char *at, struct icode *ic, int kind)
+{
+	fix[fixi].at = at;
+	fix[fixi].icode = ic;
+	fix[fixi].kind = kind;
+	fixi++;
+}
+
+static void
+call(void *fn)
+{
+	move_imm64(RAX, (unsigned long)fn);
+	emit(0xff);			/* call rax */
+	emit(0xd0);
+}
+
+/*** stubs ***/
+
+static vm_label_t
+stub_for(struct icode *ic)
+{
+	if (ic->stub == NULL) {
+		ic->stub = bhuna_malloc(sizeof(vm_opcode_t) + sizeof(vm_native_t));
+#ifdef DIRECT_THREADING
+		*(vm_opcode_t *)ic->stub = vm_dispatch_table()[INSTR_NATIVE];
+#else
+		*(vm_opcode_t *)ic->stub = INSTR_NATIVE;
+#endif
+		entry[entryi++] = ic;
+	}
+	return(ic->stub);
+}
+
+/*
+ * Native entry point for a stub: save the registers we use,
+ * load up the vm's state, and go.
+ */
+static void
+gen_entry(struct icode *ic)
+{
+	unsigned char *thunk = cp;
+
+	emit(0x53);					/* push rbx */
+	emit(0x41); emit(0x54);				/* push r12 */
+	emit(0x41); emit(0x55);				/* push r13 */
+	emit(0x41); emit(0x56);				/* push r14 */
+	emit(0x48); emit(0x83); emit(0xec); emit(0x08);	/* sub rsp, 8 */
+	MOVE(RBX, RDI);
+	emit(0x41); emit(0xbe); emit32(JIT_BUDGET);	/* mov r14d, imm */
+	if (cp - thunk != JIT_RESUME)
+		full = 1;
+	LOAD(R12, RBX, VSP);
+	LOAD(R13, RBX, CAR);
+	jump(CC_NONE, ic->native);
+
+	if (!full)
+		memcpy(VM_OPERAND(ic->stub), &thunk, sizeof(thunk));
+}
+
+static void
+gen_exit(void)
+{
+	exit_at = cp;
+	STORE(RBX, VSP, R12);
+	leave_at = cp;
+	emit(0x48); emit(0x83); emit(0xc4); emit(0x08);	/* add rsp, 8 */
+	emit(0x41); emit(0x5e);				/* pop r14 */
+	emit(0x41); emit(0x5d);				/* pop r13 */
+	emit(0x41); emit(0x5c);				/* pop r12 */
+	emit(0x5b);					/* pop rbx */
+	emit(0xc3);					/* ret */
+}
+
+/*
+ * Go on to the label in rax, which vm_call() etc. just returned.
+ * If it is another stub, and the budget allows, go straight into its
+ * native code without going back through the vm.  Entries made by
+ * gen_entry() have already set up the registers up to JIT_RESUME.
+ */
+static void
+gen_transfer(void)
+{
+	op_reg(1, 0x85, RAX, RAX);			/* test rax, rax */
+	jump(CC_E, leave_at);
+	emit(0x41); emit(0xff); emit(0xce);		/* dec r14d */
+	jump(CC_E, leave_at);
+#ifdef DIRECT_THREADING
+	move_imm64(RCX, (unsigned long)vm_dispatch_table()[INSTR_NATIVE]);
+	op_mem(1, 0x3b, RCX, RAX, 0);			/* cmp rcx, [rax] */
+#else
+	cmp8_imm(RAX, 0, INSTR_NATIVE);
+#endif
+	jump(CC_NE, leave_at);
+	LOAD(RCX, RAX, sizeof(vm_opcode_t));
+	op_reg(1, 0x81, 0, RCX);			/* add rcx, imm */
+	emit32(JIT_RESUME);
+	emit(0xff); emit(0xe1);				/* jmp rcx */
+}
+
+/*
+ * Leave native code, continuing in the vm at label.
+ */
+static void
+gen_return_to(vm_label_t label)
+{
+	move_imm64(RAX, (unsigned long)label);
+	jump(CC_NONE, exit_at);
+}
+
+/*** translating icode ***/
+
+/*
+ * Returns the register to use as the base of the given local's address,
+ * loading the enclosing activation record from the display into tmp
+ * if need be.  The displacement is SLOT(index).
+ */
+static int
+local(int tmp, int upcount)
+{
+	if (upcount == 0)
+		return(R13);
+	LOAD(tmp, R13, DISPLAY(upcount));
+	return(tmp);
+}
+
+static void
+gen_push_local(int index, int upcount)
+{
+	int b = local(RAX, upcount);
+
+	LOAD(RCX, b, SLOT(index));
+	LOAD(RDX, b, SLOT(index) + 8);
+	STORE(R12, 0, RCX);
+	STORE(R12, 8, RDX);
+	adjust_stack(1);
+}
+
+static void
+store_local(struct activation *a, int index, struct value *v)
+{
+	AR_STORE(a, index, *v);
+}
+
+/*
+ * A structured value going into a local, or out of one, has to be
+ * counted, and may have to go past the barrier (see AR_STORE), so that
+ * is left to store_local().
+ */
+static void
+gen_pop_local(int index, int upcount)
+{
+	int b = local(RDX, upcount);
+	unsigned char *slow, *slow2, *done;
+
+	test8_imm(R12, TOP(1), VALUE_STRUCTURED);
+	slow = jump(CC_NE, NULL);
+	test8_imm(b, SLOT(index), VALUE_STRUCTURED);
+	slow2 = jump(CC_NE, NULL);
+	adjust_stack(-1);
+	LOAD(RAX, R12, 0);
+	LOAD(RCX, R12, 8);
+	STORE(b, SLOT(index), RAX);
+	STORE(b, SLOT(index) + 8, RCX);
+	done = jump(CC_NONE, NULL);
+
+	patch(slow, cp);
+	patch(slow2, cp);
+	adjust_stack(-1);
+	STORE(RBX, VSP, R12);
+	MOVE(RDI, b);
+	move_imm64(RSI, (unsigned long)index);
+	MOVE(RDX, R12);
+	call((void *)store_local);
+	patch(done, cp);
+}
+
+static void
+gen_push_int(int i)
+{
+	store8_imm(R12, 0, VALUE_INTEGER);
+	store32_imm(R12, VAL, i);
+	adjust_stack(1);
+}
+
+static void
+gen_push_value(struct value v)
+{
+	unsigned long w[2];
+
+	memcpy(w, &v, sizeof(w));
+	move_imm64(RAX, w[0]);
+	STORE(R12, 0, RAX);
+	move_imm64(RAX, w[1]);
+	STORE(R12, 8, RAX);
+	adjust_stack(1);
+}
+
+/*
+ * Go back to the vm at ic unless the value at [base + disp] is an integer.
+ */
+static void
+guard_int(struct icode *ic, int base, int disp)
+{
+	cmp8_imm(base, disp, VALUE_INTEGER);
+	fixup(jump(CC_NE, NULL), ic, FIX_BAIL);
+}
+
+/*
+ * Branch to target, on condition cc.  Backward branches
+ * count down the budget, and give the vm a turn when it runs out.
+ */
+static void
+gen_branch(int cc, struct icode *target)
+{
+	unsigned char *skip = NULL;
+
+	if (target->native == JIT_PENDING) {
+		fixup(jump(cc, NULL), target, FIX_BRANCH);
+		return;
+	}
+	if (cc != CC_NONE)
+		skip = jump(cc ^ 1, NULL);
+	stub_for(target);
+	emit(0x41); emit(0xff); emit(0xce);		/* dec r14d */
+	fixup(jump(CC_E, NULL), target, FIX_POLL);
+	jump(CC_NONE, target->native);
+	if (skip != NULL)
+		patch(skip, cp);
+}
+
+static int
+cmp_cc(int bi)
+{
+	switch (bi) {
+	case INDEX_BUILTIN_EQU:	return(CC_E);
+	case INDEX_BUILTIN_NEQ:	return(CC_NE);
+	case INDEX_BUILTIN_GT:	return(CC_G);
+	case INDEX_BUILTIN_LT:	return(CC_L);
+	case INDEX_BUILTIN_GTE:	return(CC_GE);
+	case INDEX_BUILTIN_LTE:	return(CC_LE);
+	}
+	return(CC_NONE);
+}
+
+/*
+ * Generate native code for ic.  Returns the number of icodes
+ * consumed, which is 2 if a comparison took the following JZ with it.
+ */
+static int
+gen_icode(struct icode *ic)
+{
+	struct icode *next = ic->next;
+	int b, b2, bi, cc;
+
+	switch (ic->opcode) {
+	case INSTR_PUSH_VALUE:
+		gen_push_value(ic->operand.value);
+		return(1);
+	case INSTR_PUSH_ZERO:
+		gen_push_int(0);
+		return(1);
+	case INSTR_PUSH_ONE:
+		gen_push_int(1);
+		return(1);
+	case INSTR_PUSH_TWO:
+		gen_push_int(2);
+		return(1);
+	case INSTR_PUSH_LOCAL:
+		gen_push_local(ic->operand.local.index,
+		    ic->operand.local.upcount);
+		return(1);
+	case INSTR_POP_LOCAL:
+		gen_pop_local(ic->operand.local.index,
+		    ic->operand.local.upcount);
+		return(1);
+	case INSTR_INIT_LOCAL:
+		gen_pop_local(ic->operand.local.index, 0);
+		return(1);
+	case INSTR_PUSH_LOCAL2:
+		gen_push_local(ic->fused.local[0].index,
+		    ic->fused.local[0].upcount);
+		gen_push_local(ic->fused.local[1].index,
+		    ic->fused.local[1].upcount);
+		return(1);
+	case INSTR_ADD_LOCAL_IMM:
+		b = local(RAX, ic->fused.local[0].upcount);
+		guard_int(ic, b, SLOT(ic->fused.local[0].index));
+		LOAD32(RCX, b, SLOT(ic->fused.local[0].index) + VAL);
+		op_reg(0, 0x81, 0, RCX);		/* add ecx, imm */
+		emit32(ic->fused.imm);
+		store8_imm(R12, 0, VALUE_INTEGER);
+		STORE32(R12, VAL, RCX);
+		adjust_stack(1);
+		return(1);
+	case INSTR_EQU_LOCAL_IMM_JZ:
+	case INSTR_NEQ_LOCAL_IMM_JZ:
+	case INSTR_GT_LOCAL_IMM_JZ:
+	case INSTR_LT_LOCAL_IMM_JZ:
+	case INSTR_GTE_LOCAL_IMM_JZ:
+	case INSTR_LTE_LOCAL_IMM_JZ:
+		cc = cmp_cc(ic->opcode - INSTR_EQU_LOCAL_IMM_JZ + INDEX_BUILTIN_EQU);
+		b = local(RAX, ic->fused.local[0].upcount);
+		guard_int(ic, b, SLOT(ic->fused.local[0].index));
+		cmp32_imm(b, SLOT(ic->fused.local[0].index) + VAL, ic->fused.imm);
+		gen_branch(cc ^ 1, ic->operand.branch);
+		return(1);
+	case INSTR_EQU_LOCAL_LOCAL_JZ:
+	case INSTR_NEQ_LOCAL_LOCAL_JZ:
+	case INSTR_GT_LOCAL_LOCAL_JZ:
+	case INSTR_LT_LOCAL_LOCAL_JZ:
+	case INSTR_GTE_LOCAL_LOCAL_JZ:
+	case INSTR_LTE_LOCAL_LOCAL_JZ:
+		cc = cmp_cc(ic->opcode - INSTR_EQU_LOCAL_LOCAL_JZ + INDEX_BUILTIN_EQU);
+		b = local(RAX, ic->fused.local[0].upcount);
+		b2 = local(RCX, ic->fused.local[1].upcount);
+		guard_int(ic, b, SLOT(ic->fused.local[0].index));
+		guard_int(ic, b2, SLOT(ic->fused.local[1].index));
+		LOAD32(RDX, b, SLOT(ic->fused.local[0].index) + VAL);
+		op_mem(0, 0x3b, RDX, b2, SLOT(ic->fused.local[1].index) + VAL);
+		gen_branch(cc ^ 1, ic->operand.branch);
+		return(1);
+	case INSTR_JZ:
+		LOAD32(RAX, R12, TOP(1) + VAL);
+		adjust_stack(-1);
+		op_reg(0, 0x85, RAX, RAX);		/* test eax, eax */
+		gen_branch(CC_E, ic->operand.branch);
+		return(1);
+	case INSTR_JMP:
+		gen_branch(CC_NONE, ic->operand.branch);
+		return(1);
+	case INSTR_CALL:
+		if (next == NULL || next->native != JIT_PENDING)
+			break;
+		STORE(RBX, VSP, R12);
+		MOVE(RDI, RBX);
+		move_imm64(RSI, (unsigned long)stub_for(next));
+		call((void *)vm_call);
+		gen_transfer();
+		return(1);
+	case INSTR_GOTO:
+		STORE(RBX, VSP, R12);
+		MOVE(RDI, RBX);
+		call((void *)vm_goto);
+		gen_transfer();
+		return(1);
+	case INSTR_RET:
+		STORE(RBX, VSP, R12);
+		MOVE(RDI, RBX);
+		call((void *)vm_return);
+		gen_transfer();
+		return(1);
+	case INDEX_BUILTIN_ADD:
+	case INDEX_BUILTIN_SUB:
+	case INDEX_BUILTIN_MUL:
+		guard_int(ic, R12, TOP(2));
+		guard_int(ic, R12, TOP(1));
+		/* FALLTHROUGH */
+	case INSTR_IADD:
+	case INSTR_ISUB:
+	case INSTR_IMUL:
+		bi = icode_builtin_index(ic);
+		LOAD32(RAX, R12, TOP(2) + VAL);
+		op_mem(0, bi == INDEX_BUILTIN_ADD ? 0x03 :
+		    bi == INDEX_BUILTIN_SUB ? 0x2b : 0x0faf,
+		    RAX, R12, TOP(1) + VAL);
+		if (bi != ic->opcode)
+			store8_imm(R12, TOP(2), VALUE_INTEGER);
+		STORE32(R12, TOP(2) + VAL, RAX);
+		adjust_stack(-1);
+		return(1);
+	case INDEX_BUILTIN_EQU:
+	case INDEX_BUILTIN_NEQ:
+	case INDEX_BUILTIN_GT:
+	case INDEX_BUILTIN_LT:
+	case INDEX_BUILTIN_GTE:
+	case INDEX_BUILTIN_LTE:
+		guard_int(ic, R12, TOP(2));
+		guard_int(ic, R12, TOP(1));
+		/* FALLTHROUGH */
+	case INSTR_IEQU:
+	case INSTR_INEQ:
+	case INSTR_IGT:
+	case INSTR_ILT:
+	case INSTR_IGTE:
+	case INSTR_ILTE:
+		cc = cmp_cc(icode_builtin_index(ic));
+		LOAD32(RAX, R12, TOP(2) + VAL);
+		op_mem(0, 0x3b, RAX, R12, TOP(1) + VAL);	/* cmp */
+		if (next != NULL && next->opcode == INSTR_JZ &&
+		    next->referrers == NULL && next->native == JIT_PENDING) {
+			adjust_stack(-2);
+			gen_branch(cc ^ 1, next->operand.branch);
+			next->native = cp;
+			return(2);
+		}
+		emit(0x0f); emit(0x90 | cc); emit(0xc0);	/* setcc al */
+		emit(0x0f); emit(0xb6); emit(0xc0);		/* movzx eax, al */
+		store8_imm(R12, TOP(2), VALUE_BOOLEAN);
+		STORE32(R12, TOP(2) + VAL, RAX);
+		adjust_stack(-1);
+		return(1);
+	}
+
+	/*
+	 * Anything else is left to the vm.
+	 */
+	gen_return_to(ic->label);
+	return(1);
+}
+
+/*
+ * Collect everything reachable from the closure's entry point, without
+ * following calls, marking it pending.  Returns the number found.
+ */
+static int
+find_body(struct icode *start, struct icode **found)
+{
+	struct icode *ic, *succ[2];
+	int sp = 0, n = 0, i;
+
+	start->native = JIT_PENDING;
+	found[n++] = start;
+	while (sp < n) {
+		ic = found[sp++];
+		if (ic->label == NULL)
+			full = 1;
+		succ[0] = succ[1] = NULL;
+		if (ic->opcode != INSTR_RET && ic->opcode != INSTR_GOTO &&
+		    ic->opcode != INSTR_JMP && ic->opcode != INSTR_HALT)
+			succ[0] = ic->next;
+		if (icode_is_branch(ic))
+			succ[1] = ic->operand.branch;
+		for (i = 0; i < 2; i++) {
+			if (succ[i] == NULL || succ[i]->native == JIT_PENDING)
+				continue;
+			if (succ[i]->native != NULL) {
+				full = 1;	/* already someone else's */
+				continue;
+			}
+			succ[i]->native = JIT_PENDING;
+			found[n++] = succ[i];
+		}
+	}
+	return(n);
+}
+
+static void
+jit_init(void)
+{
+	unsigned char *x = MAP_FAILED, *w = MAP_FAILED;
+	int fd;
+#ifdef THREADS
+	char name[32];
+
+	snprintf(name, sizeof(name), "/bhuna-jit.%ld", (long)getpid());
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) >= 0) {
+		shm_unlink(name);
+		if (ftruncate(fd, JIT_CODE_SIZE) == 0) {
+			x = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_EXEC,
+			    MAP_SHARED, fd, 0);
+			w = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+		}
+		close(fd);
+	}
+#else
+	if ((fd = open("/dev/zero", O_RDWR)) >= 0) {
+		x = w = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, fd, 0);
+		close(fd);
+	}
+#endif
+	if (x == MAP_FAILED || w == MAP_FAILED) {
+		if (x != MAP_FAILED)
+			munmap(x, JIT_CODE_SIZE);
+		if (w != MAP_FAILED)
+			munmap(w, JIT_CODE_SIZE);
+		jit_threshold = 0;
+		return;
+	}
+	code = x;
+	wcode = w;
+	cp = code;
+}
+
+static void
+compile(struct closure *k)
+{
+	struct icode *ic, **found;
+	unsigned char *start, *block;
+	int n, i, j, done;
+
+	if (sizeof(struct value) != 16 || offsetof(struct value, v) != VAL)
+		return;
+	if (k->icode == NULL || k->label != k->icode->label)
+		return;
+	if (code == NULL) {
+		jit_init();
+		if (code == NULL)
+			return;
+	} else {
+#ifndef THREADS
+		mprotect(code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+#endif
+	}
+
+	for (ic = k->icode; ic->prev != NULL; ic = ic->prev)
+		;
+	for (n = 0; ic != NULL; ic = ic->next)
+		n++;
+	found = bhuna_malloc(sizeof(struct icode *) * n);
+	fix = bhuna_malloc(sizeof(struct fixup) * 4 * n);
+	entry = bhuna_malloc(sizeof(struct icode *) * n);
+	fixi = entryi = 0;
+	start = cp;
+	full = 0;
+
+	n = find_body(k->icode, found);
+	if (full)
+		goto done;
+	gen_exit();
+
+	/*
+	 * Generate in program order, so that falling through works.
+	 * (Nothing reachable comes before the entry point.)
+	 */
+	for (ic = k->icode, done = 0; done < n; ic = ic->next) {
+		if (ic == NULL) {
+			full = 1;
+			goto done;
+		}
+		if (ic->native != JIT_PENDING)
+			continue;
+		ic->native = cp;
+		done += gen_icode(ic);
+	}
+
+	/*
+	 * Out-of-line code for leaving to the vm, shared by every
+	 * jump to the same place; then resolve everything else.
+	 */
+	for (i = 0; i < fixi; i++) {
+		if (fix[i].kind == FIX_BRANCH) {
+			patch(fix[i].at, fix[i].icode->native);
+			continue;
+		}
+		if (fix[i].at == NULL)
+			continue;
+		block = cp;
+		gen_return_to(fix[i].kind == FIX_BAIL ?
+		    fix[i].icode->label : fix[i].icode->stub);
+		for (j = i; j < fixi; j++) {
+			if (fix[j].icode == fix[i].icode &&
+			    fix[j].kind == fix[i].kind && fix[j].at != NULL) {
+				patch(fix[j].at, block);
+				if (j > i)
+					fix[j].at = NULL;
+			}
+		}
+	}
+
+	stub_for(k->icode);
+	for (i = 0; i < entryi; i++)
+		gen_entry(entry[i]);
+
+done:
+	if (full) {
+		/*
+		 * No room, or nothing we can deal with:
+		 * forget it and leave this one to the vm.
+		 */
+		for (i = 0; i < entryi; i++) {
+			bhuna_free(entry[i]->stub);
+			entry[i]->stub = NULL;
+		}
+		for (i = 0; i < n; i++)
+			found[i]->native = NULL;
+		cp = start;
+	} else {
+		k->label = k->icode->stub;
+	}
+#ifndef THREADS
+	mprotect(code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+#endif
+
+	bhuna_free(found);
+	bhuna_free(fix);
+	bhuna_free(entry);
+}
+
+/*
+ * Workers may reach the threshold on the same closure at once;
+ * compile() leaves alone one which has been compiled already.
+ */
+void
+jit_compile(struct closure *k)
+{
+	LOCK(&jit_lock);
+	compile(k);
+	UNLOCK(&jit_lock);
+}
+
+#endif	/* JIT */
@@ -0,0 +1,23 @@
+/*
+ * jit.h
+ * Native code generation for hot closures.
+ */
+
+#ifndef __JIT_H_
+#define __JIT_H_
+
+#include "vm.h"
+
+#ifdef JIT
+
+#define DEFAULT_JIT_THRESHOLD	1000
+
+struct closure;
+
+extern int jit_threshold;
+
+void		 jit_compile(struct closure *);
+
+#endif
+
+#endif
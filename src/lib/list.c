@@ -1,55 +1,126 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "list.h"
 #include "value.h"
 
-void
-list_cons(struct list **l, struct value v)
+#define	LIST_MIN_ROOM	4
+
+static struct list *
+list_alloc(size_t room)
 {
-	struct list *n;
+	struct list *l;
 
-	n = bhuna_malloc(sizeof(struct list));
-	n->value = v;
-	n->next = *l;
-	*l = n;
+	l = pool_alloc(LIST_BYTES(room));
+	l->outgrown = NULL;
+	l->size = 0;
+	l->room = room;
+	return(l);
 }
 
+/*
+ * A list with room for n values, in one allocation, holding the n at
+ * v, counted (see V_REF), or, if v is NULL, nothing yet.  NULL if n is
+ * 0.
+ */
 struct list *
-list_dup(struct list *l)
+list_new(struct value *v, size_t n)
 {
-	struct list *n = l;
+	struct list *l;
+	size_t i;
 
-	/* ... XXX ... */
+	if (n == 0)
+		return(NULL);
+	l = list_alloc(n);
+	if (v == NULL)
+		return(l);
+	for (i = 0; i < n; i++) {
+		l->value[i] = v[i];
+		V_REF(v[i]);
+	}
+	l->size = n;
+	return(l);
+}
 
-	return(n);
+/*
+ * Put v on the end of *l, counted.  When *l is full it is moved into
+ * twice the room, and what it was in is freed, or, if keep is nonzero,
+ * kept until *l is, for whoever else may be reading it.  Returns how
+ * many more bytes *l takes up.
+ */
+size_t
+list_append(struct list **l, struct value v, int keep)
+{
+	struct list *o = *l, *n;
+	size_t room, grew = 0;
+
+	if (o == NULL || o->size == o->room) {
+		room = o == NULL ? LIST_MIN_ROOM : (size_t)o->room * 2;
+		n = list_alloc(room);
+		grew = LIST_BYTES(room);
+		if (o != NULL) {
+			memcpy(n->value, o->value, sizeof(struct value) * o->size);
+			n->size = o->size;
+			if (keep) {
+				n->outgrown = o;
+			} else {
+				n->outgrown = o->outgrown;
+				grew -= LIST_BYTES(o->room);
+				pool_free(o, LIST_BYTES(o->room));
+			}
+		}
+		*l = n;
+	}
+	V_REF(v);
+	(*l)->value[(*l)->size++] = v;
+	return(grew);
 }
 
-void
+/*
+ * A copy of l, with just enough room; what is in it is counted again.
+ */
+struct list *
+list_dup(struct list *l)
+{
+	if (l == NULL)
+		return(NULL);
+	return(list_new(l->value, l->size));
+}
+
+/*
+ * Returns how many bytes were freed, as list_size() would have
+ * measured them.
+ */
+size_t
 list_free(struct list **l)
 {
 	struct list *next;
+	size_t n = 0;
 
 	while ((*l) != NULL) {
-		next = (*l)->next;
-		bhuna_free((*l));
+		next = (*l)->outgrown;
+		n += LIST_BYTES((*l)->room);
+		pool_free(*l, LIST_BYTES((*l)->room));
 		(*l) = next;
 	}
+	return(n);
 }
 
+/*
+ * How many bytes l takes up, what it outgrew included.
+ */
 size_t
-list_length(struct list *l)
+list_size(struct list *l)
 {
-	size_t i = 0;
-
-	while(l != NULL) {
-		i++;
-		l = l->next;
-	}
+	size_t n = 0;
 
-	return(i);
+	for (; l != NULL; l = l->outgrown)
+		n += LIST_BYTES(l->room);
+	return(n);
 }
 
 /*
@@ -58,10 +129,11 @@ list_length(struct list *l)
 int
 list_contains(struct list *l, struct value v)
 {
-	while (l != NULL) {
-		if (value_equal(l->value, v))
+	size_t i;
+
+	for (i = 0; i < LIST_LENGTH(l); i++) {
+		if (value_equal(l->value[i], v))
 			return(1);
-		l = l->next;
 	}
 
 	return(0);
@@ -70,12 +142,13 @@ list_contains(struct list *l, struct value v)
 void
 list_dump(struct list *l)
 {
+	size_t i;
+
 	printf("[");
-	while (l != NULL) {
-		value_print(l->value);
-		if (l->next != NULL)
+	for (i = 0; i < LIST_LENGTH(l); i++) {
+		if (i > 0)
 			printf(",");
-		l = l->next;
+		value_print(l->value[i]);
 	}
 	printf("]");
 }
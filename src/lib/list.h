@@ -7,18 +7,34 @@
 #define	__LIST_H_
 
 #include <sys/types.h>
+#include <stddef.h>
 
 #include "value.h"
 
+/*
+ * A list is a vector: its values, first first, in one allocation with
+ * room for more.  The empty list is NULL.  What a shared list outgrew
+ * is kept until the list is freed, since another process may still be
+ * looking at it (see list_append().)  value[1] stands for as many as
+ * there is room for; C89 has no flexible array members.
+ */
 struct list {
-	struct list		*next;
-	struct value		value;
+	struct list		*outgrown;
+	unsigned int		 size;		/* values in it */
+	unsigned int		 room;		/* values it has room for */
+	struct value		 value[1];
 };
 
-void		 list_cons(struct list **, struct value);
+#define	LIST_BYTES(room)	\
+	(offsetof(struct list, value) + sizeof(struct value) * (room))
+
+#define	LIST_LENGTH(l)	((l) == NULL ? 0 : (size_t)(l)->size)
+
+struct list	*list_new(struct value *, size_t);
+size_t		 list_append(struct list **, struct value, int);
 struct list	*list_dup(struct list *);
-void		 list_free(struct list **);
-size_t		 list_length(struct list *);
+size_t		 list_free(struct list **);
+size_t		 list_size(struct list *);
 int		 list_contains(struct list *, struct value);
 
 void		 list_dump(struct list *);
@@ -222,6 +222,7 @@ parse_definition(struct scan_st *sc, struct symbol_table *stab, int is_const,
 		if (r == NULL || r->type != AST_VALUE) {
 			report(REPORT_ERROR, sc, "Expression must be constant");
 		} else {
+			value_freeze(r->u.value.value);
 			symbol_set_value(sym, r->u.value.value);
 			ast_free(l);
 			ast_free(r);
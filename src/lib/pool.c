@@ -1,168 +1,219 @@
+/*
+ * pool.c
+ * Size-class pools.
+ *
+ * Structured values, list cells, dict chains, closures, messages and
+ * small activation records are allocated and freed by the million,
+ * nearly all of a handful of sizes, and most of them are freed by the
+ * collector not long after.  Here every size up to POOL_MAX is rounded
+ * up to a multiple of POOL_ALIGN, which is its class, and everything of
+ * a class is carved from slabs of SLAB_SIZE kept for that class alone.
+ *
+ * Each thread has a free list of each class, and allocates from it
+ * what it has freed most recently.  When a thread has freed a BATCH
+ * more of a class than it has allocated, it gives a batch to the depot;
+ * when it has none of a class, it takes a batch from the depot, or if
+ * there is none there, carves from the slab it is carving that class
+ * from, or a new one.  Only the depot is locked, and only once for each
+ * batch; what one thread frees (a collection on one thread sweeps what
+ * processes on others allocated) is soon allocated by another.
+ *
+ * Slabs are never given back, so memory once used for one class is
+ * only ever used again for that class.
+ */
+
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <err.h>
+#include <sysexits.h>
 
-#ifdef POOL_VALUES
+#ifdef POOLS
 
+#include "mem.h"
 #include "pool.h"
+#include "thread.h"
+
+#define	POOL_ALIGN	8
+#define	POOL_CLASSES	(POOL_MAX / POOL_ALIGN)
+#define	CLASS_OF(n)	(((n) + POOL_ALIGN - 1) / POOL_ALIGN - 1)
+#define	CLASS_SIZE(c)	(((c) + 1) * POOL_ALIGN)
+#define	SLAB_SIZE	65536
+#define	BATCH		256
+
+/*
+ * Free things, chained through their first word.
+ */
+struct free_list {
+	void		*head;
+	int		 n;
+};
+
+struct cache {
+	struct free_list cur[POOL_CLASSES];	/* allocated from */
+	struct free_list full[POOL_CLASSES];	/* a batch, to give */
+	char		*bump[POOL_CLASSES];	/* slab carved from */
+	char		*end[POOL_CLASSES];
+};
+
+struct depot {
+	struct free_list *batch;
+	int		  n;
+	int		  size;
+	int		  slabs;
+};
+
+static THREAD_LOCAL struct cache cache;
+static struct depot depot[POOL_CLASSES];
+static bhuna_lock_t depot_lock = LOCK_INITIALIZER;
 
-static struct value_pool *current_vp = NULL;
-static struct value *pv_free = NULL;
-
+#ifdef DEBUG
 extern int trace_pool;
+#endif
 
-void
-value_pool_new(void)
+static void
+pool_give(int c, struct free_list *f)
+{
+	struct depot *d = &depot[c];
+
+	LOCK(&depot_lock);
+	if (d->n == d->size) {
+		d->size = d->size == 0 ? 16 : d->size * 2;
+		d->batch = realloc(d->batch, d->size * sizeof(struct free_list));
+		if (d->batch == NULL)
+			err(EX_UNAVAILABLE, "realloc()");
+	}
+	d->batch[d->n++] = *f;
+	UNLOCK(&depot_lock);
+	f->head = NULL;
+	f->n = 0;
+}
+
+/*
+ * Fill this thread's free list of class c, empty, from its full batch
+ * or the depot.  Returns 0 if there was nothing in either.
+ */
+static int
+pool_refill(int c)
 {
-	struct value_pool *vp;
-	int i;
+	struct depot *d = &depot[c];
 
-#ifdef DEBUG
-	if (trace_pool > 0) {
-		printf("MAKING NEW POOL\n");
-		printf("value size        = %4d\n", sizeof(struct value));
-		printf("page size         = %4d\n", PAGE_SIZE);
-		printf("header size       = %4d\n", sizeof(struct lifeguard));
-		printf("value pool size   = %4d\n", sizeof(struct value_pool));
-		printf("values per pool   = %4d\n", VALUES_PER_POOL);
+	if (cache.full[c].head != NULL) {
+		cache.cur[c] = cache.full[c];
+		cache.full[c].head = NULL;
+		cache.full[c].n = 0;
+		return(1);
 	}
+	if (d->n == 0)		/* a peek; looked at again under the lock */
+		return(0);
+	LOCK(&depot_lock);
+	if (d->n > 0)
+		cache.cur[c] = d->batch[--d->n];
+	UNLOCK(&depot_lock);
+	return(cache.cur[c].head != NULL);
+}
+
+static void *
+pool_carve(int c)
+{
+	size_t size = CLASS_SIZE(c);
+	char *p;
+
+	if (cache.bump[c] == NULL || cache.bump[c] + size > cache.end[c]) {
+		if ((cache.bump[c] = malloc(SLAB_SIZE)) == NULL)
+			err(EX_UNAVAILABLE, "malloc()");
+		cache.end[c] = cache.bump[c] + SLAB_SIZE;
+		ATOMIC_ADD(&depot[c].slabs, 1);
+#ifdef DEBUG
+		if (trace_pool > 1)
+			printf("pool: new slab for %d-byte things\n", (int)size);
 #endif
-	assert(sizeof(struct value_pool) <= PAGE_SIZE);
-	vp = malloc(PAGE_SIZE);
-
-	/*
-	 * Link us up to the parent pool, if any.
-	 */
-	if (current_vp != NULL)
-		current_vp->lg.next = vp;
-	vp->lg.prev = current_vp;
-	vp->lg.next = NULL;
-
-	/*
-	 * Create an initial freelist within the pool,
-	 * and link it into our global freelist pv_free.
-	 */
-	vp->pool[0].admin = ADMIN_FREE;
-	vp->pool[0].next = pv_free;
-	for (i = 1; i < VALUES_PER_POOL; i++) {
-		vp->pool[i].admin = ADMIN_FREE;
-		vp->pool[i].next = &vp->pool[i-1];
 	}
-	pv_free = &vp->pool[VALUES_PER_POOL - 1];
-
-	/*printf("pv_free = %08lx\n", (unsigned long)pv_free);*/
+	p = cache.bump[c];
+	cache.bump[c] += size;
+	return(p);
+}
 
-	current_vp = vp;
+void *
+pool_alloc(size_t n)
+{
+	struct free_list *f;
+	void *p;
+	int c;
+
+	assert(n > 0);
+	if (n > POOL_MAX)
+		return(bhuna_malloc(n));
+	c = CLASS_OF(n);
+	f = &cache.cur[c];
+	if (f->head == NULL && !pool_refill(c))
+		return(pool_carve(c));
+	p = f->head;
+	f->head = *(void **)p;
+	f->n--;
+	return(p);
 }
 
-struct value *
-value_allocate(void)
+/*
+ * Free p, of n bytes, as it was allocated.
+ */
+void
+pool_free(void *p, size_t n)
 {
-	struct value *r;
-
-	/*
-	 * Check to see if this is the last remaining slot in the pool.
-	 */
-	if (pv_free->next == NULL) {
-		/*
-		 * If so, create a new pool.
-		 */
-		value_pool_new();
-	}
-	/*
-	 * Find the next pooled value on the freelist,
-	 * remove it from the freelist, and return it.
-	 */
-	r = pv_free;
-	pv_free = pv_free->next;
+	struct free_list *f;
+	int c;
 
-#ifdef DEBUG
-	if (trace_pool > 1) {
-		printf("pool: allocate: next free now %08lx\n",
-		    (unsigned long)pv_free);
+	if (n > POOL_MAX) {
+		bhuna_free(p);
+		return;
 	}
-#endif
-	return(r);
+	c = CLASS_OF(n);
+	f = &cache.cur[c];
+	if (f->n == BATCH) {
+		if (cache.full[c].head != NULL)
+			pool_give(c, &cache.full[c]);
+		cache.full[c] = *f;
+		f->head = NULL;
+		f->n = 0;
+	}
+	*(void **)p = f->head;
+	f->head = p;
+	f->n++;
 }
 
+/*
+ * Give everything this thread has free to the depot, as it is ending.
+ * What is left of the slabs it was carving is lost.
+ */
 void
-value_deallocate(struct value *v)
+pool_flush(void)
 {
-	/*
-	 * Tack this value back onto the freelist.
-	 */
-	v->next = pv_free;
-	v->admin = ADMIN_FREE;
-	pv_free = v;
-#ifdef DEBUG
-	if (trace_pool > 1) {
-		printf("pool: deallocate: next free now %08lx\n",
-		    (unsigned long)pv_free);
+	int c;
+
+	for (c = 0; c < POOL_CLASSES; c++) {
+		if (cache.cur[c].head != NULL)
+			pool_give(c, &cache.cur[c]);
+		if (cache.full[c].head != NULL)
+			pool_give(c, &cache.full[c]);
+		cache.bump[c] = cache.end[c] = NULL;
 	}
-#endif
 }
 
 void
 pool_report(void)
 {
 #ifdef DEBUG
-	struct value_pool *vp;
-	int pool_no = 1;
-	int i, nf;
-
-	for (vp = current_vp; vp != NULL; vp = vp->lg.prev) {
-		nf = 0;
-		for (i = 0; i < VALUES_PER_POOL; i++) {
-			if (vp->pool[i].admin & ADMIN_FREE)
-				nf++;
-		}
-		printf("Pool #%d: %5d/%5d\n", pool_no++, nf, VALUES_PER_POOL);
+	int c, i, nf;
+
+	for (c = 0; c < POOL_CLASSES; c++) {
+		if (depot[c].slabs == 0)
+			continue;
+		for (nf = i = 0; i < depot[c].n; i++)
+			nf += depot[c].batch[i].n;
+		printf("Pool %3d: %5d slabs, %8d free in the depot\n",
+		    CLASS_SIZE(c), depot[c].slabs, nf);
 	}
 #endif
 }
 
-void
-clean_pools(void)
-{
-	struct value_pool *vp, *vp_prev;
-	int pool_no = 1, i, nf;
-	struct value *save = NULL;
-
-	/* re-thread the free list! */
-
-	pv_free = NULL;
-	for (vp = current_vp; vp != NULL; vp = vp_prev) {
-		vp_prev = vp->lg.prev;
-		save = pv_free;
-		nf = 0;
-		for (i = 0; i < VALUES_PER_POOL; i++) {
-			/*
-			 * If this space is taken - skip it.
-			 */
-			if (!(vp->pool[i].admin & ADMIN_FREE))
-				continue;
-
-			/*
-			 * Otherwise re-thread the free list through here.
-			 */
-			vp->pool[i].next = pv_free;
-			pv_free = &vp->pool[i];
-			nf++;
-		}
-		if (nf == VALUES_PER_POOL) {
-			/*printf("Pool #%d is EMPTY, DESTROYING\n", pool_no);*/
-			pv_free = save;
-			if (vp->lg.prev != NULL)
-				vp->lg.prev->lg.next = vp->lg.next;
-			if (vp->lg.next != NULL)
-				vp->lg.next->lg.prev = vp->lg.prev;
-			if (vp == current_vp)
-				current_vp = vp_prev;
-			bhuna_free(vp);
-		} else {
-			/*printf("Pool #%d is not empty\n", pool_no);*/
-		}
-		pool_no++;
-	}
-}
 #endif
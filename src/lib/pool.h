@@ -1,23 +1,26 @@
-#include "value.h"
+/*
+ * pool.h
+ * Size-class pools, for the small things allocated by the million.
+ */
 
-struct lifeguard {
-	struct value_pool	*next;
-	struct value_pool	*prev;
-};
+#ifndef __POOL_H_
+#define __POOL_H_
 
-#define PAGE_SIZE 16384
-#define	VALUES_PER_POOL	((PAGE_SIZE - sizeof(struct lifeguard)) / \
-			sizeof(struct value) - 1)
+#include <sys/types.h>
 
-struct value_pool {
-	struct lifeguard	lg;
-	struct value	 	pool[VALUES_PER_POOL];
-};
+#include "mem.h"
 
-void			 value_pool_new(void);
+#define	POOL_MAX	256	/* anything bigger is malloc()ed */
 
-struct value		*value_allocate(void);
-void			 value_deallocate(struct value *);
+#ifdef POOLS
+void		*pool_alloc(size_t);
+void		 pool_free(void *, size_t);
+void		 pool_flush(void);
+void		 pool_report(void);
+#else
+#define	pool_alloc(n)		bhuna_malloc(n)
+#define	pool_free(p, n)		bhuna_free(p)
+#define	pool_flush()
+#endif
 
-void			 pool_report(void);
-void			 clean_pools(void);
+#endif
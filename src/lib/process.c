@@ -1,78 +1,320 @@
+#ifndef _POSIX_C_SOURCE
+#define	_POSIX_C_SOURCE	200112L	/* clock_gettime(), even with ANSI=1 */
+#endif
+
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "process.h"
 #include "vm.h"
 #include "closure.h"
 #include "ast.h"
 #include "activation.h"
+#include "atom.h"
+#include "list.h"
+#include "gcstat.h"
+#include "thread.h"
 
 #define TIMESLICE	2048 /* 4096 */
+#define TIMER_POLL	32	/* timeslices between looks at the clock */
 extern int trace_scheduling;
 
-struct process		*current_process = NULL;
-struct process		*run_head = NULL;
-struct process		*wait_head = NULL;
+/*
+ * The first time a Recv or Sleep with a time limit has to wait, it notes
+ * the limit (TIMER_SET); the deadline is reckoned from when the process
+ * first falls asleep, and kept (TIMER_HELD) if it is woken before then.
+ * The timer is only in the wheel while the process is on the wait list
+ * (TIMER_ARMED), so it is added and removed under the same lock as that,
+ * the clock is read once per wait, and a Recv which is answered before
+ * the process falls asleep doesn't touch the wheel at all.  The
+ * process is woken and finds the timer fired, or else gets a message
+ * and forgets the deadline.
+ */
+#define	TIMER_NONE	0
+#define	TIMER_SET	1
+#define	TIMER_HELD	2
+#define	TIMER_ARMED	3
+#define	TIMER_FIRED	4
 
-static int		 procno = 1;
+#define	PROCESS_OF(t)	((struct process *)((char *)(t) - \
+			    offsetof(struct process, timer)))
 
-struct process *
-process_new(struct vm *vm)
+/*
+ * Processes are run by workers, each with a queue of processes ready
+ * to run.  A worker runs a timeslice of the process at the head of its
+ * own queue, then puts it back at the tail.  Processes spawned or
+ * awakened by a process go on its worker's queue.  A worker whose queue
+ * is empty steals from the tail of another's, and if there is nothing
+ * to steal, waits for there to be.  When no process is running or
+ * ready to run, every worker stops and process_scheduler() returns.
+ *
+ * Without THREADS there is one worker, which is the main thread.
+ */
+struct worker {
+	bhuna_lock_t	 lock;		/* guards the queue */
+	struct process	*head;		/* run from the head... */
+	struct process	*tail;		/* ...stolen from the tail */
+	struct process	*current;	/* process in a timeslice, if any */
+	int		 polls;		/* timeslices until timers_run() */
+#ifdef THREADS
+	pthread_t	 thread;
+#endif
+};
+
+/*
+ * Messages passed over by Pick (see below.)
+ */
+struct aside {
+	struct message	*head;		/* oldest first, */
+	struct message	*tail;		/* chained through next and prev */
+	struct tagq	**tags;		/* by tag */
+	int		 buckets;
+	int		 count;		/* tags */
+};
+
+THREAD_LOCAL struct process	*current_process = NULL;
+int				 process_workers = 0;	/* 0 = one per cpu */
+int				 process_timeout;	/* atom */
+
+static struct worker		*workers = NULL;
+static int			 nworkers;
+static THREAD_LOCAL struct worker *self = NULL;
+
+/*
+ * sched_lock guards everything from here down, the wait list, and
+ * the timers (timer.c.)
+ */
+static bhuna_lock_t		 sched_lock = LOCK_INITIALIZER;
+static struct process		*wait_head = NULL;
+static int			 procno = 1;
+static int			 live = 0;	/* processes not asleep */
+static int			 done = 0;	/* no more to run; stop */
+#ifdef THREADS
+static unsigned			 work_gen = 0;	/* bumped by each enqueue */
+static pthread_cond_t		 work_cv = PTHREAD_COND_INITIALIZER;
+static int			 idle = 0;	/* workers waiting on work_cv */
+static pthread_cond_t		 world_cv = PTHREAD_COND_INITIALIZER;
+static int			 running = 0;	/* workers in a timeslice */
+static int			 stopping = 0;	/* a collection is waiting */
+#endif
+
+static wchar_t		 timeout_name[] = L"timeout";
+
+static void		 mailbox_init(struct process *);
+static struct message	*mailbox_take(struct process *);
+static void		 message_free(struct message *);
+static void		 aside_remove(struct process *, struct message *);
+static void		 aside_free(struct process *);
+
+static void
+sched_init(void)
+{
+	int n;
+
+	nworkers = process_workers;
+#ifdef THREADS
+	if (nworkers <= 0)
+		nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nworkers <= 0)
+		nworkers = 1;
+#ifndef THREADS
+	nworkers = 1;
+#endif
+	workers = bhuna_malloc(sizeof(struct worker) * nworkers);
+	for (n = 0; n < nworkers; n++) {
+		LOCK_INIT(&workers[n].lock);
+		workers[n].head = NULL;
+		workers[n].tail = NULL;
+		workers[n].current = NULL;
+		workers[n].polls = TIMER_POLL;
+	}
+	self = &workers[0];
+
+#ifdef THREADS
+	{
+		pthread_condattr_t attr;
+
+		/* so that deadlines from timer_now() can be waited for */
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&work_cv, &attr);
+		pthread_condattr_destroy(&attr);
+	}
+#endif
+	process_timeout = atom_resolve(timeout_name);
+}
+
+static void
+enqueue(struct worker *w, struct process *p)
+{
+	LOCK(&w->lock);
+	p->next = NULL;
+	p->prev = w->tail;
+	if (w->tail != NULL)
+		w->tail->next = p;
+	else
+		w->head = p;
+	w->tail = p;
+	UNLOCK(&w->lock);
+
+#ifdef THREADS
+	if (nworkers > 1) {
+		LOCK(&sched_lock);
+		work_gen++;
+		if (idle > 0)
+			pthread_cond_broadcast(&work_cv);
+		UNLOCK(&sched_lock);
+	}
+#endif
+}
+
+static struct process *
+dequeue(struct worker *w)
 {
 	struct process *p;
 
+	LOCK(&w->lock);
+	if ((p = w->head) != NULL) {
+		w->head = p->next;
+		if (w->head != NULL)
+			w->head->prev = NULL;
+		else
+			w->tail = NULL;
+	}
+	UNLOCK(&w->lock);
+
+	return(p);
+}
+
+#ifdef THREADS
+static struct process *
+steal(struct worker *thief)
+{
+	struct worker *w;
+	struct process *p;
+	int n, start;
+
+	start = (int)(thief - workers);
+	for (n = 1; n < nworkers; n++) {
+		w = &workers[(start + n) % nworkers];
+		if (w->tail == NULL)	/* unlocked peek; rechecked below */
+			continue;
+		LOCK(&w->lock);
+		if ((p = w->tail) != NULL) {
+			w->tail = p->prev;
+			if (w->tail != NULL)
+				w->tail->next = NULL;
+			else
+				w->head = NULL;
+		}
+		UNLOCK(&w->lock);
+		if (p != NULL)
+			return(p);
+	}
+
+	return(NULL);
+}
+#endif
+
+static struct process *
+process_alloc(struct vm *vm)
+{
+	struct process *p;
+
+	if (workers == NULL)
+		sched_init();
+
 	p = bhuna_malloc(sizeof(struct process));
 	p->vm = vm;
+	p->asleep = PROCESS_AWAKE;
+	p->waiting = PROCESS_RECV;
+	p->timer_state = TIMER_NONE;
+	p->copied = 0;
+	heap_init(&p->heap);
+	mailbox_init(p);
+
+	LOCK(&sched_lock);
 	p->number = procno++;
-	p->msg_head = NULL;
-	p->asleep = 0;
-	p->next = run_head;
-	p->prev = NULL;
-	if (run_head != NULL)
-		run_head->prev = p;
-	run_head = p;
+	live++;
+	UNLOCK(&sched_lock);
 
 	return(p);
 }
 
+struct process *
+process_new(struct vm *vm)
+{
+	struct process *p;
+
+	p = process_alloc(vm);
+	enqueue(self != NULL ? self : &workers[0], p);
+
+	return(p);
+}
+
+/*
+ * Free a process which has finished.  It is in no queue, having been
+ * taken off one to be run.
+ */
 void
 process_free(struct process *p)
 {
+	struct message *m;
+
 	if (p == NULL) return;
 
 #ifdef DEBUG
 	if (trace_scheduling)
-		printf("vm activation stack hiwater was %d bytes\n",
-		    p->vm->astack_hi - p->vm->astack);
+		printf("process #%d %s its small stacks\n", p->number,
+		    p->vm->vstack == VM_SMALL_VSTACK(p->vm) &&
+		    p->vm->cstack == VM_SMALL_CSTACK(p->vm) &&
+		    p->vm->astack_big == NULL ? "kept to" : "outgrew");
+	if (trace_scheduling && p->copied > 0)
+		printf("process #%d copied %lu bytes into its messages\n",
+		    p->number, (unsigned long)p->copied);
 #endif
 
-	if (p->prev != NULL)
-		p->prev->next = p->next;
-	else if (p == run_head)
-		run_head = p->next;
-	else if (p == wait_head)
-		wait_head = p->next;
-
-	if (p->next != NULL)
-		p->next->prev = p->prev;
+	LOCK(&sched_lock);
+	live--;
+	UNLOCK(&sched_lock);
 
+	while ((m = mailbox_take(p)) != NULL)
+		message_free(m);
+	aside_free(p);
+	vm_free(p->vm);
+	heap_free(&p->heap);
 	bhuna_free(p);
 }
 
+/*
+ * Start a process running k.  Its first activation record is its own,
+ * in its own heap, but those enclosing it are shared with whoever else
+ * may have them.
+ */
 struct process *
 process_spawn(struct closure *k)
 {
 	struct vm *vm;
 	struct process *p;
+	struct heap *h;
 
 	vm = vm_new(current_process->vm->program, current_process->vm->prog_size);
 	vm_set_pc(vm, k->label);
+	vm_reserve(vm, k->need);
 
+	activation_share(k->ar);
+	p = process_alloc(vm);
+	h = heap_enter(&p->heap);
 	vm->current_ar = activation_new_on_heap(
 	    k->arity + k->locals, NULL, k->ar);
-
-	p = process_new(vm);
+	heap_enter(h);
+	enqueue(self != NULL ? self : &workers[0], p);
 #ifdef DEBUG
 	if (trace_scheduling)
 		printf("process #%d created\n", p->number);
@@ -81,15 +323,211 @@ process_spawn(struct closure *k)
 	return(p);
 }
 
+/*
+ * Call fn on every process there is.  Only for use while the world is
+ * stopped (see process_stop_world()), when nothing else can touch
+ * the queues.
+ */
+void
+process_walk(void (*fn)(struct process *))
+{
+	struct process *p;
+	int n;
+
+	for (n = 0; n < nworkers; n++) {
+		for (p = workers[n].head; p != NULL; p = p->next)
+			fn(p);
+		if (workers[n].current != NULL)
+			fn(workers[n].current);
+	}
+	for (p = wait_head; p != NULL; p = p->next)
+		fn(p);
+}
+
+/******** MAILBOXES ********/
+
+/*
+ * A mailbox is a queue of messages with any number of senders, on any
+ * worker, and one receiver, its process.  It needs no lock: senders
+ * swap themselves in at mb_in and then link the one before them to
+ * themselves, and the receiver takes messages off at mb_out.  mb_stub
+ * keeps the queue from ever being empty, so that a sender always has
+ * a message to link from.  A message whose sender has swapped itself
+ * in but not linked yet is not received until it has.  The mailbox
+ * is empty when mb_in is the stub.
+ *
+ * Message nodes come from the pools (see pool.c), so sending mostly
+ * does not call malloc.  A node goes back to the pool of the worker
+ * which received it.
+ */
+static struct message *
+message_new(void)
+{
+	return(pool_alloc(sizeof(struct message)));
+}
+
+static void
+message_free(struct message *m)
+{
+	pool_free(m, sizeof(struct message));
+}
+
+static void
+mailbox_init(struct process *p)
+{
+	p->mb_stub.next = NULL;
+	V_SET_NULL(p->mb_stub.payload);
+	p->mb_stub.copies = NULL;
+	p->mb_stub.shared = 0;
+	p->mb_shared = 0;
+	p->mb_in = &p->mb_stub;
+	p->mb_out = &p->mb_stub;
+	p->aside = NULL;
+	p->pick_vm = NULL;
+}
+
+static void
+mailbox_put(struct process *p, struct message *m)
+{
+	struct message *prev;
+
+	m->next = NULL;
+#ifdef THREADS
+	prev = ATOMIC_XCHG(&p->mb_in, m);
+	ATOMIC_STORE(&prev->next, m);
+#else
+	prev = p->mb_in;
+	p->mb_in = m;
+	prev->next = m;
+#endif
+}
+
+/*
+ * Take the oldest message from the mailbox of p, which must be the
+ * process calling, or NULL if there is none yet.
+ */
+static struct message *
+mailbox_next(struct process *p)
+{
+	struct message *out, *next;
+
+	out = p->mb_out;
+	next = ATOMIC_LOAD(&out->next);
+	if (out == &p->mb_stub) {
+		if (next == NULL)
+			return(NULL);
+		p->mb_out = out = next;
+		next = ATOMIC_LOAD(&out->next);
+	}
+	if (next != NULL) {
+		p->mb_out = next;
+		return(out);
+	}
+	if (out != ATOMIC_LOAD(&p->mb_in))
+		return(NULL);		/* a sender is linking up */
+	mailbox_put(p, &p->mb_stub);
+	if ((next = ATOMIC_LOAD(&out->next)) != NULL) {
+		p->mb_out = next;
+		return(out);
+	}
+	return(NULL);
+}
+
+/*
+ * Likewise, and make what was copied for the message p's own.
+ */
+static struct message *
+mailbox_take(struct process *p)
+{
+	struct message *m;
+
+	if ((m = mailbox_next(p)) == NULL)
+		return(NULL);
+	if (m->copies != NULL) {
+		heap_take(&p->heap, m->copies, m->bytes);
+		m->copies = NULL;
+	}
+	if (m->shared)
+		ATOMIC_ADD(&p->mb_shared, -1);
+	return(m);
+}
+
+static int
+mailbox_empty(struct process *p)
+{
+	return(ATOMIC_LOAD(&p->mb_in) == &p->mb_stub);
+}
+
+/*
+ * Call fn on the payload of each message p has put aside.  Only by p,
+ * or while the world is stopped.
+ */
+void
+process_walk_aside(struct process *p, void (*fn)(struct value))
+{
+	struct message *m;
+
+	if (p->aside != NULL)
+		for (m = p->aside->head; m != NULL; m = m->next)
+			fn(m->payload);
+}
+
+/*
+ * Call fn on the payload of each message still in the mailbox of p
+ * which refers to anything shared; the rest refer only to their own
+ * copies, which the collector has no need to see until p receives
+ * them, and p counts those which do, so that a mailbox with none
+ * isn't looked through at all.  Only while the world is stopped.
+ */
+void
+process_walk_mailbox(struct process *p, void (*fn)(struct value))
+{
+	struct message *m;
+
+	if (p->mb_shared == 0)
+		return;
+	for (m = p->mb_out; m != NULL; m = m->next)
+		if (m->shared)
+			fn(m->payload);
+}
+
+/*
+ * Call fn on each value copied for those messages.
+ */
+void
+process_walk_copies(struct process *p, void (*fn)(struct s_value *))
+{
+	struct message *m;
+	struct s_value *sv;
+
+	if (p->mb_shared == 0)
+		return;
+	for (m = p->mb_out; m != NULL; m = m->next)
+		if (m->shared)
+			for (sv = m->copies; sv != NULL; sv = sv->next)
+				fn(sv);
+}
+
+/*
+ * Send v to p.  What p receives must be its own: anything in v which
+ * could still change is copied (see value_copy()), and the cost of
+ * that is counted against the sender.  Frozen values are not copied,
+ * but shared.  The copies are made in a heap of the message's own,
+ * and become part of p's when p receives it.
+ */
 void
 process_send(struct process *p, struct value v)
 {
 	struct message *m;
+	struct heap copies, *h;
 
-	m = bhuna_malloc(sizeof(struct message));
-	m->next = p->msg_head;
-	p->msg_head = m;
-	m->payload = v;
+	m = message_new();
+	heap_init(&copies);
+	h = heap_enter(&copies);
+	m->payload = value_copy(v, &current_process->copied, &m->shared);
+	heap_enter(h);
+	m->copies = copies.sv_head;
+	m->bytes = copies.bytes;
 
 #ifdef DEBUG
 	if (trace_scheduling) {
@@ -100,130 +538,790 @@ process_send(struct process *p, struct value v)
 	}
 #endif
 
+	if (m->shared)
+		ATOMIC_ADD(&p->mb_shared, 1);
+	mailbox_put(p, m);
 	process_awaken(p);
 }
 
+static void
+received(struct message *m, struct value *v)
+{
+	*v = m->payload;
+	message_free(m);
+	current_process->timer_state = TIMER_NONE;
+
+#ifdef DEBUG
+	if (trace_scheduling) {
+		printf("received in process #%d: ",
+		    current_process->number);
+		value_print(*v);
+		printf("\n");
+	}
+#endif
+}
+
 /*
  * Returns 1 if a message was obtained from the mailbox,
  * 0 if there were no messages waiting (indicating: go to sleep.)
+ * Messages are received in the order they were sent, and a process
+ * receives all those waiting before it sleeps again.  Any which Pick
+ * has put aside are older than those still in the mailbox.
  */
 int
 process_recv(struct value *v)
 {
+	struct process *p = current_process;
 	struct message *m;
 
-	if (current_process->msg_head == NULL)
+	if (p->aside != NULL && (m = p->aside->head) != NULL)
+		aside_remove(p, m);
+	else if ((m = mailbox_take(p)) == NULL)
 		return(0);
 
-	m = current_process->msg_head;
-	*v = m->payload;
-	current_process->msg_head = m->next;
-	bhuna_free(m);
+	received(m, v);
+	return(1);
+}
 
-#ifdef DEBUG
-	if (trace_scheduling) {
-		printf("received in process #%d: ",
-		    current_process->number);
-		value_print(*v);
-		printf("\n");
+/******** PICKING MESSAGES ********/
+
+/*
+ * Pick receives the oldest message which matches: whose first element
+ * is a given tag, or for which a given closure returns true.  Messages
+ * it passes over are taken out of the mailbox and put aside, in the
+ * order they came, for a later Recv or Pick; only the receiver ever
+ * sees them there, so none of this is locked.
+ *
+ * Messages put aside whose first element is an integer, boolean,
+ * atom or pid are also chained by that tag, in a small hash table,
+ * so that picking by tag goes straight to the oldest with the tag
+ * instead of looking through all of those put aside.
+ */
+#define	TAG_BUCKETS	16	/* to begin with; doubled as needed */
+
+struct tagq {
+	struct tagq	*next;		/* in its bucket */
+	struct value	 tag;
+	struct message	*head;		/* oldest put aside with tag, */
+	struct message	*tail;		/* chained through same */
+};
+
+static int
+tag_ok(struct value t)
+{
+	switch (V_TYPE(t)) {
+	case VALUE_INTEGER:
+	case VALUE_BOOLEAN:
+	case VALUE_ATOM:
+	case VALUE_OPAQUE:
+		return(1);
+	default:
+		return(0);
 	}
-#endif
+}
 
-	return(1);
+/*
+ * The tag of a message, if it has one it can be picked by.
+ */
+static int
+tag_of(struct value v, struct value *t)
+{
+	if (V_TYPE(v) != VALUE_LIST || LIST_LENGTH(V_SV(v)->v.l) == 0)
+		return(0);
+	*t = V_SV(v)->v.l->value[0];
+	return(tag_ok(*t));
 }
 
-void
-process_sleep(struct process *p)
+static int
+tag_equal(struct value a, struct value b)
+{
+	if (V_TYPE(a) != V_TYPE(b))
+		return(0);
+	if (V_TYPE(a) == VALUE_OPAQUE)
+		return(V_PTR(a) == V_PTR(b));
+	return(V_INT(a) == V_INT(b));
+}
+
+static unsigned int
+tag_hash(struct value t)
+{
+	unsigned long h;
+
+	if (V_TYPE(t) == VALUE_OPAQUE)
+		h = (unsigned long)V_PTR(t) >> 4;
+	else
+		h = (unsigned int)V_INT(t);
+	return((unsigned int)((h + V_TYPE(t)) * 2654435761UL));
+}
+
+static struct tagq **
+tag_bucket(struct aside *a, struct value t)
 {
-	if (p == NULL || p->asleep)
+	return(&a->tags[tag_hash(t) & (a->buckets - 1)]);
+}
+
+static struct tagq *
+tag_find(struct aside *a, struct value t)
+{
+	struct tagq *q;
+
+	if (a == NULL || a->tags == NULL)
+		return(NULL);
+	for (q = *tag_bucket(a, t); q != NULL; q = q->next)
+		if (tag_equal(q->tag, t))
+			return(q);
+	return(NULL);
+}
+
+static void
+tag_grow(struct aside *a)
+{
+	struct tagq **old = a->tags, *q, *q_next, **b;
+	int n = a->buckets, i;
+
+	a->buckets = n == 0 ? TAG_BUCKETS : n * 2;
+	a->tags = bhuna_malloc(a->buckets * sizeof(struct tagq *));
+	for (i = 0; i < a->buckets; i++)
+		a->tags[i] = NULL;
+	for (i = 0; i < n; i++) {
+		for (q = old[i]; q != NULL; q = q_next) {
+			q_next = q->next;
+			b = tag_bucket(a, q->tag);
+			q->next = *b;
+			*b = q;
+		}
+	}
+	if (old != NULL)
+		bhuna_free(old);
+}
+
+/*
+ * Put m aside, after all the others.  Most processes never Pick, so
+ * a process has nowhere to put messages aside until it first needs it.
+ */
+static void
+aside_put(struct process *p, struct message *m)
+{
+	struct aside *a;
+	struct tagq *q, **b;
+	struct value t;
+
+	if ((a = p->aside) == NULL) {
+		a = p->aside = bhuna_malloc(sizeof(struct aside));
+		a->head = a->tail = NULL;
+		a->tags = NULL;
+		a->buckets = 0;
+		a->count = 0;
+	}
+	m->next = NULL;
+	m->same = NULL;
+	if ((m->prev = a->tail) != NULL)
+		a->tail->next = m;
+	else
+		a->head = m;
+	a->tail = m;
+
+	if (!tag_of(m->payload, &t))
+		return;
+	if ((q = tag_find(a, t)) == NULL) {
+		if (a->count >= a->buckets)
+			tag_grow(a);
+		q = bhuna_malloc(sizeof(struct tagq));
+		q->tag = t;
+		q->head = NULL;
+		b = tag_bucket(a, t);
+		q->next = *b;
+		*b = q;
+		a->count++;
+	}
+	if (q->head == NULL)
+		q->head = m;
+	else
+		q->tail->same = m;
+	q->tail = m;
+}
+
+/*
+ * Take m, which was put aside, back.  If it is the oldest with its
+ * tag, as it is unless a predicate picked it, this takes constant time.
+ */
+static void
+aside_remove(struct process *p, struct message *m)
+{
+	struct aside *a = p->aside;
+	struct tagq *q, **qp;
+	struct message *before = NULL, *n;
+	struct value t;
+
+	if (m->prev != NULL)
+		m->prev->next = m->next;
+	else
+		a->head = m->next;
+	if (m->next != NULL)
+		m->next->prev = m->prev;
+	else
+		a->tail = m->prev;
+
+	if (!tag_of(m->payload, &t))
 		return;
+	for (qp = tag_bucket(a, t); !tag_equal((*qp)->tag, t); qp = &(*qp)->next)
+		;
+	q = *qp;
+	for (n = q->head; n != m; n = n->same)
+		before = n;
+	if (before == NULL)
+		q->head = m->same;
+	else
+		before->same = m->same;
+	if (q->tail == m)
+		q->tail = before;
+	if (q->head == NULL) {
+		*qp = q->next;
+		bhuna_free(q);
+		a->count--;
+	}
+}
+
+static void
+aside_free(struct process *p)
+{
+	struct aside *a = p->aside;
+	struct message *m;
+	struct tagq *q;
+	int i;
+
+	if (a == NULL)
+		return;
+	while ((m = a->head) != NULL) {
+		a->head = m->next;
+		message_free(m);
+	}
+	for (i = 0; i < a->buckets; i++) {
+		while ((q = a->tags[i]) != NULL) {
+			a->tags[i] = q->next;
+			bhuna_free(q);
+		}
+	}
+	if (a->tags != NULL)
+		bhuna_free(a->tags);
+	bhuna_free(a);
+	p->aside = NULL;
+}
+
+/*
+ * Call the closure k on v, on a vm of its own, to completion; return
+ * whether it returned true.  While it runs, the collector finds that
+ * vm through the process (see gc.c.)  It runs as p, in the middle of
+ * looking through p's messages, so it may not receive any (Recv and
+ * Pick in it are errors; see process_picking()), nor wait (Sleep in it
+ * is over at once.)
+ */
+static int
+pick_test(struct process *p, struct closure *k, struct value v)
+{
+	struct vm *vm;
+	struct value r;
+	int status;
+
+	vm = vm_new(p->vm->program, p->vm->prog_size);
+	vm_set_pc(vm, k->label);
+	vm_reserve(vm, k->need);
+	vm->current_ar = activation_new_on_heap(
+	    k->arity + k->locals, NULL, k->ar);
+	if (k->arity > 0)
+		activation_initialize_value(vm->current_ar, 0, v);
+
+	p->pick_vm = vm;
+	while ((status = vm_run(vm, TIMESLICE)) == VM_TIME_EXPIRED)
+		;
+	V_SET_NULL(r);
+	if (status == VM_RETURNED && vm->vstack_ptr > vm->vstack)
+		r = vm->vstack_ptr[-1];
+	p->pick_vm = NULL;
+	vm_free(vm);
+
+	return(V_TYPE(r) == VALUE_BOOLEAN && V_BOOL(r));
+}
+
+static int
+pick_match(struct process *p, struct value pattern, struct message *m)
+{
+	struct value t;
+
+	if (V_TYPE(pattern) == VALUE_CLOSURE)
+		return(pick_test(p, V_SV(pattern)->v.k, m->payload));
+	return(tag_of(m->payload, &t) && tag_equal(t, pattern));
+}
 
-	/* remove from run list, add to wait list */
+/*
+ * Nonzero if the current process is running a Pick predicate, and so
+ * may not receive.
+ */
+int
+process_picking(void)
+{
+	return(current_process->pick_vm != NULL);
+}
+
+/*
+ * Like process_recv(), but only for a message which matches pattern:
+ * a closure of one argument returning a boolean, or a tag.  Returns
+ * -1 if pattern is neither.
+ */
+int
+process_pick(struct value pattern, struct value *v)
+{
+	struct process *p = current_process;
+	struct message *m;
+	struct tagq *q;
+
+	if (V_TYPE(pattern) == VALUE_CLOSURE) {
+		for (m = p->aside != NULL ? p->aside->head : NULL;
+		     m != NULL; m = m->next) {
+			if (pick_test(p, V_SV(pattern)->v.k, m->payload)) {
+				aside_remove(p, m);
+				received(m, v);
+				return(1);
+			}
+		}
+	} else if (tag_ok(pattern)) {
+		if ((q = tag_find(p->aside, pattern)) != NULL) {
+			aside_remove(p, m = q->head);
+			received(m, v);
+			return(1);
+		}
+	} else {
+		return(-1);
+	}
+
+	while ((m = mailbox_take(p)) != NULL) {
+		if (pick_match(p, pattern, m)) {
+			received(m, v);
+			return(1);
+		}
+		aside_put(p, m);
+	}
+
+	return(0);
+}
+
+/*
+ * Take p off the wait list, and its timer, if any, out of the wheel.
+ * Called with sched_lock held.
+ */
+static void
+wait_remove(struct process *p)
+{
+	if (p->timer_state == TIMER_ARMED) {
+		timer_cancel(&p->timer);
+		p->timer_state = TIMER_HELD;
+	}
 	if (p->prev != NULL)
 		p->prev->next = p->next;
-	else if (p == run_head)
-		run_head = p->next;
-
+	else
+		wait_head = p->next;
 	if (p->next != NULL)
 		p->next->prev = p->prev;
+	live++;
+}
 
+static void
+wait_unlink(struct process *p)
+{
+	LOCK(&sched_lock);
+	wait_remove(p);
+	UNLOCK(&sched_lock);
+}
+
+/*
+ * Put a process which has to wait (see process_wait()) on the wait list.
+ * Returns 0, and leaves it be, if what it waits for has happened since.
+ *
+ * A sender puts its message in the mailbox before it looks at asleep,
+ * and the process sets asleep before it looks at the mailbox again,
+ * so at least one of them sees the other; whichever clears asleep
+ * first is the one to put the process back to run.  A timer which
+ * fires is marked fired before asleep is looked at, so the same goes
+ * for it.
+ */
+int
+process_sleep(struct process *p)
+{
+	unsigned long now;
+
+	/* the timer is the process's own till it is in the wheel */
+	if (p->timer_state == TIMER_SET || p->timer_state == TIMER_HELD) {
+		now = timer_now();
+		if (p->timer_state == TIMER_SET)
+			p->timer.expires = now + (unsigned long)p->timeout;
+		LOCK(&sched_lock);
+		timer_add(&p->timer, now);
+		p->timer_state = TIMER_ARMED;
+	} else {
+		LOCK(&sched_lock);
+	}
 	p->prev = NULL;
 	p->next = wait_head;
 	if (wait_head != NULL)
 		wait_head->prev = p;
 	wait_head = p;
+	live--;
+	UNLOCK(&sched_lock);
+
+	ATOMIC_STORE(&p->asleep, p->waiting);
+	if (((p->waiting == PROCESS_RECV && !mailbox_empty(p)) ||
+	    ATOMIC_LOAD(&p->timer_state) == TIMER_FIRED) &&
+	    ATOMIC_CAS(&p->asleep, p->waiting, PROCESS_AWAKE)) {
+		wait_unlink(p);
+		return(0);
+	}
 
-	p->asleep = 1;
+	return(1);
 }
 
+/*
+ * If p is asleep in Recv, move it from the wait list to the current
+ * worker's queue.
+ */
 void
 process_awaken(struct process *p)
 {
-	if (p == NULL || !p->asleep)
+	if (p == NULL || ATOMIC_LOAD(&p->asleep) != PROCESS_RECV ||
+	    !ATOMIC_CAS(&p->asleep, PROCESS_RECV, PROCESS_AWAKE))
 		return;
 
-	/* remove from run list, add to run list */
-	if (p->prev != NULL)
-		p->prev->next = p->next;
-	else if (p == wait_head)
-		wait_head = p->next;
+	wait_unlink(p);
+	enqueue(self, p);
+}
 
-	if (p->next != NULL)
-		p->next->prev = p->prev;
+/******** TIMERS ********/
 
-	p->prev = NULL;
-	p->next = run_head;
-	if (run_head != NULL)
-		run_head->prev = p;
-	run_head = p;
+/*
+ * Called by the vm when the current process is to wait: in Recv
+ * (what is PROCESS_RECV) for a message, or for at most ms milliseconds
+ * if ms is not negative; or in Sleep (PROCESS_SLEEP) for ms.  Returns
+ * 1 if the wait is over because the time is up, or 0 if it is to wait
+ * (return VM_WAITING) and then try again.
+ */
+int
+process_wait(int what, int ms)
+{
+	struct process *p = current_process;
+
+	if (p->pick_vm != NULL)
+		return(1);
+	p->waiting = what;
+	if (p->timer_state == TIMER_FIRED) {
+		p->timer_state = TIMER_NONE;
+		return(1);
+	}
+	if (ms == 0)
+		return(1);
+	if (ms > 0 && p->timer_state == TIMER_NONE) {
+		p->timeout = ms;
+		p->timer_state = TIMER_SET;
+	}
 
-	p->asleep = 0;
+	return(0);
 }
 
-/******** SCHEDULER ********/
+/*
+ * Fire the timers which are due, and put those of their processes
+ * which are asleep on w's queue.
+ */
+static void
+timers_run(struct worker *w)
+{
+	struct timer *t, *t_next;
+	struct process *p, *wake = NULL, **tail = &wake;
+	unsigned long now;
+	int a;
+
+	/* unlocked peeks; at most once a tick gets past them */
+	if (timer_count() == 0 || !timer_due(now = timer_now()))
+		return;
+
+	LOCK(&sched_lock);
+	for (t = timer_expire(now); t != NULL; t = t_next) {
+		t_next = t->next;
+		p = PROCESS_OF(t);
+		ATOMIC_STORE(&p->timer_state, TIMER_FIRED);
+#ifdef DEBUG
+		if (trace_scheduling)
+			printf("process #%d timed out\n", p->number);
+#endif
+		if ((a = ATOMIC_LOAD(&p->asleep)) != PROCESS_AWAKE &&
+		    ATOMIC_CAS(&p->asleep, a, PROCESS_AWAKE)) {
+			wait_remove(p);
+			*tail = p;
+			tail = &p->next;
+		}
+	}
+	*tail = NULL;
+	UNLOCK(&sched_lock);
+
+	while ((p = wake) != NULL) {
+		wake = p->next;
+		enqueue(w, p);
+	}
+}
+
+/******** STOPPING THE WORLD ********/
+
+/*
+ * The collector may only run while no other worker is in a timeslice.
+ * A worker which wants to collect calls process_stop_world() from inside
+ * its own; if that returns 1, the other workers are held between
+ * timeslices until it calls process_start_world().  If it returns 0,
+ * another worker collected meanwhile, and there is no need to.
+ */
+int
+process_stop_world(void)
+{
+#ifdef THREADS
+	if (nworkers == 1)
+		return(1);
+	LOCK(&sched_lock);
+	if (stopping) {
+		if (--running == 0)
+			pthread_cond_broadcast(&world_cv);
+		while (stopping)
+			pthread_cond_wait(&world_cv, &sched_lock);
+		running++;
+		UNLOCK(&sched_lock);
+		return(0);
+	}
+	stopping = 1;
+	running--;
+	while (running > 0)
+		pthread_cond_wait(&world_cv, &sched_lock);
+	UNLOCK(&sched_lock);
+#endif
+	return(1);
+}
 
 void
-process_scheduler(void)
+process_start_world(void)
 {
-	struct process *next;
+#ifdef THREADS
+	if (nworkers == 1)
+		return;
+	LOCK(&sched_lock);
+	stopping = 0;
+	running++;
+	pthread_cond_broadcast(&world_cv);
+	UNLOCK(&sched_lock);
+#endif
+}
+
+/*
+ * Begin a timeslice (or a look for one): wait out any collection,
+ * and return the work generation, for worker_wait().  A lone worker
+ * has no one to wait for.
+ */
+static unsigned
+world_enter(void)
+{
+	unsigned gen = 0;
+
+#ifdef THREADS
+	if (nworkers == 1)
+		return(gen);
+	LOCK(&sched_lock);
+	while (stopping)
+		pthread_cond_wait(&world_cv, &sched_lock);
+	running++;
+	gen = work_gen;
+	UNLOCK(&sched_lock);
+#endif
+	return(gen);
+}
 
-	if ((current_process = run_head) == NULL)
+static void
+world_leave(void)
+{
+#ifdef THREADS
+	if (nworkers == 1)
 		return;
+	LOCK(&sched_lock);
+	if (--running == 0 && stopping)
+		pthread_cond_broadcast(&world_cv);
+	UNLOCK(&sched_lock);
+#endif
+}
+
+/******** SCHEDULER ********/
+
+/*
+ * Wait, with sched_lock held, for at most ms milliseconds, or until
+ * there is work if ms is negative.
+ */
+static void
+worker_idle(long ms)
+{
+	struct timespec ts;
+
+#ifdef THREADS
+	idle++;
+	if (ms < 0) {
+		pthread_cond_wait(&work_cv, &sched_lock);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		ts.tv_sec += ms / 1000;
+		ts.tv_nsec += (ms % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&work_cv, &sched_lock, &ts);
+	}
+	idle--;
+#else
+	/* there is no one else to give us work */
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * Nothing to run was found.  Wait until something has been queued
+ * since gen, or a timer may be due; return 0 if instead there is
+ * nothing left to run, and no timer to wait for, at all.
+ */
+static int
+worker_wait(unsigned gen)
+{
+	long ms;
+	int more;
+
+#ifndef THREADS
+	(void)gen;
+#endif
+	LOCK(&sched_lock);
+#ifdef THREADS
+	/* one in a timeslice may yet take back a process it put to sleep */
+	if (live == 0 && running == 0 && timer_count() == 0) {
+#else
+	if (live == 0 && timer_count() == 0) {
+#endif
+		done = 1;
+#ifdef THREADS
+		pthread_cond_broadcast(&work_cv);
+#endif
+	}
+#ifdef THREADS
+	if (!done && work_gen == gen) {
+		if ((ms = timer_next(timer_now())) != 0)
+			worker_idle(ms);
+	}
+#else
+	if (!done && (ms = timer_next(timer_now())) > 0)
+		worker_idle(ms);
+#endif
+	more = !done;
+	UNLOCK(&sched_lock);
+
+	return(more);
+}
 
-	for (;;) {
-		next = current_process->next;
+static void
+worker_slice(struct worker *w, struct process *p)
+{
+	w->current = p;
+	current_process = p;
+	current_heap = &p->heap;
 #ifdef DEBUG
-		if (trace_scheduling)
-			printf("context switched to process #%d\n", current_process->number);
+	if (trace_scheduling)
+		printf("context switched to process #%d\n", p->number);
 #endif
-		switch (vm_run(current_process->vm, TIMESLICE)) {
-		case VM_TERMINATED:
+	if (p->heap.lazy || global_unswept != NULL)
+		gc_sweep(p);
+	if (p->heap.marking)
+		gc_step(p);
+	switch (vm_run(p->vm, TIMESLICE)) {
+	case VM_TERMINATED:
 #ifdef DEBUG
-			if (trace_scheduling)
-				printf("process #%d terminated\n", current_process->number);
+		if (trace_scheduling)
+			printf("process #%d terminated\n", p->number);
 #endif
-			process_free(current_process);
-			break;
-		case VM_RETURNED:
+		process_free(p);
+		break;
+	case VM_RETURNED:
 #ifdef DEBUG
-			if (trace_scheduling)
-				printf("process #%d returned\n", current_process->number);
+		if (trace_scheduling)
+			printf("process #%d returned\n", p->number);
 #endif
-			process_free(current_process);
-			break;
-		case VM_WAITING:
+		process_free(p);
+		break;
+	case VM_WAITING:
 #ifdef DEBUG
-			if (trace_scheduling)
-				printf("process #%d falling asleep\n", current_process->number);
-#endif
-			process_sleep(current_process);
-			break;
-		case VM_TIME_EXPIRED:
-		default:
-			break;
-		}
-		if ((current_process = next) == NULL)
-			if ((current_process = run_head) == NULL)
-				return;
+		if (trace_scheduling)
+			printf("process #%d falling asleep\n", p->number);
+#endif
+		if (!process_sleep(p))
+			enqueue(w, p);
+		break;
+	case VM_TIME_EXPIRED:
+	default:
+		enqueue(w, p);
+		break;
 	}
+	current_process = NULL;
+	current_heap = &global_heap;
+	w->current = NULL;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct process *p;
+	unsigned gen;
+
+	self = w;
+	do {
+		gen = world_enter();
+		p = dequeue(w);
+		/* reading the clock costs; do it now and then, or when idle */
+		if (p == NULL || --w->polls == 0) {
+			w->polls = TIMER_POLL;
+			timers_run(w);
+			if (p == NULL)
+				p = dequeue(w);
+		}
+#ifdef THREADS
+		if (p == NULL)
+			p = steal(w);
+#endif
+		if (p != NULL)
+			worker_slice(w, p);
+		if (gcstat_wanted)
+			gcstat_poll();
+		world_leave();
+	} while (p != NULL || worker_wait(gen));
+
+	pool_flush();
+	return(NULL);
+}
+
+void
+process_scheduler(void)
+{
+#ifdef THREADS
+	int n;
+#endif
+
+	if (workers == NULL)
+		sched_init();
+	done = 0;
+#ifdef THREADS
+	for (n = 1; n < nworkers; n++)
+		pthread_create(&workers[n].thread, NULL, worker_main, &workers[n]);
+#endif
+	worker_main(&workers[0]);
+#ifdef THREADS
+	for (n = 1; n < nworkers; n++)
+		pthread_join(workers[n].thread, NULL);
+#endif
 }
@@ -2,37 +2,74 @@
 #define	__PROCESS_H_
 
 #include "value.h"
+#include "thread.h"
+#include "timer.h"
+#include "gc.h"
 
 struct vm;
 struct closure;
 
+struct message {
+	struct message	*next;		/* in the mailbox, or put aside */
+	struct message	*prev;		/* put aside: the one before */
+	struct message	*same;		/* put aside: the next with its tag */
+	struct value	 payload;
+	struct s_value	*copies;	/* made for it, in no heap yet */
+	size_t		 bytes;		/* in copies */
+	int		 shared;	/* refers to anything shared (gc.c) */
+};
+
+struct aside;
+
+/*
+ * What a process is waiting for, and so what may wake it.
+ */
+#define	PROCESS_AWAKE	0
+#define	PROCESS_RECV	1	/* a message, or its timer */
+#define	PROCESS_SLEEP	2	/* its timer only */
+
 struct process {
-	int		 asleep;
+	int		 asleep;	/* on the wait list: what for */
+	int		 waiting;	/* what for, once it sleeps */
+	int		 timer_state;	/* of timer; see process_wait() */
+	int		 timeout;	/* ms, till the timer is first added */
+	struct timer	 timer;		/* Recv timeout or Sleep */
 	int		 number;
-	struct process	*next;
+	struct process	*next;		/* in a run queue or the wait list */
 	struct process	*prev;
 	struct vm	*vm;
-	struct message	*msg_head;
-};
-
-struct message {
-	struct message	*next;
-	struct value	 payload;
+	struct vm	*pick_vm;	/* running a Pick predicate, if any */
+	struct message	*mb_in;		/* mailbox: last message sent, */
+	struct message	*mb_out;	/* and next to be received */
+	struct message	 mb_stub;
+	int		 mb_shared;	/* messages in it referring to such */
+	struct aside	*aside;		/* passed over by Pick, if any */
+	size_t		 copied;	/* bytes, into messages it sent */
+	struct heap	 heap;		/* what it has allocated */
 };
 
-extern struct process *current_process;
-extern struct process *run_head;
-extern struct process *wait_head;
+extern THREAD_LOCAL struct process *current_process;
+extern int process_workers;
+extern int process_timeout;
 
 struct process	*process_new(struct vm *);
 void		 process_free(struct process *);
 void		 process_scheduler(void);
 struct process	*process_spawn(struct closure *);
+void		 process_walk(void (*)(struct process *));
+void		 process_walk_aside(struct process *, void (*)(struct value));
+void		 process_walk_mailbox(struct process *, void (*)(struct value));
+void		 process_walk_copies(struct process *, void (*)(struct s_value *));
+int		 process_stop_world(void);
+void		 process_start_world(void);
 
 void		 process_send(struct process *, struct value);
 int		 process_recv(struct value *);
+int		 process_pick(struct value, struct value *);
+int		 process_picking(void);
+int		 process_wait(int, int);
 
-void		 process_sleep(struct process *);
+int		 process_sleep(struct process *);
 void		 process_awaken(struct process *);
 
 #endif
@@ -0,0 +1,236 @@
+/*
+ * stack.c
+ * Growable stacks for the vm.
+ *
+ * Each stack is a single mapping, reserved at its maximum size up front:
+ * a small header, then the stack proper.  Only the first part of it is
+ * accessible to begin with; the rest is mapped PROT_NONE.  Pushing past
+ * the accessible part faults, and the SIGSEGV handler makes more of it
+ * accessible and returns, restarting the instruction.  So a stack never
+ * moves and nothing pointing into it needs fixing up, and pushes need
+ * no test for overflow: a process only pays for as much stack as it
+ * has touched.
+ *
+ * The last page of the mapping is never made accessible.  A stack which
+ * reaches it has overflowed, and the program stops with an error.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define	_POSIX_C_SOURCE	200112L	/* siginfo_t, even with ANSI=1 */
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "stack.h"
+#include "thread.h"
+
+struct stack {
+	unsigned char	**slot;		/* where its base is published */
+	size_t		 committed;	/* accessible bytes, incl. header */
+	size_t		 reserved;	/* mapped bytes, incl. guard page */
+};
+
+#define	STACK_HEADER	((sizeof(struct stack) + 15) & ~(size_t)15)
+
+/*
+ * Where each live stack begins, for stack_fault(), which can't take a
+ * lock (it runs in a signal handler): slots in chunks which are never
+ * freed, each NULL or a stack's base.  A slot is filled in after the
+ * stack's header is, and emptied before the stack is unmapped.  Only
+ * the holder of stack_lock changes the table, or the list of free slots.
+ */
+#define	SLOTS_PER_CHUNK	256
+
+struct slots {
+	struct slots	*next;
+	unsigned char	*base[SLOTS_PER_CHUNK];
+};
+
+static struct slots	*slots_head = NULL;
+static unsigned char	***free_slot = NULL;
+static size_t		 free_slots = 0;
+static size_t		 free_slot_room = 0;
+
+static size_t		 page_size = 0;
+static int		 zero_fd = -1;
+static struct sigaction	 old_segv;
+static bhuna_lock_t	 stack_lock = LOCK_INITIALIZER;	/* guards the table */
+
+void
+stack_overflow(void)
+{
+	static const char msg[] = "bhuna: stack overflow\n";
+
+	write(2, msg, sizeof(msg) - 1);
+	_exit(1);
+}
+
+/*
+ * If the fault is in the inaccessible part of one of our stacks, make
+ * enough of it accessible, at least doubling what was, and return to
+ * retry.  If it's in a guard page, the stack has overflowed.  Anything
+ * else isn't ours; put back the old handler and let it fault again.
+ *
+ * The stack a fault is in, if any, is the one with the nearest base at
+ * or below it.  That stack is live, since it is being written to, so
+ * its header may be read.  (A stack being freed meanwhile by another
+ * thread can only be the nearest if the fault isn't in any stack, and
+ * then reading its header at worst faults again, which is as fatal.)
+ */
+static void
+stack_fault(int sig, siginfo_t *si, void *context)
+{
+	unsigned char *addr = si->si_addr, *base = NULL, *b;
+	struct slots *c;
+	struct stack *s;
+	size_t want, limit;
+	int i;
+
+	(void)sig;
+	(void)context;
+	for (c = ATOMIC_LOAD(&slots_head); c != NULL; c = c->next) {
+		for (i = 0; i < SLOTS_PER_CHUNK; i++) {
+			b = ATOMIC_LOAD(&c->base[i]);
+			if (b != NULL && b <= addr && (base == NULL || b > base))
+				base = b;
+		}
+	}
+	if (base != NULL) {
+		s = (struct stack *)base;
+		if (addr >= base + s->committed && addr < base + s->reserved) {
+			limit = s->reserved - page_size;
+			if (addr >= base + limit)
+				stack_overflow();
+			for (want = s->committed * 2; base + want <= addr;
+			     want *= 2)
+				;
+			if (want > limit)
+				want = limit;
+			if (mprotect(base, want, PROT_READ | PROT_WRITE) != 0)
+				stack_overflow();
+			s->committed = want;
+			return;
+		}
+	}
+	sigaction(SIGSEGV, &old_segv, NULL);
+}
+
+static void
+stack_init(void)
+{
+	struct sigaction sa;
+
+	page_size = (size_t)sysconf(_SC_PAGESIZE);
+	if ((zero_fd = open("/dev/zero", O_RDWR)) < 0) {
+		perror("/dev/zero");
+		exit(1);
+	}
+	sa.sa_sigaction = stack_fault;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGSEGV, &sa, &old_segv);
+}
+
+/*
+ * Give s a slot, and publish its base there.  Called with stack_lock
+ * held.
+ */
+static void
+slot_take(struct stack *s)
+{
+	struct slots *c;
+	size_t i;
+
+	if (free_slots == 0) {
+		c = calloc(1, sizeof(struct slots));
+		if (free_slot_room < SLOTS_PER_CHUNK) {
+			free_slot_room = SLOTS_PER_CHUNK;
+			free_slot = realloc(free_slot,
+			    sizeof(unsigned char **) * free_slot_room);
+		}
+		if (c == NULL || free_slot == NULL) {
+			perror("stack slots");
+			exit(1);
+		}
+		for (i = SLOTS_PER_CHUNK; i > 0; i--)
+			free_slot[free_slots++] = &c->base[i - 1];
+		c->next = slots_head;
+		ATOMIC_STORE(&slots_head, c);
+	}
+	s->slot = free_slot[--free_slots];
+	ATOMIC_STORE(s->slot, (unsigned char *)s);
+}
+
+/*
+ * Empty s's slot, and keep it for the next stack.  Called with
+ * stack_lock held.
+ */
+static void
+slot_give(struct stack *s)
+{
+	size_t room;
+
+	ATOMIC_STORE(s->slot, (unsigned char *)NULL);
+	if (free_slots == free_slot_room) {
+		room = free_slot_room * 2;
+		free_slot = realloc(free_slot, sizeof(unsigned char **) * room);
+		if (free_slot == NULL) {
+			perror("stack slots");
+			exit(1);
+		}
+		free_slot_room = room;
+	}
+	free_slot[free_slots++] = s->slot;
+}
+
+/*
+ * Return a stack of up to size bytes, of which the first page or so
+ * is accessible.
+ */
+void *
+stack_new(size_t size)
+{
+	struct stack *s;
+	size_t reserved;
+
+	LOCK(&stack_lock);
+	if (page_size == 0)
+		stack_init();
+	UNLOCK(&stack_lock);
+
+	reserved = (STACK_HEADER + size + page_size - 1) & ~(page_size - 1);
+	reserved += page_size;
+	s = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE, zero_fd, 0);
+	if (s == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	mprotect(s, page_size, PROT_READ | PROT_WRITE);
+	s->committed = page_size;
+	s->reserved = reserved;
+
+	LOCK(&stack_lock);
+	slot_take(s);
+	UNLOCK(&stack_lock);
+
+	return((unsigned char *)s + STACK_HEADER);
+}
+
+void
+stack_free(void *p)
+{
+	struct stack *s;
+
+	s = (struct stack *)((unsigned char *)p - STACK_HEADER);
+	LOCK(&stack_lock);
+	slot_give(s);
+	UNLOCK(&stack_lock);
+	munmap(s, s->reserved);
+}
@@ -0,0 +1,15 @@
+/*
+ * stack.h
+ * Growable stacks for the vm.
+ */
+
+#ifndef __STACK_H_
+#define __STACK_H_
+
+#include <sys/types.h>
+
+void		*stack_new(size_t);
+void		 stack_free(void *);
+void		 stack_overflow(void);
+
+#endif
@@ -48,6 +48,8 @@ symbol_new(wchar_t *token, int kind)
 	sym->type = NULL;
 	/*sym->value = NULL;*/
 	sym->builtin = NULL;
+	sym->routine = NULL;
+	sym->flow = 0;
 
 	return(sym);
 }
@@ -13,6 +13,7 @@
 #include "value.h"
 
 struct type;
+struct closure;
 
 struct symbol_table {
 	struct symbol_table	*parent;	/* link to scopes above us */
@@ -34,6 +35,9 @@ struct symbol {
 	struct value		 value;	/* if symbol is a constant, this is the value */
 
 	int			 index;	/* index into activation record */
+
+	struct closure		*routine; /* the closure it is assigned, if one */
+	int			 flow;	/* SYM_FLOW_* (see ast_find_errors()) */
 };
 
 #define SYM_KIND_ANONYMOUS	0
@@ -41,6 +45,11 @@ struct symbol {
 #define SYM_KIND_FUNCTION	2
 #define SYM_KIND_VARIABLE	3
 
+#define	SYM_FLOW_ASSIGNED	1	/* assigned somewhere */
+#define	SYM_FLOW_UNKNOWN	2	/* may hold a closure not assigned here */
+#define	SYM_FLOW_ESCAPES	4	/* read other than to be called */
+#define	SYM_FLOW_MAY_ERR	8	/* may be assigned an error */
+
 struct symbol_table	*symbol_table_new(struct symbol_table *, int);
 struct symbol_table	*symbol_table_dup(struct symbol_table *);
 void			 symbol_table_free(struct symbol_table *);
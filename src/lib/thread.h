@@ -0,0 +1,65 @@
+/*
+ * thread.h
+ * Locks and atomic operations for running processes on several threads.
+ *
+ * With THREADS, the scheduler runs processes on a number of worker
+ * threads (see process.c), and what they share outside of a collection
+ * is guarded by these locks.  Without it, they compile to nothing and
+ * the main thread is the only worker.  The atomic operations are for
+ * what is shared without a lock (the mailboxes in process.c, the
+ * flags of what is shared in gc.c and value.c); there is no
+ * ATOMIC_XCHG, ATOMIC_FETCH_OR or ATOMIC_FETCH_AND without THREADS,
+ * since they can't be plain expressions.
+ */
+
+#ifndef __THREAD_H_
+#define __THREAD_H_
+
+#if defined(THREADS) && !defined(__GNUC__)
+#undef THREADS
+#endif
+
+#ifdef THREADS
+
+#include <pthread.h>
+
+typedef pthread_mutex_t		bhuna_lock_t;
+
+#define	LOCK_INITIALIZER	PTHREAD_MUTEX_INITIALIZER
+#define	LOCK_INIT(l)		pthread_mutex_init((l), NULL)
+#define	LOCK(l)			pthread_mutex_lock(l)
+#define	UNLOCK(l)		pthread_mutex_unlock(l)
+#define	THREAD_LOCAL		__thread
+
+#define	ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define	ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define	ATOMIC_XCHG(p, v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define	ATOMIC_CAS(p, o, n)	__sync_bool_compare_and_swap((p), (o), (n))
+#define	ATOMIC_ADD(p, n)	__atomic_add_fetch((p), (n), __ATOMIC_SEQ_CST)
+#define	ATOMIC_FETCH_OR(p, n)	__atomic_fetch_or((p), (n), __ATOMIC_SEQ_CST)
+#define	ATOMIC_FETCH_AND(p, n)	__atomic_fetch_and((p), (n), __ATOMIC_SEQ_CST)
+
+#else
+
+typedef int			bhuna_lock_t;
+
+#define	LOCK_INITIALIZER	0
+#define	LOCK_INIT(l)		(*(l) = 0)
+#define	LOCK(l)			((void)(l))
+#define	UNLOCK(l)		((void)(l))
+#define	THREAD_LOCAL
+
+#define	ATOMIC_LOAD(p)		(*(p))
+#define	ATOMIC_STORE(p, v)	(*(p) = (v))
+#define	ATOMIC_CAS(p, o, n)	(*(p) == (o) ? (*(p) = (n), 1) : 0)
+#define	ATOMIC_ADD(p, n)	(*(p) += (n))
+
+#endif
+
+/*
+ * Guards the lists of heap activation records and structured values,
+ * and their counts (see gc.c.)
+ */
+extern bhuna_lock_t heap_lock;
+
+#endif
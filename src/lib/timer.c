@@ -0,0 +1,200 @@
+/*
+ * timer.c
+ * Timers on a hierarchical timing wheel.
+ *
+ * There are four wheels of 64 slots, and the tick is a millisecond.
+ * A timer due within 64 ticks goes in the slot of the first wheel for
+ * its tick.  One due later goes in the wheel whose slots are about as
+ * wide as the wait, in the slot its tick falls in.  When the first wheel
+ * comes round to where that slot begins, its timers are moved down
+ * (cascaded) to the wheel below.  So adding and cancelling a timer take
+ * constant time, and so does expiring it, but for at most three moves.
+ * Timers further off than the last wheel reaches (about 4.6 hours) wait
+ * in its furthest slot, and are cascaded back into it in turn.
+ *
+ * Nothing here is locked: process.c uses it under its sched_lock.
+ */
+
+#ifndef _POSIX_C_SOURCE
+#define	_POSIX_C_SOURCE	200112L	/* clock_gettime(), even with ANSI=1 */
+#endif
+
+#include <stddef.h>
+#include <time.h>
+
+#include "timer.h"
+
+#define	WHEEL_BITS	6
+#define	WHEEL_SIZE	(1 << WHEEL_BITS)
+#define	WHEEL_MASK	(WHEEL_SIZE - 1)
+#define	WHEELS		4
+#define	WHEEL_SPAN	(1UL << (WHEEL_BITS * WHEELS))	/* ticks */
+
+#define	SHIFT(level)	(WHEEL_BITS * (level))
+
+static struct timer	*wheel[WHEELS][WHEEL_SIZE];
+static unsigned long	 wheel_time = 0;	/* next tick to expire */
+static int		 wheel_count = 0;	/* timers in the wheels */
+
+/*
+ * Milliseconds on the monotonic clock.
+ */
+unsigned long
+timer_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return((unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static void
+slot_insert(struct timer *t)
+{
+	struct timer **slot;
+	unsigned long when;
+	int level;
+
+	when = t->expires < wheel_time ? wheel_time : t->expires;
+	if (when - wheel_time >= WHEEL_SPAN)
+		when = wheel_time + WHEEL_SPAN - 1;
+	for (level = 0; level < WHEELS - 1; level++)
+		if (when - wheel_time < (1UL << SHIFT(level + 1)))
+			break;
+
+	slot = &wheel[level][(when >> SHIFT(level)) & WHEEL_MASK];
+	if ((t->next = *slot) != NULL)
+		t->next->prevp = &t->next;
+	t->prevp = slot;
+	*slot = t;
+}
+
+static void
+slot_remove(struct timer *t)
+{
+	if (t->next != NULL)
+		t->next->prevp = t->prevp;
+	*t->prevp = t->next;
+}
+
+/*
+ * Add a timer, due when timer_now() reaches t->expires.  now is
+ * timer_now(), which the caller will have had to read anyway.
+ */
+void
+timer_add(struct timer *t, unsigned long now)
+{
+	/* nothing is due before the next tick, so don't look till then */
+	if (wheel_count == 0)
+		wheel_time = now + 1;
+	slot_insert(t);
+	wheel_count++;
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	slot_remove(t);
+	wheel_count--;
+}
+
+static void
+cascade(int level, int index)
+{
+	struct timer *t;
+
+	while ((t = wheel[level][index]) != NULL) {
+		slot_remove(t);
+		slot_insert(t);
+	}
+}
+
+/*
+ * Take every timer due by now out of the wheels, and return them
+ * as a list linked through next.
+ */
+struct timer *
+timer_expire(unsigned long now)
+{
+	struct timer *head = NULL, **tail = &head;
+	struct timer *t;
+	int level;
+
+	while (wheel_time <= now) {
+		if (wheel_count == 0) {
+			wheel_time = now + 1;
+			break;
+		}
+		for (level = 1; level < WHEELS; level++) {
+			if ((wheel_time >> SHIFT(level - 1)) & WHEEL_MASK)
+				break;
+			cascade(level, (wheel_time >> SHIFT(level)) & WHEEL_MASK);
+		}
+		while ((t = wheel[0][wheel_time & WHEEL_MASK]) != NULL) {
+			slot_remove(t);
+			wheel_count--;
+			*tail = t;
+			tail = &t->next;
+		}
+		*tail = NULL;
+		wheel_time++;
+	}
+
+	return(head);
+}
+
+/*
+ * How many milliseconds from now timer_expire() may next have something
+ * to do: when the first timer is due, or before that, when a slot of a
+ * higher wheel is to be cascaded.  0 if it has something to do already,
+ * -1 if there are no timers at all.
+ */
+long
+timer_next(unsigned long now)
+{
+	unsigned long when, block;
+	int level, k;
+
+	if (wheel_count == 0)
+		return(-1);
+
+	when = wheel_time + WHEEL_SPAN;
+	for (k = 0; k < WHEEL_SIZE; k++) {
+		if (wheel[0][(wheel_time + k) & WHEEL_MASK] != NULL) {
+			when = wheel_time + k;
+			break;
+		}
+	}
+	for (level = 1; level < WHEELS; level++) {
+		/*
+		 * The slot for the block we are in has been cascaded
+		 * already, unless we are at its very start.
+		 */
+		k = (wheel_time & ((1UL << SHIFT(level)) - 1)) == 0 ? 0 : 1;
+		for (; k <= WHEEL_SIZE; k++) {
+			block = (wheel_time >> SHIFT(level)) + k;
+			if (wheel[level][block & WHEEL_MASK] != NULL) {
+				if ((block << SHIFT(level)) < when)
+					when = block << SHIFT(level);
+				break;
+			}
+		}
+	}
+
+	return(when <= now ? 0 : (long)(when - now));
+}
+
+int
+timer_count(void)
+{
+	return(wheel_count);
+}
+
+/*
+ * Whether timer_expire(now) would have anything to do.
+ */
+int
+timer_due(unsigned long now)
+{
+	return(wheel_count > 0 && wheel_time <= now);
+}
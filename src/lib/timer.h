@@ -0,0 +1,23 @@
+/*
+ * timer.h
+ * Timers on a hierarchical timing wheel, in milliseconds.
+ */
+
+#ifndef __TIMER_H_
+#define __TIMER_H_
+
+struct timer {
+	struct timer	 *next;		/* in a slot of the wheel */
+	struct timer	**prevp;	/* what points to this one */
+	unsigned long	 expires;	/* timer_now() it is due at */
+};
+
+unsigned long	 timer_now(void);
+void		 timer_add(struct timer *, unsigned long);
+void		 timer_cancel(struct timer *);
+struct timer	*timer_expire(unsigned long);
+long		 timer_next(unsigned long);
+int		 timer_count(void);
+int		 timer_due(unsigned long);
+
+#endif
@@ -7,6 +7,7 @@ int trace_pool = 0;
 int trace_type_inference = 0;
 int trace_gc = 0;
 int trace_scheduling = 0;
+int profile_vm = 0;
 
 int num_vars_created = 0;
 int num_vars_cached = 0;
@@ -12,6 +12,7 @@ extern int trace_pool;
 extern int trace_type_inference;
 extern int trace_gc;
 extern int trace_scheduling;
+extern int profile_vm;
 
 extern int num_vars_created;
 extern int num_vars_cached;
@@ -11,6 +11,7 @@
 #include <wchar.h>
 
 #include "mem.h"
+#include "pool.h"
 #include "value.h"
 #include "ast.h"
 #include "list.h"
@@ -18,6 +19,8 @@
 #include "closure.h"
 #include "utf8.h"
 #include "type.h"
+#include "gc.h"
+#include "thread.h"
 
 #ifdef DEBUG
 extern int trace_valloc;
@@ -26,14 +29,14 @@ extern int num_vars_cached;
 extern int num_vars_freed;
 #endif
 
-struct s_value *sv_head = NULL;
+struct s_value	*s_value_new(unsigned char);
 
 struct value
 value_null(void)
 {
 	struct value v;
 
-	v.type = VALUE_NULL;
+	V_SET_NULL(v);
 	
 	return(v);
 }
@@ -45,90 +48,306 @@ value_null(void)
 void
 value_deregister(struct value v)
 {
-	if (v.type & VALUE_STRUCTURED)
-		v.v.s->admin |= ADMIN_PERMANENT;
+	if (V_TYPE(v) & VALUE_STRUCTURED)
+		V_SV(v)->admin |= ADMIN_PERMANENT;
 }
 
 /*
  * Return a deep(ish) copy of the given value.
  * New strings (char arrays) are created when copying a string;
- * New list spines (struct list *) are created, but values are only grabbed, not dup'ed.
+ * New lists (struct list *) are created, but values are only grabbed, not dup'ed.
  * Some things are not copied, only the pointers to them.
  *
- * Note that the dup'ed value is 'new', i.e. it has a refcount of 1.
+ * Note that the dup'ed value is 'new', i.e. nothing counts it yet; what
+ * is in it is counted once more (see V_REF.)
  */
 struct value
 value_dup(struct value v)
 {
 	struct value n;
-	/*struct list *l;*/
 
-	switch (v.type) {
+	switch (V_TYPE(v)) {
 	case VALUE_INTEGER:
-		return(value_new_integer(v.v.i));
+		return(value_new_integer(V_INT(v)));
 	case VALUE_BOOLEAN:
-		return(value_new_boolean(v.v.b));
+		return(value_new_boolean(V_BOOL(v)));
 	case VALUE_STRING:
-		return(value_new_string(v.v.s->v.s));
+		return(value_new_string(V_SV(v)->v.s));
 	case VALUE_LIST:
 		n = value_new_list();
-	/*
-		for (l = v.v.s->v.l; l != NULL; l = l->next) {
-			value_list_append(&n, l->value);
-		}
-	*/
-		/*
-		n = value_new(VALUE_LIST);
-		n->v.l = list_dup(v->v.l);
-		*/
+		V_SV(n)->v.l = list_dup(V_SV(v)->v.l);
+		HEAP_CHARGE(list_size(V_SV(n)->v.l));
 		return(n);
 	case VALUE_ERROR:
-		return(value_new_error(v.v.s->v.e));
+		return(value_new_error(V_SV(v)->v.e));
 	case VALUE_BUILTIN:
-		return(value_new_builtin(v.v.bi));
+		return(value_new_builtin(V_BI(v)));
 	case VALUE_CLOSURE:
-		return(value_new_closure(v.v.s->v.k->ast, v.v.s->v.k->ar,
-		    v.v.s->v.k->arity, v.v.s->v.k->locals, v.v.s->v.k->cc));
+		return(value_new_closure(V_SV(v)->v.k->ast, V_SV(v)->v.k->ar,
+		    V_SV(v)->v.k->arity, V_SV(v)->v.k->locals, V_SV(v)->v.k->cc));
 	case VALUE_DICT:
-		n = value_new_dict(); /* XXX */
-		n.v.s->v.d = dict_dup(v.v.s->v.d);
+		V_SET_PTR(n, VALUE_DICT, s_value_new(VALUE_DICT));
+		V_SV(n)->v.d = dict_dup(V_SV(v)->v.d);
+		HEAP_CHARGE(s_value_size(V_SV(n)) - sizeof(struct s_value));
 		return(n);
 	case VALUE_OPAQUE:
-		return(value_new_opaque(v.v.ptr));
+		return(value_new_opaque(V_PTR(v)));
 	default:
 		return(value_new_error("unknown type"));
 	}
 }
 
+/*
+ * Mark v, and everything in it, as never to change again.  Store
+ * refuses to change a frozen list or dict, and a frozen value can be
+ * sent to another process as it is.  Strings and errors are born
+ * frozen.  A closure is frozen as a value, but not what it refers to.
+ */
+void
+value_freeze(struct value v)
+{
+	struct s_value *sv;
+	struct chain *c;
+	size_t j;
+	int i;
+
+	if (!V_IS_STRUCTURED(v) || (V_SV(v)->admin & ADMIN_FROZEN))
+		return;
+	sv = V_SV(v);
+#ifdef THREADS
+	/* another process may be sweeping it (see gc.c) */
+	if (sv->admin & ADMIN_SHARED)
+		ATOMIC_FETCH_OR(&sv->admin, ADMIN_FROZEN);
+	else
+#endif
+	sv->admin |= ADMIN_FROZEN;
+	switch (sv->type) {
+	case VALUE_LIST:
+		for (j = 0; j < LIST_LENGTH(sv->v.l); j++)
+			value_freeze(sv->v.l->value[j]);
+		break;
+	case VALUE_DICT:
+		for (i = 0; i < sv->v.d->num_buckets; i++) {
+			for (c = sv->v.d->bucket[i]; c != NULL; c = c->next) {
+				value_freeze(c->key);
+				value_freeze(c->value);
+			}
+		}
+		break;
+	}
+}
+
+/*
+ * Copying a value for another process.  Each list or dict is copied
+ * once, however many times it occurs, so the copy has the same shape
+ * as the original, cycles and all; this remembers which have been.
+ */
+struct copied {
+	struct s_value	**from;
+	struct s_value	**to;
+	size_t		  size;		/* a power of two */
+	size_t		  count;
+	int		  shared;	/* anything was left uncopied */
+};
+
+static size_t
+copied_slot(struct copied *cp, struct s_value *sv)
+{
+	size_t i;
+
+	i = ((unsigned long)sv >> 4) * 2654435761UL;
+	for (i &= cp->size - 1; cp->from[i] != NULL; i = (i + 1) & (cp->size - 1))
+		if (cp->from[i] == sv)
+			break;
+	return(i);
+}
+
+static void
+copied_put(struct copied *cp, struct s_value *from, struct s_value *to)
+{
+	struct s_value **old_from = cp->from, **old_to = cp->to;
+	size_t old_size = cp->size, i, j;
+
+	if (cp->count * 2 >= cp->size) {
+		cp->size = old_size == 0 ? 16 : old_size * 2;
+		cp->from = bhuna_malloc(cp->size * sizeof(struct s_value *));
+		cp->to = bhuna_malloc(cp->size * sizeof(struct s_value *));
+		for (i = 0; i < cp->size; i++)
+			cp->from[i] = NULL;
+		for (i = 0; i < old_size; i++) {
+			if (old_from[i] != NULL) {
+				j = copied_slot(cp, old_from[i]);
+				cp->from[j] = old_from[i];
+				cp->to[j] = old_to[i];
+			}
+		}
+		if (old_from != NULL) {
+			bhuna_free(old_from);
+			bhuna_free(old_to);
+		}
+	}
+	i = copied_slot(cp, from);
+	cp->from[i] = from;
+	cp->to[i] = to;
+	cp->count++;
+}
+
+static struct value
+value_copy_r(struct value v, struct copied *cp, size_t *bytes)
+{
+	struct value n;
+	struct list *l;
+	struct chain *c;
+	size_t i;
+
+	if (!V_IS_STRUCTURED(v) || (V_SV(v)->admin & ADMIN_FROZEN) ||
+	    (V_TYPE(v) != VALUE_LIST && V_TYPE(v) != VALUE_DICT)) {
+		if (V_IS_STRUCTURED(v)) {
+			value_share(v);
+			cp->shared = 1;
+		}
+		return(v);
+	}
+	if (cp->size > 0 && cp->from[i = copied_slot(cp, V_SV(v))] != NULL) {
+		V_SET_PTR(n, V_TYPE(v), cp->to[i]);
+		return(n);
+	}
+
+	*bytes += sizeof(struct s_value);
+	if (V_TYPE(v) == VALUE_LIST) {
+		n = value_new_list();
+		copied_put(cp, V_SV(v), V_SV(n));
+		l = V_SV(v)->v.l;
+		V_SV(n)->v.l = list_new(NULL, LIST_LENGTH(l));
+		*bytes += list_size(V_SV(n)->v.l);
+		HEAP_CHARGE(list_size(V_SV(n)->v.l));
+		for (i = 0; i < LIST_LENGTH(l); i++) {
+			(void)list_append(&V_SV(n)->v.l,
+			    value_copy_r(l->value[i], cp, bytes), 0);
+		}
+	} else {
+		n = value_new_dict();
+		copied_put(cp, V_SV(v), V_SV(n));
+		*bytes += sizeof(struct dict) +
+		    V_SV(n)->v.d->num_buckets * sizeof(struct chain *);
+		for (i = 0; i < (size_t)V_SV(v)->v.d->num_buckets; i++) {
+			for (c = V_SV(v)->v.d->bucket[i]; c != NULL; c = c->next) {
+				dict_store(V_SV(n)->v.d,
+				    value_copy_r(c->key, cp, bytes),
+				    value_copy_r(c->value, cp, bytes));
+				*bytes += sizeof(struct chain);
+				HEAP_CHARGE(sizeof(struct chain));
+			}
+		}
+	}
+	return(n);
+}
+
+/*
+ * Return a value which v's receiver can have to itself: v, if nothing
+ * in it can change, or else a copy of the lists and dicts in it which
+ * are not frozen, sharing everything that is.  Closures and opaque
+ * values are not copied.  What isn't copied is shared (see gc.c), and
+ * *shared set if there is any; copies go into the current heap.  Adds
+ * the number of bytes copied to *bytes.
+ */
+struct value
+value_copy(struct value v, size_t *bytes, int *shared)
+{
+	struct copied cp;
+	struct value n;
+
+	*shared = V_IS_STRUCTURED(v);
+	if (!V_IS_STRUCTURED(v) || (V_SV(v)->admin & ADMIN_FROZEN)) {
+		value_share(v);
+		return(v);
+	}
+	cp.from = cp.to = NULL;
+	cp.size = cp.count = 0;
+	cp.shared = 0;
+	n = value_copy_r(v, &cp, bytes);
+	*shared = cp.shared;
+	if (cp.from != NULL) {
+		bhuna_free(cp.from);
+		bhuna_free(cp.to);
+	}
+	return(n);
+}
+
 /*** DESTRUCTOR ***/
 
-void
+/*
+ * Returns how many bytes were freed, as s_value_size() would have
+ * measured them.
+ */
+size_t
 s_value_free(struct s_value *sv)
 {
+	size_t n = sizeof(struct s_value);
+
 	switch (sv->type) {
 	case VALUE_LIST:
-		list_free(&sv->v.l);
+		n += list_free(&sv->v.l);
 		break;
 	case VALUE_STRING:
-		if (sv->v.s != NULL)
+		if (sv->v.s != NULL) {
+			n += (wcslen(sv->v.s) + 1) * sizeof(wchar_t);
 			bhuna_free(sv->v.s);
+		}
 		break;
 	case VALUE_ERROR:
-		if (sv->v.e != NULL)
+		if (sv->v.e != NULL) {
+			n += strlen(sv->v.e) + 1;
 			bhuna_free(sv->v.e);
+		}
 		break;
 	case VALUE_CLOSURE:
 		closure_free(sv->v.k);
+		n += sizeof(struct closure);
 		break;
 	case VALUE_DICT:
-		dict_free(sv->v.d);
+		n += dict_free(sv->v.d);
 		break;
 	case VALUE_OPAQUE:
 		/* XXX oiks.  user GC "finalizer" ? */
 		break;
 	}
 
-	bhuna_free(sv);
+	pool_free(sv, sizeof(struct s_value));
+	return(n);
+}
+
+/*
+ * How many bytes sv takes up, with what it owns, but not the values
+ * it refers to (see gc.c.)
+ */
+size_t
+s_value_size(struct s_value *sv)
+{
+	size_t n = sizeof(struct s_value);
+
+	switch (sv->type) {
+	case VALUE_LIST:
+		n += list_size(sv->v.l);
+		break;
+	case VALUE_STRING:
+		if (sv->v.s != NULL)
+			n += (wcslen(sv->v.s) + 1) * sizeof(wchar_t);
+		break;
+	case VALUE_ERROR:
+		if (sv->v.e != NULL)
+			n += strlen(sv->v.e) + 1;
+		break;
+	case VALUE_CLOSURE:
+		n += sizeof(struct closure);
+		break;
+	case VALUE_DICT:
+		n += sizeof(struct dict) +
+		    sv->v.d->num_buckets * sizeof(struct chain *) +
+		    dict_size(sv->v.d) * sizeof(struct chain);
+		break;
+	}
+	return(n);
 }
 
 /*** SPECIFIC CONSTRUCTORS ***/
@@ -139,8 +358,7 @@ value_new_integer(int i)
 {
 	struct value v;
 
-	v.type = VALUE_INTEGER;
-	v.v.i = i;
+	V_SET_INT(v, VALUE_INTEGER, i);
 	
 	return(v);
 }
@@ -150,8 +368,7 @@ value_new_boolean(int b)
 {
 	struct value v;
 
-	v.type = VALUE_BOOLEAN;
-	v.v.b = b;
+	V_SET_INT(v, VALUE_BOOLEAN, b);
 	
 	return(v);
 }
@@ -161,8 +378,7 @@ value_new_atom(int atom)
 {
 	struct value v;
 
-	v.type = VALUE_ATOM;
-	v.v.a = atom;
+	V_SET_INT(v, VALUE_ATOM, atom);
 	
 	return(v);
 }
@@ -172,8 +388,7 @@ value_new_builtin(struct builtin *bi)
 {
 	struct value v;
 
-	v.type = VALUE_BUILTIN;
-	v.v.bi = bi;
+	V_SET_PTR(v, VALUE_BUILTIN, bi);
 	
 	return(v);
 }
@@ -183,8 +398,7 @@ value_new_opaque(void *ptr)
 {
 	struct value v;
 
-	v.type = VALUE_OPAQUE;
-	v.v.ptr = ptr;
+	V_SET_PTR(v, VALUE_OPAQUE, ptr);
 	
 	return(v);
 }
@@ -195,11 +409,19 @@ struct s_value *
 s_value_new(unsigned char type)
 {
 	struct s_value *sv;
+	struct heap *h = current_heap;
 
-	sv = bhuna_malloc(sizeof(struct s_value));
-	sv->next = sv_head;
-	sv_head = sv;
+	sv = pool_alloc(sizeof(struct s_value));
 	sv->admin = 0;
+	if (h == &global_heap) {
+		sv->admin = ADMIN_SHARED;
+		LOCK(&heap_lock);
+	}
+	sv->next = h->sv_head;
+	h->sv_head = sv;
+	h->bytes += sizeof(struct s_value);
+	if (h == &global_heap)
+		UNLOCK(&heap_lock);
 	sv->type = type;
 	sv->refcount = 0;
 
@@ -211,9 +433,10 @@ value_new_string(wchar_t *s)
 {
 	struct value v;
 
-	v.type = VALUE_STRING;
-	v.v.s = s_value_new(VALUE_STRING);
-	v.v.s->v.s = bhuna_wcsdup(s);
+	V_SET_PTR(v, VALUE_STRING, s_value_new(VALUE_STRING));
+	V_SV(v)->v.s = bhuna_wcsdup(s);
+	V_SV(v)->admin |= ADMIN_FROZEN;
+	HEAP_CHARGE((wcslen(s) + 1) * sizeof(wchar_t));
 
 	return(v);
 }
@@ -223,9 +446,23 @@ value_new_list(void)
 {
 	struct value v;
 
-	v.type = VALUE_LIST;
-	v.v.s = s_value_new(VALUE_LIST);
-	v.v.s->v.l = NULL;
+	V_SET_PTR(v, VALUE_LIST, s_value_new(VALUE_LIST));
+	V_SV(v)->v.l = NULL;
+
+	return(v);
+}
+
+/*
+ * A list of the n values at p, made all at once.
+ */
+struct value
+value_new_list_of(struct value *p, size_t n)
+{
+	struct value v;
+
+	v = value_new_list();
+	V_SV(v)->v.l = list_new(p, n);
+	HEAP_CHARGE(list_size(V_SV(v)->v.l));
 
 	return(v);
 }
@@ -234,10 +471,13 @@ struct value
 value_new_error(const char *error)
 {
 	struct value v;
+	size_t len = strlen(error) + 1;
 
-	v.type = VALUE_ERROR;
-	v.v.s = s_value_new(VALUE_ERROR);
-	v.v.s->v.e = strdup(error);
+	V_SET_PTR(v, VALUE_ERROR, s_value_new(VALUE_ERROR));
+	V_SV(v)->v.e = bhuna_malloc(len);
+	memcpy(V_SV(v)->v.e, error, len);
+	V_SV(v)->admin |= ADMIN_FROZEN;
+	HEAP_CHARGE(len);
 
 	return(v);
 }
@@ -247,9 +487,9 @@ value_new_closure(struct ast *a, struct activation *ar, int arity, int locals, i
 {
 	struct value v;
 
-	v.type = VALUE_CLOSURE;
-	v.v.s = s_value_new(VALUE_CLOSURE);
-	v.v.s->v.k = closure_new(a, ar, arity, locals, cc);
+	V_SET_PTR(v, VALUE_CLOSURE, s_value_new(VALUE_CLOSURE));
+	V_SV(v)->v.k = closure_new(a, ar, arity, locals, cc);
+	HEAP_CHARGE(sizeof(struct closure));
 
 	return(v);
 }
@@ -259,25 +499,43 @@ value_new_dict(void)
 {
 	struct value v;
 
-	v.type = VALUE_DICT;
-	v.v.s = s_value_new(VALUE_DICT);
-	v.v.s->v.d = dict_new();
+	V_SET_PTR(v, VALUE_DICT, s_value_new(VALUE_DICT));
+	V_SV(v)->v.d = dict_new();
+	HEAP_CHARGE(sizeof(struct dict) +
+	    V_SV(v)->v.d->num_buckets * sizeof(struct chain *));
 
 	return(v);
 }
 
 /*** ACCESSORS ***/
 
+/*
+ * Put q on the end of the list v.  What a shared one outgrows is kept
+ * (see list_append()); it is in the global heap, which counts it when
+ * it is swept.
+ */
 void
 value_list_append(struct value v, struct value q)
 {
-	list_cons(&v.v.s->v.l, q);
+	struct s_value *sv = V_SV(v);
+	size_t n;
+
+	if (sv->admin & ADMIN_SHARED)
+		(void)list_append(&sv->v.l, q, 1);
+	else {
+		n = list_append(&sv->v.l, q, 0);
+		HEAP_CHARGE(n);
+	}
 }
 
 void
 value_dict_store(struct value v, struct value k, struct value d)
 {
-	dict_store(v.v.s->v.d, k, d);
+	struct value old;
+
+	old = dict_store(V_SV(v)->v.d, k, d);
+	V_UNREF(old);
+	HEAP_CHARGE(sizeof(struct chain));
 }
 
 /*** OPERATIONS ***/
@@ -286,39 +544,39 @@ void
 value_print(struct value v)
 {
 	/*printf("[0x%08lx](x%d)", (unsigned long)v, v->refcount);*/
-	switch (v.type) {
+	switch (V_TYPE(v)) {
 	case VALUE_INTEGER:
-		printf("%d", v.v.i);
+		printf("%d", V_INT(v));
 		break;
 	case VALUE_BOOLEAN:
-		printf("%s", v.v.b ? "true" : "false");
+		printf("%s", V_BOOL(v) ? "true" : "false");
 		break;
 	case VALUE_ATOM:
-		printf("atom<%d>", v.v.a);
+		printf("atom<%d>", V_ATOM(v));
 		break;
 	case VALUE_BUILTIN:
-		printf("#BIF<%08lx>", (unsigned long)v.v.bi);
+		printf("#BIF<%08lx>", (unsigned long)V_BI(v));
 		break;
 	case VALUE_OPAQUE:
-		printf("#OPAQUE<%08lx>", (unsigned long)v.v.ptr);
+		printf("#OPAQUE<%08lx>", (unsigned long)V_PTR(v));
 		break;
 
 	case VALUE_STRING:
 		printf("\"");
-		fputsu8(stdout, v.v.s->v.s);
+		fputsu8(stdout, V_SV(v)->v.s);
 		printf("\"");
 		break;
 	case VALUE_LIST:
-		list_dump(v.v.s->v.l);
+		list_dump(V_SV(v)->v.l);
 		break;
 	case VALUE_ERROR:
-		printf("#ERR<%s>", v.v.s->v.e);
+		printf("#ERR<%s>", V_SV(v)->v.e);
 		break;
 	case VALUE_CLOSURE:
-		closure_dump(v.v.s->v.k);
+		closure_dump(V_SV(v)->v.k);
 		break;
 	case VALUE_DICT:
-		dict_dump(v.v.s->v.d);
+		dict_dump(V_SV(v)->v.d);
 		break;
 	}
 }
@@ -327,27 +585,28 @@ int
 value_equal(struct value a, struct value b)
 {
 	int c;
-	/* struct list *la, *lb; */
+	/* size_t i; */
 
-	if (a.type != b.type)
+	if (V_TYPE(a) != V_TYPE(b))
 		return(0);
 
-	switch (a.type) {
+	switch (V_TYPE(a)) {
 	case VALUE_INTEGER:
-		return(a.v.i == b.v.i);
+		return(V_INT(a) == V_INT(b));
 	case VALUE_BOOLEAN:
-		return(a.v.b == b.v.b);
+		return(V_BOOL(a) == V_BOOL(b));
 	case VALUE_ATOM:
-		return(a.v.a == b.v.a);
+		return(V_ATOM(a) == V_ATOM(b));
 	case VALUE_STRING:
-		return(wcscmp(a.v.s->v.s, b.v.s->v.s) == 0);
+		return(wcscmp(V_SV(a)->v.s, V_SV(b)->v.s) == 0);
 	case VALUE_LIST:
 		c = 1;
 	/*
-		for (la = a.v.s->v.l, lb = b.v.s->v.l;
-		     la != NULL && lb != NULL;
-		     la = la->next, lb = lb->next) {
-			if (!value_equal(la->value, lb->value)) {
+		if (LIST_LENGTH(V_SV(a)->v.l) != LIST_LENGTH(V_SV(b)->v.l))
+			return(0);
+		for (i = 0; i < LIST_LENGTH(V_SV(a)->v.l); i++) {
+			if (!value_equal(V_SV(a)->v.l->value[i],
+			    V_SV(b)->v.l->value[i])) {
 				c = 0;
 				break;
 			}
@@ -355,15 +614,15 @@ value_equal(struct value a, struct value b)
 	*/
 		return(c);
 	case VALUE_ERROR:
-		return(strcmp(a.v.s->v.e, b.v.s->v.e) == 0);
+		return(strcmp(V_SV(a)->v.e, V_SV(b)->v.e) == 0);
 	case VALUE_BUILTIN:
-		return(a.v.bi == b.v.bi);
+		return(V_BI(a) == V_BI(b));
 	case VALUE_CLOSURE:
-		return(a.v.s->v.k == b.v.s->v.k);
+		return(V_SV(a)->v.k == V_SV(b)->v.k);
 	case VALUE_DICT:
-		return(a.v.s->v.d == b.v.s->v.d);	/* XXX !!! */
+		return(V_SV(a)->v.d == V_SV(b)->v.d);	/* XXX !!! */
 	case VALUE_OPAQUE:
-		return(a.v.ptr == b.v.ptr);
+		return(V_PTR(a) == V_PTR(b));
 	}
 	return(0);
 }
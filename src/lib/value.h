@@ -7,8 +7,11 @@
 #ifndef __VALUE_H_
 #define __VALUE_H_
 
+#include <sys/types.h>
 #include <wchar.h>
 
+#include "thread.h"
+
 struct list;
 struct value;
 struct closure;
@@ -25,7 +28,7 @@ struct s_value {
 	struct s_value		*next;
 	unsigned char		 admin;		/* ADMIN_ flags */
 	unsigned char		 type;		/* VALUE_ */
-	int			 refcount;
+	int			 refcount;	/* see V_REF */
 	union {
 		wchar_t			*s;
 		struct list		*l;
@@ -38,11 +41,40 @@ struct s_value {
 #define	ADMIN_FREE		1	/* on the free list */
 #define	ADMIN_MARKED		2	/* marked, during gc */
 #define	ADMIN_PERMANENT		4	/* don't EVER gc this 'k? */
+#define	ADMIN_FROZEN		8	/* never changes; may be shared */
+#define	ADMIN_SHARED		16	/* other processes may see it */
+#define	ADMIN_OLD		32	/* survived a collection, unwritten since */
 
 /*
  * Simple values.
  * These are not garbage-collected, refcounted and so forth.
+ *
+ * With TAGGED_VALUES, a value is a single 64-bit word instead of a type
+ * byte padded out to a union: the type is the low byte, and integers,
+ * booleans and atoms are stored in the high 32 bits, pointers (to
+ * builtins, opaque objects and structured values) shifted up by 8.
+ * Either way, get at values only through the macros below.
  */
+#ifdef TAGGED_VALUES
+
+#include <stdint.h>
+
+struct value {
+	uint64_t		w;
+};
+
+#define	V_TYPE(x)	((unsigned char)(x).w)
+#define	V_INT(x)	((int)(uint32_t)((x).w >> 32))
+#define	V_BOOL(x)	V_INT(x)
+#define	V_ATOM(x)	V_INT(x)
+#define	V_PTR(x)	((void *)(uintptr_t)((x).w >> 8))
+
+#define	V_SET_NULL(x)		((x).w = VALUE_NULL)
+#define	V_SET_INT(x, t, n)	((x).w = (uint64_t)(uint32_t)(n) << 32 | (t))
+#define	V_SET_PTR(x, t, p)	((x).w = (uint64_t)(uintptr_t)(p) << 8 | (t))
+
+#else
+
 struct value {
 	unsigned char		type;		/* VALUE_ */
 	union {
@@ -56,6 +88,27 @@ struct value {
 	} v;
 };
 
+#define	V_TYPE(x)	((x).type)
+#define	V_INT(x)	((x).v.i)
+#define	V_BOOL(x)	((x).v.b)
+#define	V_ATOM(x)	((x).v.a)
+#define	V_PTR(x)	((x).v.ptr)
+
+#define	V_SET_NULL(x)		((x).type = VALUE_NULL)
+#define	V_SET_INT(x, t, n)	((x).type = (t), (x).v.i = (n))
+#define	V_SET_PTR(x, t, p)	((x).type = (t), (x).v.ptr = (p))
+
+#endif
+
+/*
+ * The rest are in terms of those.  V_SET_INT is for all the types
+ * which hold an int (integers, booleans, atoms), V_SET_PTR for all
+ * those which hold a pointer.
+ */
+#define	V_BI(x)		((struct builtin *)V_PTR(x))
+#define	V_SV(x)		((struct s_value *)V_PTR(x))
+#define	V_IS_STRUCTURED(x)	(V_TYPE(x) & VALUE_STRUCTURED)
+
 #define	VALUE_NULL	 0
 #define	VALUE_INTEGER	 1
 #define	VALUE_BOOLEAN	 2
@@ -71,6 +124,35 @@ struct value {
 #define VALUE_CLOSURE	 (VALUE_STRUCTURED | 3)
 #define VALUE_DICT	 (VALUE_STRUCTURED | 4)
 
+/*
+ * Count a slot in the heap (a local of an activation record, a list
+ * cell, a dict's key or value) coming to refer to x, or no longer
+ * referring to it.  Counting is deferred: what refers to x from a vm's
+ * stack isn't counted, and what referred to it from something the
+ * collector has freed isn't taken off, so a count may be too high, but
+ * is never too low.  A list or dict counted only once can be changed in
+ * place without anything else seeing it change (see INSTR_COW_LOCAL.)
+ * A shared value may be counted by several processes at once; what a
+ * shared record, list or dict refers to is never uncounted, since
+ * several processes may overwrite it at once.
+ */
+#define	V_REF(x)	do {						\
+	if (V_IS_STRUCTURED(x)) {					\
+		if (V_SV(x)->admin & ADMIN_SHARED)			\
+			ATOMIC_ADD(&V_SV(x)->refcount, 1);		\
+		else							\
+			V_SV(x)->refcount++;				\
+	}								\
+} while (0)
+#define	V_UNREF(x)	do {						\
+	if (V_IS_STRUCTURED(x)) {					\
+		if (V_SV(x)->admin & ADMIN_SHARED)			\
+			ATOMIC_ADD(&V_SV(x)->refcount, -1);		\
+		else							\
+			V_SV(x)->refcount--;				\
+	}								\
+} while (0)
+
 /* Prototypes */
 
 struct value	value_null(void);
@@ -82,14 +164,18 @@ struct value	value_new_opaque(void *);
 
 struct value	value_new_string(wchar_t *);
 struct value	value_new_list(void);
+struct value	value_new_list_of(struct value *, size_t);
 struct value	value_new_error(const char *);
 struct value	value_new_builtin(struct builtin *);
 struct value	value_new_closure(struct ast *, struct activation *, int, int, int);
 struct value	value_new_dict(void);
 
-void		s_value_free(struct s_value *);
+size_t		s_value_free(struct s_value *);
+size_t		s_value_size(struct s_value *);
 
 struct value	value_dup(struct value);
+void		value_freeze(struct value);
+struct value	value_copy(struct value, size_t *, int *);
 
 void		value_deregister(struct value);
 
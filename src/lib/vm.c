@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "mem.h"
 #include "vm.h"
@@ -11,6 +12,12 @@
 #include "gc.h"
 #include "process.h"
 #include "utf8.h"
+#include "jit.h"
+#include "stack.h"
+#include "thread.h"
+#ifdef DEBUG
+#include "icode.h"
+#endif
 
 /*
  * Macros to push values onto and pop values off of the stack.
@@ -24,35 +31,75 @@
 #ifdef DEBUG
 extern int trace_vm;
 extern int trace_gc;
+extern int profile_vm;
 #endif
 
-extern int gc_target, gc_trigger, a_count; /* v_count; */
-int v_count = 0;
-static int i;
+extern size_t gc_trigger;
+
+#ifdef DIRECT_THREADING
+/*
+ * Handler addresses inside vm_run(), indexed by opcode.
+ * Builtins without an inline handler have no entry here;
+ * the code generator threads them through INSTR_EXTERNAL.
+ */
+static void *dispatch_table[256];
+#endif
+
+/*
+ * Terminated vm's, kept for reuse by vm_new(), since processes
+ * tend to come and go in bunches.
+ */
+#define	VM_FREE_MAX	4096
+
+/*
+ * Reserved activation stacks given back by vm_astack_shrink(), kept
+ * for the next vm_astack_grow() on the same thread.  So a process which
+ * goes past its small activation stack only now and then doesn't map
+ * a stack each time, and many processes which each do so once don't
+ * each map and keep their own.
+ */
+#define	ASTACK_SPARE_MAX	16
+
+static THREAD_LOCAL unsigned char *astack_spare[ASTACK_SPARE_MAX];
+static THREAD_LOCAL int astack_spares = 0;
+
+static struct vm *vm_free_head = NULL;
+static int vm_free_count = 0;
+static bhuna_lock_t vm_free_lock = LOCK_INITIALIZER;
 
 struct vm *
 vm_new(vm_label_t program, size_t prog_size)
 {
 	struct vm *vm;
 
-	vm = bhuna_malloc(sizeof(struct vm));
+	LOCK(&vm_free_lock);
+	if ((vm = vm_free_head) != NULL) {
+		vm_free_head = vm->next_free;
+		vm_free_count--;
+	}
+	UNLOCK(&vm_free_lock);
+	if (vm == NULL)
+		vm = bhuna_malloc(sizeof(struct vm) + VM_SMALL_SIZE);
 
 	vm->prog_size = prog_size;
 	vm->program = program;
 	vm->pc = vm->program;
 
-	vm->vstack_size = 65536;
-	vm->vstack = bhuna_malloc(vm->vstack_size * sizeof(struct value));
+	vm->vstack = VM_SMALL_VSTACK(vm);
+	vm->vstack_end = vm->vstack + VM_VSTACK_SMALL;
 	vm->vstack_ptr = vm->vstack;
 
-	vm->cstack_size = 8192;
-	vm->cstack = bhuna_malloc(vm->cstack_size * sizeof(vm_label_t));
+	vm->cstack = VM_SMALL_CSTACK(vm);
+	vm->cstack_end = vm->cstack + VM_CSTACK_SMALL;
 	vm->cstack_ptr = vm->cstack;
 
-	vm->astack_size = 65536;
-	vm->astack = bhuna_malloc(vm->astack_size * sizeof(unsigned char));
+	vm->astack = VM_SMALL_ASTACK(vm);
+	vm->astack_end = vm->astack + VM_ASTACK_SMALL;
 	vm->astack_ptr = vm->astack;
-	vm->astack_hi = vm->astack;
+	vm->astack_big = NULL;
+
+	vm->current_ar = NULL;
+	vm->next_free = NULL;
 
 	return(vm);
 }
@@ -61,10 +108,103 @@ void
 vm_free(struct vm *vm)
 {
 	if (vm == NULL) return;
-	bhuna_free(vm->vstack);
-	bhuna_free(vm->cstack);
-	bhuna_free(vm->astack);
-	bhuna_free(vm);
+	if (vm->vstack != VM_SMALL_VSTACK(vm))
+		stack_free(vm->vstack);
+	if (vm->cstack != VM_SMALL_CSTACK(vm))
+		stack_free(vm->cstack);
+	if (vm->astack_big != NULL)
+		stack_free(vm->astack_big);
+	LOCK(&vm_free_lock);
+	if (vm_free_count < VM_FREE_MAX) {
+		vm->next_free = vm_free_head;
+		vm_free_head = vm;
+		vm_free_count++;
+		vm = NULL;
+	}
+	UNLOCK(&vm_free_lock);
+	if (vm != NULL)
+		bhuna_free(vm);
+}
+
+/*
+ * Move a small stack, of which used bytes are in use,
+ * to a newly reserved one of max bytes.
+ */
+static void *
+vm_move_stack(void *small, size_t used, size_t max)
+{
+	void *big;
+
+	big = stack_new(max);
+	memcpy(big, small, used);
+	return(big);
+}
+
+/*
+ * Make sure there is room on the vm's stacks for n more values and one
+ * more return label, moving them off the small stacks if need be.
+ * vm_call() and vm_goto() check for the need of the closure they enter,
+ * so nothing else has to check for overflow.
+ */
+void
+vm_reserve(struct vm *vm, int n)
+{
+	size_t used;
+
+	if (vm->vstack_ptr + n > vm->vstack_end) {
+		if (vm->vstack != VM_SMALL_VSTACK(vm) ||
+		    n > VM_VSTACK_MAX - VM_VSTACK_SMALL)
+			stack_overflow();
+		used = vm->vstack_ptr - vm->vstack;
+		vm->vstack = vm_move_stack(vm->vstack,
+		    used * sizeof(struct value),
+		    VM_VSTACK_MAX * sizeof(struct value));
+		vm->vstack_end = vm->vstack + VM_VSTACK_MAX;
+		vm->vstack_ptr = vm->vstack + used;
+	}
+	if (vm->cstack_ptr == vm->cstack_end) {
+		if (vm->cstack != VM_SMALL_CSTACK(vm))
+			stack_overflow();
+		used = vm->cstack_ptr - vm->cstack;
+		vm->cstack = vm_move_stack(vm->cstack,
+		    used * sizeof(vm_label_t),
+		    VM_CSTACK_MAX * sizeof(vm_label_t));
+		vm->cstack_end = vm->cstack + VM_CSTACK_MAX;
+		vm->cstack_ptr = vm->cstack + used;
+	}
+}
+
+/*
+ * Activation records are never moved, since other records point to
+ * them; one which won't fit on the small activation stack starts the
+ * reserved one, and records go there until it is empty again.
+ */
+void
+vm_astack_grow(struct vm *vm, size_t n)
+{
+	if (vm->astack != VM_SMALL_ASTACK(vm) || n > VM_ASTACK_MAX)
+		stack_overflow();
+	if (vm->astack_big == NULL) {
+		if (astack_spares > 0)
+			vm->astack_big = astack_spare[--astack_spares];
+		else
+			vm->astack_big = stack_new(VM_ASTACK_MAX);
+	}
+	vm->astack_small_ptr = vm->astack_ptr;
+	vm->astack = vm->astack_ptr = vm->astack_big;
+	vm->astack_end = vm->astack_big + VM_ASTACK_MAX;
+}
+
+void
+vm_astack_shrink(struct vm *vm)
+{
+	vm->astack = VM_SMALL_ASTACK(vm);
+	vm->astack_end = vm->astack + VM_ASTACK_SMALL;
+	vm->astack_ptr = vm->astack_small_ptr;
+	if (astack_spares < ASTACK_SPARE_MAX) {
+		astack_spare[astack_spares++] = vm->astack_big;
+		vm->astack_big = NULL;
+	}
 }
 
 #ifdef DEBUG
@@ -87,15 +227,154 @@ dump_activation_stack(struct vm *vm)
 	struct activation *a;
 	int i = 0;
 
-	for (a = (struct activation *)vm->astack;
-	     (unsigned char *)a < vm->astack_ptr;
-	     a += (sizeof(struct activation) +
-	     sizeof(struct value) * a->size)) {
+	for (a = vm->current_ar;
+	     a != NULL && (a->admin & AR_ADMIN_ON_STACK);
+	     a = a->caller) {
 		printf("ask@%02d: ", i++);
 		activation_dump(a, 0);
 		printf("\n");
 	}
 }
+
+/*
+ * Opcode profiling (-f): count how often each pair and triple of
+ * opcodes is executed in straight-line sequence, for choosing which
+ * sequences are worth fusing into superinstructions.  History is
+ * cleared whenever control doesn't simply fall through.
+ */
+#define PROF_TRIPLES	16384
+#define PROF_TOP	40
+
+static unsigned long prof_pair[256][256];
+static struct prof_triple {
+	unsigned long key;
+	unsigned long count;
+} prof_triple[PROF_TRIPLES];
+static unsigned long prof_total = 0, prof_lost = 0, prof_used = 0;
+static int prof_hist[2] = { -1, -1 };
+static vm_label_t prof_next = NULL;
+
+static size_t
+vm_operand_size(int opcode)
+{
+	switch (opcode) {
+	case INSTR_PUSH_VALUE:
+		return(sizeof(struct value));
+	case INSTR_PUSH_LOCAL:
+	case INSTR_POP_LOCAL:
+	case INSTR_INIT_LOCAL:
+	case INSTR_COW_LOCAL:
+		return(2);
+	case INSTR_JZ:
+	case INSTR_JMP:
+		return(sizeof(vm_label_t));
+	case INSTR_EXTERNAL:
+		return(sizeof(struct builtin *));
+	case INSTR_PUSH_LOCAL2:
+		return(4);
+	case INSTR_ADD_LOCAL_IMM:
+		return(2 + sizeof(int));
+	case INSTR_NATIVE:
+		return(sizeof(vm_native_t));
+	}
+	if (opcode >= INSTR_EQU_LOCAL_IMM_JZ && opcode <= INSTR_LTE_LOCAL_IMM_JZ)
+		return(2 + sizeof(int) + sizeof(vm_label_t));
+	if (opcode >= INSTR_EQU_LOCAL_LOCAL_JZ && opcode <= INSTR_LTE_LOCAL_LOCAL_JZ)
+		return(4 + sizeof(vm_label_t));
+	if (opcode == INSTR_R_MOVE || opcode == INSTR_R_NOT)
+		return(4);
+	if (opcode >= INSTR_R_AND && opcode <= INSTR_R_MOD)
+		return(6);
+	if (opcode == INSTR_R_JZ)
+		return(2 + sizeof(vm_label_t));
+	if (opcode >= INSTR_R_EQU_JZ && opcode <= INSTR_R_LTE_JZ)
+		return(4 + sizeof(vm_label_t));
+	return(0);
+}
+
+static void
+vm_profile(vm_label_t pc)
+{
+	unsigned long key, h;
+	int op = *pc;
+
+	if (pc != prof_next)
+		prof_hist[0] = prof_hist[1] = -1;
+	prof_next = pc + sizeof(vm_opcode_t) + vm_operand_size(op);
+	prof_total++;
+
+	if (prof_hist[1] >= 0)
+		prof_pair[prof_hist[1]][op]++;
+	if (prof_hist[0] >= 0) {
+		key = ((unsigned long)prof_hist[0] << 16) |
+		    ((unsigned long)prof_hist[1] << 8) | op;
+		for (h = (key * 2654435761UL) % PROF_TRIPLES;
+		     prof_triple[h].count != 0 && prof_triple[h].key != key;
+		     h = (h + 1) % PROF_TRIPLES)
+			;
+		if (prof_triple[h].count > 0) {
+			prof_triple[h].count++;
+		} else if (prof_used < PROF_TRIPLES / 2) {
+			prof_used++;
+			prof_triple[h].key = key;
+			prof_triple[h].count = 1;
+		} else {
+			prof_lost++;
+		}
+	}
+	prof_hist[0] = prof_hist[1];
+	prof_hist[1] = op;
+}
+
+static int
+prof_cmp(const void *a, const void *b)
+{
+	const struct prof_triple *x = a, *y = b;
+
+	return(x->count < y->count ? 1 : x->count > y->count ? -1 : 0);
+}
+
+static void
+prof_dump_seq(const char *title, struct prof_triple *t, int n, int len)
+{
+	int i, j;
+
+	printf("--- most frequent opcode %s (of %lu instructions) ---\n",
+	    title, prof_total);
+	qsort(t, n, sizeof(struct prof_triple), prof_cmp);
+	for (i = 0; i < n && i < PROF_TOP && t[i].count > 0; i++) {
+		printf("%10lu %5.1f%%  ", t[i].count,
+		    100.0 * t[i].count / prof_total);
+		for (j = len - 1; j >= 0; j--) {
+			opcode_print((t[i].key >> (8 * j)) & 0xff);
+			printf(j > 0 ? ", " : "\n");
+		}
+	}
+}
+
+void
+vm_profile_dump(void)
+{
+	struct prof_triple *t;
+	int i, j, n = 0;
+
+	t = bhuna_malloc(sizeof(struct prof_triple) * 256 * 256);
+	for (i = 0; i < 256; i++) {
+		for (j = 0; j < 256; j++) {
+			if (prof_pair[i][j] > 0) {
+				t[n].key = (i << 8) | j;
+				t[n].count = prof_pair[i][j];
+				n++;
+			}
+		}
+	}
+	prof_dump_seq("pairs", t, n, 2);
+	bhuna_free(t);
+
+	prof_dump_seq("triples", prof_triple, PROF_TRIPLES, 3);
+	if (prof_lost > 0)
+		printf("(%lu triples not counted; table full)\n", prof_lost);
+}
 #endif
 
 void
@@ -104,6 +383,403 @@ vm_set_pc(struct vm *vm, vm_label_t pc)
 	vm->pc = pc;
 }
 
+/*
+ * Transfers of control between closures.  These are shared by the
+ * interpreter and by native code from the jit; each returns the label
+ * at which execution continues.
+ */
+
+/*
+ * Call the closure on top of the stack, with its arguments below it.
+ * ret is where the matching return will resume.
+ */
+vm_label_t
+vm_call(struct vm *vm, vm_label_t ret)
+{
+	struct value l, r;
+	struct closure *k;
+	struct activation *ar;
+	int j;
+
+	POP_VALUE(l);
+	k = V_SV(l)->v.k;
+#ifdef JIT
+	/*
+	 * Workers count calls to the same closure without a lock, so a
+	 * count may be lost, or seen to reach the threshold twice.  It
+	 * only decides when to compile, not whether it is safe to, and
+	 * jit_compile() takes jit_lock and leaves alone a closure which
+	 * has been compiled already, so that costs at most compiling a
+	 * few calls late, or a call to it which does nothing.  An atomic
+	 * add would cost every call.
+	 */
+	if (++k->entries == jit_threshold)
+		jit_compile(k);
+#endif
+	if (vm->vstack_ptr + k->need > vm->vstack_end ||
+	    vm->cstack_ptr == vm->cstack_end)
+		vm_reserve(vm, k->need);
+	if (k->cc > 0) {
+		/*
+		 * Create a new activation record
+		 * on the heap for this call.
+		 */
+		ar = activation_new_on_heap(k->arity + k->locals,
+		    vm->current_ar, k->ar);
+	} else {
+		/*
+		 * Optimize by placing it on a stack.
+		 */
+		ar = activation_new_on_stack(k->arity + k->locals,
+		    vm->current_ar, k->ar, vm);
+	}
+	/*
+	 * Fill out the activation record.
+	 */
+	for (j = k->arity - 1; j >= 0; j--) {
+		POP_VALUE(r);
+		activation_initialize_value(ar, j, r);
+	}
+
+	vm->current_ar = ar;
+	PUSH_PC(ret);
+	return(k->label);
+}
+
+/*
+ * Tail-call the closure on top of the stack.
+ */
+vm_label_t
+vm_goto(struct vm *vm)
+{
+	struct value l, r;
+	struct closure *k;
+	struct activation *ar;
+	int j;
+
+	POP_VALUE(l);
+	k = V_SV(l)->v.k;
+#ifdef JIT
+	if (++k->entries == jit_threshold)	/* racy; see vm_call() */
+		jit_compile(k);
+#endif
+	if (vm->vstack_ptr + k->need > vm->vstack_end)
+		vm_reserve(vm, k->need);
+
+	/*
+	 * DON'T create a new activation record for this leap
+	 * UNLESS the current activation record isn't large enough.
+	 */
+	if (vm->current_ar->size < k->arity + k->locals) {
+		/*
+		 * REMOVE the current activation record, if on the stack.
+		 */
+		if (vm->current_ar->admin & AR_ADMIN_ON_STACK) {
+			ar = vm->current_ar->caller;
+			activation_free_from_stack(vm->current_ar, vm);
+			vm->current_ar = ar;
+		} else {
+			ar = vm->current_ar->caller;
+			vm->current_ar->caller = NULL;
+			vm->current_ar = ar;
+		}
+
+		/*
+		 * Create a NEW activation record... wherever.
+		 */
+		if (k->cc > 0) {
+			vm->current_ar = activation_new_on_heap(
+			    k->arity + k->locals,
+			    vm->current_ar, k->ar);
+		} else {
+			vm->current_ar = activation_new_on_stack(
+			    k->arity + k->locals,
+			    vm->current_ar, k->ar, vm);
+		}
+	}
+
+	/*
+	 * Fill out the current activation record.
+	 */
+	for (j = k->arity - 1; j >= 0; j--) {
+		POP_VALUE(r);
+		activation_set_value(vm->current_ar, j, 0, r);
+	}
+
+	return(k->label);
+}
+
+/*
+ * Return from the current closure.  Returns NULL if there is
+ * nothing to return to (the process is finished.)
+ */
+vm_label_t
+vm_return(struct vm *vm)
+{
+	struct activation *ar;
+	vm_label_t label;
+
+	label = POP_PC();
+	if (vm->current_ar->admin & AR_ADMIN_ON_STACK) {
+		ar = vm->current_ar->caller;
+		activation_free_from_stack(vm->current_ar, vm);
+		vm->current_ar = ar;
+	} else {
+		/*
+		 * A record left on the heap mustn't keep pointing to its
+		 * caller, which may be on a stack that goes away.
+		 */
+		ar = vm->current_ar->caller;
+		vm->current_ar->caller = NULL;
+		vm->current_ar = ar;
+	}
+	if (vm->current_ar == NULL)
+		return(NULL);
+	return(label);
+}
+
+/*
+ * Collect the current process's heap, if it has grown enough, and
+ * then every heap, if the global one has (see gc.c.)  Each sets its
+ * own next target, from what it left and how long it took.  Collecting
+ * every heap only marks; each process sweeps its own afterwards.
+ */
+static void
+vm_collect(struct vm *vm)
+{
+	struct heap *h = current_heap;
+
+	(void)vm;
+	if (h != &global_heap && h->bytes > h->target) {
+#ifdef DEBUG
+		if (trace_gc > 0) {
+			printf("[GC] process #%d collecting its %luK young and %luK old activation records and values\n",
+			    current_process->number, (unsigned long)h->bytes / 1024,
+			    (unsigned long)h->old_bytes / 1024);
+			dump_activation_stack(vm);
+		}
+#endif
+		gc_local(current_process);
+#ifdef DEBUG
+		if (trace_gc > 0)
+			printf("[GC] process #%d has %luK old left, %luK in the global heap, next after %luK\n",
+			    current_process->number, (unsigned long)h->old_bytes / 1024,
+			    (unsigned long)global_heap.bytes / 1024,
+			    (unsigned long)h->nursery / 1024);
+#endif
+	}
+	if (global_heap.bytes <= global_heap.target)
+		return;
+	if (process_stop_world()) {
+#ifdef DEBUG
+		if (trace_gc > 0) {
+			printf("[GC] GARBAGE COLLECTION STARTED with %luK in the global heap\n",
+				(unsigned long)global_heap.bytes / 1024);
+			dump_activation_stack(vm);
+		}
+#endif
+		gc();
+#ifdef DEBUG
+		if (trace_gc > 0) {
+			printf("[GC] GARBAGE COLLECTION FINISHED, now %luK in the global heap\n",
+				(unsigned long)global_heap.bytes / 1024);
+		}
+#endif
+		process_start_world();
+	}
+	/* ours or another's, it left this process's heap to it to sweep */
+	gc_sweep(current_process);
+}
+
+/*
+ * Every so often, see if it's time to garbage-collect, and
+ * give up control if we've exceeded our timeslice.
+ * The switch engine polls before every instruction; the threaded
+ * engine only polls after control transfers (jumps taken, calls),
+ * so there its timeslice is measured in branches.
+ */
+#define VM_POLL()							\
+	if (((++xcount) & 0xff) == 0) {					\
+		if (current_heap->bytes > current_heap->target ||	\
+		    global_heap.bytes > global_heap.target)		\
+			vm_collect(vm);					\
+		if (xcount >= xmax)					\
+			return(VM_TIME_EXPIRED);			\
+	}
+
+/*
+ * Handlers are written once for both engines.  Each ends in VM_NEXT()
+ * (fall through to the following instruction) or VM_BRANCH() (vm->pc
+ * was just pointed one opcode cell before the target.)
+ */
+#ifdef DIRECT_THREADING
+#define	VM_CASE(x)	op_##x
+#define	VM_DISPATCH()	goto **(void **)vm->pc
+#define	VM_NEXT()	do {						\
+				vm->pc += sizeof(vm_opcode_t);		\
+				VM_DISPATCH();				\
+			} while (0)
+#define	VM_BRANCH()	do {						\
+				vm->pc += sizeof(vm_opcode_t);		\
+				VM_POLL();				\
+				VM_DISPATCH();				\
+			} while (0)
+#else
+#define	VM_CASE(x)	case x
+#define	VM_NEXT()	break
+#define	VM_BRANCH()	break
+#endif
+
+/*
+ * What the inline builtin with the given index would push, given the
+ * operands l and r (r is ignored for NOT.)  The superinstructions and
+ * register instructions handle the common integer cases themselves and
+ * leave everything else to this.
+ */
+static struct value
+vm_operate(int bi, struct value l, struct value r)
+{
+	if (bi == INDEX_BUILTIN_NOT) {
+		if (V_TYPE(l) == VALUE_BOOLEAN)
+			return(value_new_boolean(!V_BOOL(l)));
+		return(value_new_error("type mismatch"));
+	}
+	if (bi == INDEX_BUILTIN_AND || bi == INDEX_BUILTIN_OR) {
+		if (V_TYPE(l) == VALUE_BOOLEAN && V_TYPE(r) == VALUE_BOOLEAN)
+			return(value_new_boolean(bi == INDEX_BUILTIN_AND ?
+			    V_BOOL(l) && V_BOOL(r) : V_BOOL(l) || V_BOOL(r)));
+		return(value_new_error("type mismatch"));
+	}
+	if (bi == INDEX_BUILTIN_EQU &&
+	    V_TYPE(l) == VALUE_OPAQUE && V_TYPE(r) == VALUE_OPAQUE)
+		return(value_new_boolean(V_PTR(l) == V_PTR(r)));
+	if ((bi == INDEX_BUILTIN_EQU || bi == INDEX_BUILTIN_NEQ) &&
+	    (V_TYPE(l) == VALUE_ATOM || V_TYPE(r) == VALUE_ATOM))
+		return(value_new_boolean((V_TYPE(l) == V_TYPE(r) &&
+		    V_ATOM(l) == V_ATOM(r)) == (bi == INDEX_BUILTIN_EQU)));
+	if (V_TYPE(l) != VALUE_INTEGER || V_TYPE(r) != VALUE_INTEGER)
+		return(value_new_error("type mismatch"));
+	switch (bi) {
+	case INDEX_BUILTIN_EQU: return(value_new_boolean(V_INT(l) == V_INT(r)));
+	case INDEX_BUILTIN_NEQ: return(value_new_boolean(V_INT(l) != V_INT(r)));
+	case INDEX_BUILTIN_GT:  return(value_new_boolean(V_INT(l) > V_INT(r)));
+	case INDEX_BUILTIN_LT:  return(value_new_boolean(V_INT(l) < V_INT(r)));
+	case INDEX_BUILTIN_GTE: return(value_new_boolean(V_INT(l) >= V_INT(r)));
+	case INDEX_BUILTIN_LTE: return(value_new_boolean(V_INT(l) <= V_INT(r)));
+	case INDEX_BUILTIN_ADD: return(value_new_integer(V_INT(l) + V_INT(r)));
+	case INDEX_BUILTIN_SUB: return(value_new_integer(V_INT(l) - V_INT(r)));
+	case INDEX_BUILTIN_MUL: return(value_new_integer(V_INT(l) * V_INT(r)));
+	case INDEX_BUILTIN_DIV:
+		if (V_INT(r) == 0)
+			return(value_new_error("division by zero"));
+		return(value_new_integer(V_INT(l) / V_INT(r)));
+	case INDEX_BUILTIN_MOD:
+		if (V_INT(r) == 0)
+			return(value_new_error("modulo by zero"));
+		return(value_new_integer(V_INT(l) % V_INT(r)));
+	}
+	return(value_new_error("type mismatch"));
+}
+
+/*
+ * Bodies of the fused compare-and-branch handlers.
+ */
+#define	LOCAL_VALUE(index, upcount)					\
+	VALARY(AR_LEVEL(vm->current_ar, (upcount)), (index))
+
+#define	LOCAL_OPERAND(n)						\
+	LOCAL_VALUE(*(VM_OPERAND(vm->pc) + (n)),			\
+	    *(VM_OPERAND(vm->pc) + (n) + 1))
+
+#define	CMP_JZ(test, size)						\
+	label = *(vm_label_t *)(VM_OPERAND(vm->pc) + (size));		\
+	if (!(test)) {							\
+		vm->pc = label - sizeof(vm_opcode_t);			\
+		VM_BRANCH();						\
+	}								\
+	vm->pc += (size) + sizeof(vm_label_t);				\
+	VM_NEXT()
+
+#define	CMP_LOCAL_IMM_JZ(op, bi)					\
+	l = LOCAL_OPERAND(0);						\
+	imm = *(int *)(VM_OPERAND(vm->pc) + 2);				\
+	CMP_JZ(V_TYPE(l) == VALUE_INTEGER ? V_INT(l) op imm :		\
+	    V_BOOL(vm_operate(bi, l, value_new_integer(imm))), 2 + sizeof(int))
+
+#define	CMP_LOCAL_LOCAL_JZ(op, bi)					\
+	l = LOCAL_OPERAND(0);						\
+	r = LOCAL_OPERAND(2);						\
+	CMP_JZ(V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER ? \
+	    V_INT(l) op V_INT(r) : V_BOOL(vm_operate(bi, l, r)), 4)
+
+/*
+ * Register instruction operands.  Sources are fetched last-first so
+ * that those on the stack are popped in the right order.
+ */
+#define	REG_GET(x, p)							\
+	if ((p)[1] < REG_CONST)						\
+		x = LOCAL_VALUE((p)[0], (p)[1]);			\
+	else if ((p)[1] == REG_STACK)					\
+		POP_VALUE(x);						\
+	else {								\
+		V_SET_INT(x, VALUE_INTEGER, (signed char)(p)[0]);	\
+	}
+
+#define	REG_SET(p, x)							\
+	if ((p)[1] == 0)						\
+		AR_STORE(vm->current_ar, (p)[0], x);			\
+	else if ((p)[1] == REG_STACK)					\
+		PUSH_VALUE(x);						\
+	else								\
+		activation_set_value(vm->current_ar, (p)[0], (p)[1], x)
+
+/*
+ * Bodies of the register arithmetic handlers: D A B.
+ */
+#define	R_OP(bi, vtype, op)						\
+	REG_GET(r, VM_OPERAND(vm->pc) + 4);				\
+	REG_GET(l, VM_OPERAND(vm->pc) + 2);				\
+	if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {	\
+		V_SET_INT(v, vtype, V_INT(l) op V_INT(r));		\
+	} else								\
+		v = vm_operate(bi, l, r);				\
+	REG_SET(VM_OPERAND(vm->pc), v);					\
+	vm->pc += 6;							\
+	VM_NEXT()
+
+#define	R_SLOW_OP(bi)							\
+	REG_GET(r, VM_OPERAND(vm->pc) + 4);				\
+	REG_GET(l, VM_OPERAND(vm->pc) + 2);				\
+	v = vm_operate(bi, l, r);					\
+	REG_SET(VM_OPERAND(vm->pc), v);					\
+	vm->pc += 6;							\
+	VM_NEXT()
+
+#define	R_CMP_JZ(op, bi)						\
+	REG_GET(r, VM_OPERAND(vm->pc) + 2);				\
+	REG_GET(l, VM_OPERAND(vm->pc));					\
+	CMP_JZ(V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER ? \
+	    V_INT(l) op V_INT(r) : V_BOOL(vm_operate(bi, l, r)), 4)
+
+/*
+ * Body of the unchecked integer handlers.
+ */
+#define	I_OP(vtype, op)							\
+	POP_VALUE(r);							\
+	l = vm->vstack_ptr[-1];						\
+	V_SET_INT(vm->vstack_ptr[-1], vtype, V_INT(l) op V_INT(r));	\
+	VM_NEXT()
+
+#ifdef DIRECT_THREADING
+void **
+vm_dispatch_table(void)
+{
+	if (dispatch_table[INSTR_HALT] == NULL)
+		vm_run(NULL, 0);
+	return(dispatch_table);
+}
+#endif
+
 int
 vm_run(struct vm *vm, int xmax)
 {
@@ -111,7 +787,7 @@ vm_run(struct vm *vm, int xmax)
 	struct value l, r, v;
 	struct activation *ar;
 	struct builtin *ext_bi;
-	int varity;
+	int varity, imm, i;
 	int xcount = 0;
 	struct value zero, one, two;
 	/*int upcount, index; */
@@ -122,6 +798,98 @@ vm_run(struct vm *vm, int xmax)
 	}
 #endif
 
+#ifdef DIRECT_THREADING
+	if (vm == NULL) {
+		/*
+		 * Called by vm_dispatch_table() to publish our handlers.
+		 */
+#ifdef INLINE_BUILTINS
+		dispatch_table[INDEX_BUILTIN_NOT] = &&op_INDEX_BUILTIN_NOT;
+		dispatch_table[INDEX_BUILTIN_AND] = &&op_INDEX_BUILTIN_AND;
+		dispatch_table[INDEX_BUILTIN_OR] = &&op_INDEX_BUILTIN_OR;
+		dispatch_table[INDEX_BUILTIN_EQU] = &&op_INDEX_BUILTIN_EQU;
+		dispatch_table[INDEX_BUILTIN_NEQ] = &&op_INDEX_BUILTIN_NEQ;
+		dispatch_table[INDEX_BUILTIN_GT] = &&op_INDEX_BUILTIN_GT;
+		dispatch_table[INDEX_BUILTIN_LT] = &&op_INDEX_BUILTIN_LT;
+		dispatch_table[INDEX_BUILTIN_GTE] = &&op_INDEX_BUILTIN_GTE;
+		dispatch_table[INDEX_BUILTIN_LTE] = &&op_INDEX_BUILTIN_LTE;
+		dispatch_table[INDEX_BUILTIN_ADD] = &&op_INDEX_BUILTIN_ADD;
+		dispatch_table[INDEX_BUILTIN_MUL] = &&op_INDEX_BUILTIN_MUL;
+		dispatch_table[INDEX_BUILTIN_SUB] = &&op_INDEX_BUILTIN_SUB;
+		dispatch_table[INDEX_BUILTIN_DIV] = &&op_INDEX_BUILTIN_DIV;
+		dispatch_table[INDEX_BUILTIN_MOD] = &&op_INDEX_BUILTIN_MOD;
+		dispatch_table[INSTR_IEQU] = &&op_INSTR_IEQU;
+		dispatch_table[INSTR_INEQ] = &&op_INSTR_INEQ;
+		dispatch_table[INSTR_IGT] = &&op_INSTR_IGT;
+		dispatch_table[INSTR_ILT] = &&op_INSTR_ILT;
+		dispatch_table[INSTR_IGTE] = &&op_INSTR_IGTE;
+		dispatch_table[INSTR_ILTE] = &&op_INSTR_ILTE;
+		dispatch_table[INSTR_IADD] = &&op_INSTR_IADD;
+		dispatch_table[INSTR_ISUB] = &&op_INSTR_ISUB;
+		dispatch_table[INSTR_IMUL] = &&op_INSTR_IMUL;
+#endif
+		dispatch_table[INDEX_BUILTIN_RECV] = &&op_INDEX_BUILTIN_RECV;
+		dispatch_table[INDEX_BUILTIN_SLEEP] = &&op_INDEX_BUILTIN_SLEEP;
+		dispatch_table[INDEX_BUILTIN_PICK] = &&op_INDEX_BUILTIN_PICK;
+		dispatch_table[INSTR_HALT] = &&op_INSTR_HALT;
+		dispatch_table[INSTR_PUSH_VALUE] = &&op_INSTR_PUSH_VALUE;
+		dispatch_table[INSTR_PUSH_ZERO] = &&op_INSTR_PUSH_ZERO;
+		dispatch_table[INSTR_PUSH_ONE] = &&op_INSTR_PUSH_ONE;
+		dispatch_table[INSTR_PUSH_TWO] = &&op_INSTR_PUSH_TWO;
+		dispatch_table[INSTR_PUSH_LOCAL] = &&op_INSTR_PUSH_LOCAL;
+		dispatch_table[INSTR_POP_LOCAL] = &&op_INSTR_POP_LOCAL;
+		dispatch_table[INSTR_INIT_LOCAL] = &&op_INSTR_INIT_LOCAL;
+		dispatch_table[INSTR_JMP] = &&op_INSTR_JMP;
+		dispatch_table[INSTR_JZ] = &&op_INSTR_JZ;
+		dispatch_table[INSTR_CALL] = &&op_INSTR_CALL;
+		dispatch_table[INSTR_GOTO] = &&op_INSTR_GOTO;
+		dispatch_table[INSTR_RET] = &&op_INSTR_RET;
+#ifdef JIT
+		dispatch_table[INSTR_NATIVE] = &&op_INSTR_NATIVE;
+#endif
+		dispatch_table[INSTR_SET_ACTIVATION] = &&op_INSTR_SET_ACTIVATION;
+		dispatch_table[INSTR_COW_LOCAL] = &&op_INSTR_COW_LOCAL;
+		dispatch_table[INSTR_EXTERNAL] = &&op_INSTR_EXTERNAL;
+		dispatch_table[INSTR_PUSH_LOCAL2] = &&op_INSTR_PUSH_LOCAL2;
+		dispatch_table[INSTR_ADD_LOCAL_IMM] = &&op_INSTR_ADD_LOCAL_IMM;
+		dispatch_table[INSTR_EQU_LOCAL_IMM_JZ] = &&op_INSTR_EQU_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_NEQ_LOCAL_IMM_JZ] = &&op_INSTR_NEQ_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_GT_LOCAL_IMM_JZ] = &&op_INSTR_GT_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_LT_LOCAL_IMM_JZ] = &&op_INSTR_LT_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_GTE_LOCAL_IMM_JZ] = &&op_INSTR_GTE_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_LTE_LOCAL_IMM_JZ] = &&op_INSTR_LTE_LOCAL_IMM_JZ;
+		dispatch_table[INSTR_EQU_LOCAL_LOCAL_JZ] = &&op_INSTR_EQU_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_NEQ_LOCAL_LOCAL_JZ] = &&op_INSTR_NEQ_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_GT_LOCAL_LOCAL_JZ] = &&op_INSTR_GT_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_LT_LOCAL_LOCAL_JZ] = &&op_INSTR_LT_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_GTE_LOCAL_LOCAL_JZ] = &&op_INSTR_GTE_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_LTE_LOCAL_LOCAL_JZ] = &&op_INSTR_LTE_LOCAL_LOCAL_JZ;
+		dispatch_table[INSTR_R_MOVE] = &&op_INSTR_R_MOVE;
+		dispatch_table[INSTR_R_NOT] = &&op_INSTR_R_NOT;
+		dispatch_table[INSTR_R_AND] = &&op_INSTR_R_AND;
+		dispatch_table[INSTR_R_OR] = &&op_INSTR_R_OR;
+		dispatch_table[INSTR_R_EQU] = &&op_INSTR_R_EQU;
+		dispatch_table[INSTR_R_NEQ] = &&op_INSTR_R_NEQ;
+		dispatch_table[INSTR_R_GT] = &&op_INSTR_R_GT;
+		dispatch_table[INSTR_R_LT] = &&op_INSTR_R_LT;
+		dispatch_table[INSTR_R_GTE] = &&op_INSTR_R_GTE;
+		dispatch_table[INSTR_R_LTE] = &&op_INSTR_R_LTE;
+		dispatch_table[INSTR_R_ADD] = &&op_INSTR_R_ADD;
+		dispatch_table[INSTR_R_SUB] = &&op_INSTR_R_SUB;
+		dispatch_table[INSTR_R_MUL] = &&op_INSTR_R_MUL;
+		dispatch_table[INSTR_R_DIV] = &&op_INSTR_R_DIV;
+		dispatch_table[INSTR_R_MOD] = &&op_INSTR_R_MOD;
+		dispatch_table[INSTR_R_JZ] = &&op_INSTR_R_JZ;
+		dispatch_table[INSTR_R_EQU_JZ] = &&op_INSTR_R_EQU_JZ;
+		dispatch_table[INSTR_R_NEQ_JZ] = &&op_INSTR_R_NEQ_JZ;
+		dispatch_table[INSTR_R_GT_JZ] = &&op_INSTR_R_GT_JZ;
+		dispatch_table[INSTR_R_LT_JZ] = &&op_INSTR_R_LT_JZ;
+		dispatch_table[INSTR_R_GTE_JZ] = &&op_INSTR_R_GTE_JZ;
+		dispatch_table[INSTR_R_LTE_JZ] = &&op_INSTR_R_LTE_JZ;
+		return(VM_TERMINATED);
+	}
+#endif
+
 	zero = value_new_integer(0);
 	value_deregister(zero);
 	one = value_new_integer(1);
@@ -129,6 +897,10 @@ vm_run(struct vm *vm, int xmax)
 	two = value_new_integer(2);
 	value_deregister(two);
 
+#ifdef DIRECT_THREADING
+	VM_DISPATCH();
+	{
+#else
 	while (*vm->pc != INSTR_HALT) {
 #ifdef DEBUG
 		if (trace_vm) {
@@ -136,193 +908,194 @@ vm_run(struct vm *vm, int xmax)
 			dump_stack(vm);
 		}
 #endif
-		if (((++xcount) & 0xff) == 0) {
-			if (a_count + v_count > gc_target) {
+		VM_POLL();
 #ifdef DEBUG
-				if (trace_gc > 0) {
-					printf("[ARC] GARBAGE COLLECTION STARTED on %d activation records + %d values\n",
-						a_count, v_count);
-					/*activation_dump(current_ar, 0);
-					printf("\n");*/
-					dump_activation_stack(vm);
-				}
+		if (profile_vm)
+			vm_profile(vm->pc);
 #endif
-				gc();
-#ifdef DEBUG
-				if (trace_gc > 0) {
-					printf("[ARC] GARBAGE COLLECTION FINISHED, now %d activation records + %d values\n",
-						a_count, v_count);
-					/*activation_dump(current_ar, 0);
-					printf("\n");*/
-				}
-#endif
-				/*
-				 * Slide the target to account for the fact that there
-				 * are now 'a_count' activation records in existence.
-				 * Only GC when there are gc_trigger *more* ar's.
-				 */
-				gc_target = a_count + v_count + gc_trigger;
-			}
-			
-			/*
-			 * Also, give up control if we've exceeded our timeslice.
-			 */
-			if (xcount >= xmax)
-				return(VM_TIME_EXPIRED);
-		}
 
 		switch (*vm->pc) {
+#endif
 
 #ifdef INLINE_BUILTINS
-		case INDEX_BUILTIN_NOT:
+		VM_CASE(INDEX_BUILTIN_NOT):
 			POP_VALUE(l);
-			if (l.type == VALUE_BOOLEAN) {
-				v = value_new_boolean(!l.v.b);
+			if (V_TYPE(l) == VALUE_BOOLEAN) {
+				v = value_new_boolean(!V_BOOL(l));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_AND:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_AND):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_BOOLEAN && r.type == VALUE_BOOLEAN) {
-				v = value_new_boolean(l.v.b && r.v.b);
+			if (V_TYPE(l) == VALUE_BOOLEAN && V_TYPE(r) == VALUE_BOOLEAN) {
+				v = value_new_boolean(V_BOOL(l) && V_BOOL(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_OR:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_OR):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_BOOLEAN && r.type == VALUE_BOOLEAN) {
-				v = value_new_boolean(l.v.b || r.v.b);
+			if (V_TYPE(l) == VALUE_BOOLEAN && V_TYPE(r) == VALUE_BOOLEAN) {
+				v = value_new_boolean(V_BOOL(l) || V_BOOL(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
+			VM_NEXT();
 
-		case INDEX_BUILTIN_EQU:
+		VM_CASE(INDEX_BUILTIN_EQU):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i == r.v.i);
-			} else if (l.type == VALUE_OPAQUE && r.type == VALUE_OPAQUE) {
-				v = value_new_boolean(l.v.ptr == r.v.ptr);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) == V_INT(r));
+			} else if (V_TYPE(l) == VALUE_OPAQUE && V_TYPE(r) == VALUE_OPAQUE) {
+				v = value_new_boolean(V_PTR(l) == V_PTR(r));
+			} else if (V_TYPE(l) == VALUE_ATOM || V_TYPE(r) == VALUE_ATOM) {
+				v = value_new_boolean(V_TYPE(l) == V_TYPE(r) &&
+				    V_ATOM(l) == V_ATOM(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_NEQ:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_NEQ):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i != r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) != V_INT(r));
+			} else if (V_TYPE(l) == VALUE_ATOM || V_TYPE(r) == VALUE_ATOM) {
+				v = value_new_boolean(V_TYPE(l) != V_TYPE(r) ||
+				    V_ATOM(l) != V_ATOM(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_GT:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_GT):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i > r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) > V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_LT:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_LT):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i < r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) < V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_GTE:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_GTE):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i >= r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) >= V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_LTE:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_LTE):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_boolean(l.v.i <= r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_boolean(V_INT(l) <= V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
+			VM_NEXT();
 
-		case INDEX_BUILTIN_ADD:
+		VM_CASE(INDEX_BUILTIN_ADD):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_integer(l.v.i + r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_integer(V_INT(l) + V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_MUL:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_MUL):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_integer(l.v.i * r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_integer(V_INT(l) * V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_SUB:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_SUB):
 			POP_VALUE(r);
 			POP_VALUE(l);
 			/* subs++; */
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				v = value_new_integer(l.v.i - r.v.i);
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				v = value_new_integer(V_INT(l) - V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_DIV:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_DIV):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				if (r.v.i == 0)
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				if (V_INT(r) == 0)
 					v = value_new_error("division by zero");
 				else
-					v = value_new_integer(l.v.i / r.v.i);
+					v = value_new_integer(V_INT(l) / V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");
 			}
 			PUSH_VALUE(v);
-			break;
-		case INDEX_BUILTIN_MOD:
+			VM_NEXT();
+		VM_CASE(INDEX_BUILTIN_MOD):
 			POP_VALUE(r);
 			POP_VALUE(l);
-			if (l.type == VALUE_INTEGER && r.type == VALUE_INTEGER) {
-				if (r.v.i == 0)
+			if (V_TYPE(l) == VALUE_INTEGER && V_TYPE(r) == VALUE_INTEGER) {
+				if (V_INT(r) == 0)
 					v = value_new_error("modulo by zero");
 				else
-					v = value_new_integer(l.v.i % r.v.i);
+					v = value_new_integer(V_INT(l) % V_INT(r));
 			} else {
 				v = value_new_error("type mismatch");			}
 			PUSH_VALUE(v);
-			break;
+			VM_NEXT();
+
+		/*
+		 * Unchecked integer instructions: the operands are known
+		 * to be integers, so the result replaces the left one.
+		 */
+		VM_CASE(INSTR_IEQU):
+			I_OP(VALUE_BOOLEAN, ==);
+		VM_CASE(INSTR_INEQ):
+			I_OP(VALUE_BOOLEAN, !=);
+		VM_CASE(INSTR_IGT):
+			I_OP(VALUE_BOOLEAN, >);
+		VM_CASE(INSTR_ILT):
+			I_OP(VALUE_BOOLEAN, <);
+		VM_CASE(INSTR_IGTE):
+			I_OP(VALUE_BOOLEAN, >=);
+		VM_CASE(INSTR_ILTE):
+			I_OP(VALUE_BOOLEAN, <=);
+		VM_CASE(INSTR_IADD):
+			I_OP(VALUE_INTEGER, +);
+		VM_CASE(INSTR_ISUB):
+			I_OP(VALUE_INTEGER, -);
+		VM_CASE(INSTR_IMUL):
+			I_OP(VALUE_INTEGER, *);
 
 #endif /* INLINE_BUILTINS */
 
@@ -331,23 +1104,56 @@ vm_run(struct vm *vm, int xmax)
 		 * isn't used (in practice INLINE_BUILTINS will always be
 		 * used anyway...)
 		 */
-		case INDEX_BUILTIN_RECV:
+		VM_CASE(INDEX_BUILTIN_RECV):
 			POP_VALUE(l);
 			r = value_null();
 
-			if (l.type == VALUE_INTEGER) {
-				if (!process_recv(&r)) {
+			if (V_TYPE(l) != VALUE_INTEGER) {
+				r = value_new_error("type mismatch");
+			} else if (process_picking()) {
+				r = value_new_error("receive in Pick predicate");
+			} else if (!process_recv(&r)) {
+				if (!process_wait(PROCESS_RECV, V_INT(l))) {
 					PUSH_VALUE(l);
 					return(VM_WAITING);
 				}
-			} else {
+				r = value_new_atom(process_timeout);
+			}
+			PUSH_VALUE(r);
+			VM_NEXT();
+
+		/*
+		 * The pattern stays on the stack until Pick is done with
+		 * it, so that a predicate can't be collected while it runs.
+		 */
+		VM_CASE(INDEX_BUILTIN_PICK):
+			l = vm->vstack_ptr[-1];
+			if (V_TYPE(l) != VALUE_INTEGER) {
 				r = value_new_error("type mismatch");
+			} else if (process_picking()) {
+				r = value_new_error("receive in Pick predicate");
+			} else if ((i = process_pick(vm->vstack_ptr[-2], &r)) < 0) {
+				r = value_new_error("type mismatch");
+			} else if (i == 0) {
+				if (!process_wait(PROCESS_RECV, V_INT(l)))
+					return(VM_WAITING);
+				r = value_new_atom(process_timeout);
 			}
+			vm->vstack_ptr -= 2;
 			PUSH_VALUE(r);
-			break;
+			VM_NEXT();
+
+		VM_CASE(INDEX_BUILTIN_SLEEP):
+			POP_VALUE(l);
+			if (V_TYPE(l) == VALUE_INTEGER &&
+			    !process_wait(PROCESS_SLEEP, V_INT(l) < 0 ? 0 : V_INT(l))) {
+				PUSH_VALUE(l);
+				return(VM_WAITING);
+			}
+			VM_NEXT();
 
-		case INSTR_PUSH_VALUE:
-			l = *(struct value *)(vm->pc + 1);
+		VM_CASE(INSTR_PUSH_VALUE):
+			l = *(struct value *)VM_OPERAND(vm->pc);
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_PUSH_VALUE:\n");
@@ -357,36 +1163,35 @@ vm_run(struct vm *vm, int xmax)
 #endif
 			PUSH_VALUE(l);
 			vm->pc += sizeof(struct value);
-			break;
+			VM_NEXT();
 
-		case INSTR_PUSH_ZERO:
+		VM_CASE(INSTR_PUSH_ZERO):
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_PUSH_ZERO\n");
 			}
 #endif
 			PUSH_VALUE(zero);
-			break;
-		case INSTR_PUSH_ONE:
+			VM_NEXT();
+		VM_CASE(INSTR_PUSH_ONE):
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_PUSH_ONE\n");
 			}
 #endif
 			PUSH_VALUE(one);
-			break;
-		case INSTR_PUSH_TWO:
+			VM_NEXT();
+		VM_CASE(INSTR_PUSH_TWO):
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_PUSH_TWO\n");
 			}
 #endif
 			PUSH_VALUE(two);
-			break;
+			VM_NEXT();
 
-		case INSTR_PUSH_LOCAL:
-			l = activation_get_value(vm->current_ar,
-			    *(vm->pc + 1), *(vm->pc + 2));
+		VM_CASE(INSTR_PUSH_LOCAL):
+			l = LOCAL_OPERAND(0);
 
 #ifdef DEBUG
 			if (trace_vm) {
@@ -397,9 +1202,9 @@ vm_run(struct vm *vm, int xmax)
 #endif
 			PUSH_VALUE(l);
 			vm->pc += sizeof(unsigned char) * 2;
-			break;
+			VM_NEXT();
 
-		case INSTR_POP_LOCAL:
+		VM_CASE(INSTR_POP_LOCAL):
 			POP_VALUE(l);
 #ifdef DEBUG
 			if (trace_vm) {
@@ -409,11 +1214,11 @@ vm_run(struct vm *vm, int xmax)
 			}
 #endif
 			activation_set_value(vm->current_ar,
-			    *(vm->pc + 1), *(vm->pc + 2), l);
+			    *VM_OPERAND(vm->pc), *(VM_OPERAND(vm->pc) + 1), l);
 			vm->pc += sizeof(unsigned char) * 2;
-			break;
+			VM_NEXT();
 
-		case INSTR_INIT_LOCAL:
+		VM_CASE(INSTR_INIT_LOCAL):
 			POP_VALUE(l);
 #ifdef DEBUG
 			if (trace_vm) {
@@ -423,23 +1228,23 @@ vm_run(struct vm *vm, int xmax)
 			}
 #endif
 			activation_initialize_value(vm->current_ar,
-			    *(vm->pc + 1), l);
+			    *VM_OPERAND(vm->pc), l);
 			vm->pc += sizeof(unsigned char) * 2;
-			break;
+			VM_NEXT();
 
-		case INSTR_JMP:
-			label = *(vm_label_t *)(vm->pc + 1);
+		VM_CASE(INSTR_JMP):
+			label = *(vm_label_t *)VM_OPERAND(vm->pc);
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_JMP -> #%d:\n", label - vm->program);
 			}
 #endif
-			vm->pc = label - 1;
-			break;
+			vm->pc = label - sizeof(vm_opcode_t);
+			VM_BRANCH();
 
-		case INSTR_JZ:
+		VM_CASE(INSTR_JZ):
 			POP_VALUE(l);
-			label = *(vm_label_t *)(vm->pc + 1);
+			label = *(vm_label_t *)VM_OPERAND(vm->pc);
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_JZ -> ");
@@ -447,173 +1252,91 @@ vm_run(struct vm *vm, int xmax)
 				printf(", #%d:\n", label - vm->program);
 			}
 #endif
-			if (!l.v.b) {
-				vm->pc = label - 1;
+			if (!V_BOOL(l)) {
+				vm->pc = label - sizeof(vm_opcode_t);
+				VM_BRANCH();
 			} else {
 				vm->pc += sizeof(vm_label_t);
 			}
-			break;
+			VM_NEXT();
 
-		case INSTR_CALL:
-			POP_VALUE(l);
-			label = l.v.s->v.k->label;
-			if (l.v.s->v.k->cc > 0) {
-				/*
-				 * Create a new activation record
-				 * on the heap for this call.
-				 */
-				ar = activation_new_on_heap(
-				    l.v.s->v.k->arity +
-				    l.v.s->v.k->locals,
-				    vm->current_ar, l.v.s->v.k->ar);
-			} else {
-				/*
-				 * Optimize by placing it on a stack.
-				 */
-				ar = activation_new_on_stack(
-				    l.v.s->v.k->arity +
-				    l.v.s->v.k->locals,
-				    vm->current_ar, l.v.s->v.k->ar, vm);
-			}
-			/*
-			 * Fill out the activation record.
-			 */
-			for (i = l.v.s->v.k->arity - 1; i >= 0; i--) {
-				POP_VALUE(r);
-				activation_initialize_value(ar, i, r);
-			}
-
-			vm->current_ar = ar;
+		VM_CASE(INSTR_CALL):
+			label = vm_call(vm, vm->pc + sizeof(vm_opcode_t));
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_CALL -> #%d:\n", label - vm->program);
 			}
 #endif
-			/*
-			printf("%% process %d pushing pc = %d\n",
-			    current_process->number, vm->pc - vm->program);
-			*/
-			PUSH_PC(vm->pc + 1); /* + sizeof(vm_label_t)); */
-			vm->pc = label - 1;
-			break;
-
-		case INSTR_GOTO:
-			POP_VALUE(l);
-			label = l.v.s->v.k->label;
-
-			/*
-			 * DON'T create a new activation record for this leap
-			 * UNLESS the current activation record isn't large enough.
-			 */
-			/*
-			printf("GOTOing a closure w/arity %d locals %d\n",
-				l.v.s->v.k->arity, l.v.s->v.k->locals);
-			printf("current ar size %d\n", current_ar->size);
-			*/
-
-			if (vm->current_ar->size < l.v.s->v.k->arity + l.v.s->v.k->locals) {
-				/*
-				 * REMOVE the current activation record, if on the stack.
-				 */
-				if (vm->current_ar->admin & AR_ADMIN_ON_STACK) {
-					ar = vm->current_ar->caller;
-					activation_free_from_stack(vm->current_ar, vm);
-					vm->current_ar = ar;
-				} else {
-					vm->current_ar = vm->current_ar->caller;
-				}
-
-				/*
-				 * Create a NEW activation record... wherever.
-				 */
-				if (l.v.s->v.k->cc > 0) {
-					/*
-					 * Create a new activation record
-					 * on the heap for this call.
-					 */
-					vm->current_ar = activation_new_on_heap(
-					    l.v.s->v.k->arity +
-					    l.v.s->v.k->locals,
-					    vm->current_ar, l.v.s->v.k->ar);
-				} else {
-					/*
-					 * Optimize by placing it on a stack.
-					 */
-					vm->current_ar = activation_new_on_stack(
-					    l.v.s->v.k->arity +
-					    l.v.s->v.k->locals,
-					    vm->current_ar, l.v.s->v.k->ar, vm);
-				}
-			}
-
-			/*
-			printf("NOW GOTOing a closure w/arity %d locals %d\n",
-				l.v.s->v.k->arity, l.v.s->v.k->locals);
-			printf("NOW current ar size %d\n", current_ar->size);
-			*/
-
-			/*
-			 * Fill out the current activation record.
-			 */
-			for (i = l.v.s->v.k->arity - 1; i >= 0; i--) {
-				POP_VALUE(r);
-				activation_set_value(vm->current_ar, i, 0, r);
-			}
+			vm->pc = label - sizeof(vm_opcode_t);
+			VM_BRANCH();
 
+		VM_CASE(INSTR_GOTO):
+			label = vm_goto(vm);
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_GOTO -> #%d:\n", label - vm->program);
 			}
 #endif
-			/*PUSH_PC(pc + 1);*/ /* + sizeof(vm_label_t)); */
-			vm->pc = label - 1;
-			break;
+			vm->pc = label - sizeof(vm_opcode_t);
+			VM_BRANCH();
 
-		case INSTR_RET:
-			vm->pc = POP_PC() - 1;
-			/*
-			printf("%% process %d popped pc = %d\n",
-			    current_process->number, vm->pc - vm->program);
-			*/
-			if (vm->current_ar->admin & AR_ADMIN_ON_STACK) {
-				ar = vm->current_ar->caller;
-				activation_free_from_stack(vm->current_ar, vm);
-				vm->current_ar = ar;
-			} else {
-				vm->current_ar = vm->current_ar->caller;
+		VM_CASE(INSTR_RET):
+			if ((label = vm_return(vm)) == NULL)
+				return(VM_RETURNED);
+#ifdef DEBUG
+			if (trace_vm) {
+				printf("INSTR_RET -> #%d:\n", label - vm->program);
 			}
-			if (vm->current_ar == NULL)
+#endif
+			vm->pc = label - sizeof(vm_opcode_t);
+			VM_NEXT();
+
+#ifdef JIT
+		VM_CASE(INSTR_NATIVE):
+			if ((label = (*(vm_native_t *)VM_OPERAND(vm->pc))(vm)) == NULL)
 				return(VM_RETURNED);
 #ifdef DEBUG
 			if (trace_vm) {
-				printf("INSTR_RET -> #%d:\n", vm->pc - vm->program);
+				printf("INSTR_NATIVE -> #%d:\n", label - vm->program);
 			}
 #endif
-			break;
+			vm->pc = label - sizeof(vm_opcode_t);
+			VM_BRANCH();
+#endif
 
-		case INSTR_SET_ACTIVATION:
+		VM_CASE(INSTR_SET_ACTIVATION):
 			POP_VALUE(l);
-			l.v.s->v.k->ar = vm->current_ar;
+			V_SV(l)->v.k->ar = vm->current_ar;
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_SET_ACTIVATION #%d\n",
-				    l.v.s->v.k->label - vm->program);
+				    V_SV(l)->v.k->label - vm->program);
 			}
 #endif
 			PUSH_VALUE(l);
-			break;
+			VM_NEXT();
 
-		case INSTR_COW_LOCAL:
-			l = activation_get_value(vm->current_ar, *(vm->pc + 1), *(vm->pc + 2));
+		VM_CASE(INSTR_COW_LOCAL):
+			/*
+			 * Store changes a list or dict in place, so if
+			 * anything else refers to the one in this local, or
+			 * it is part of the program, the local is given a
+			 * copy of its own first (see V_REF.)  A frozen one
+			 * is left for Store to refuse.
+			 */
+			l = activation_get_value(vm->current_ar, *VM_OPERAND(vm->pc), *(VM_OPERAND(vm->pc) + 1));
 
-			if (l.v.s->refcount > 1) {
+			if ((V_TYPE(l) == VALUE_LIST || V_TYPE(l) == VALUE_DICT) &&
+			    !(V_SV(l)->admin & ADMIN_FROZEN) &&
+			    (V_SV(l)->refcount > 1 ||
+			     (V_SV(l)->admin & ADMIN_PERMANENT))) {
 				/*
 				printf("deep-copying ");
 				value_print(l);
 				printf("...\n");
 				*/
 				r = value_dup(l);
-				activation_set_value(vm->current_ar, *(vm->pc + 1), *(vm->pc + 2), r);
+				activation_set_value(vm->current_ar, *VM_OPERAND(vm->pc), *(VM_OPERAND(vm->pc) + 1), r);
 			}
 
 #ifdef DEBUG
@@ -625,10 +1348,10 @@ vm_run(struct vm *vm, int xmax)
 #endif
 
 			vm->pc += sizeof(unsigned char) * 2;
-			break;
+			VM_NEXT();
 
-		case INSTR_EXTERNAL:
-			ext_bi = *(struct builtin **)(vm->pc + 1);
+		VM_CASE(INSTR_EXTERNAL):
+			ext_bi = *(struct builtin **)VM_OPERAND(vm->pc);
 #ifdef DEBUG
 			if (trace_vm) {
 				printf("INSTR_EXTERNAL(");
@@ -639,9 +1362,10 @@ vm_run(struct vm *vm, int xmax)
 			varity = ext_bi->arity;
 			if (varity == -1) {
 				POP_VALUE(l);
-				varity = l.v.i;
+				varity = V_INT(l);
 			}
 			ar = activation_new_on_stack(varity, vm->current_ar, NULL, vm);
+			ar->admin |= AR_ADMIN_UNCOUNTED;
 			for (i = varity - 1; i >= 0; i--) {
 				POP_VALUE(l);
 				activation_initialize_value(ar, i, l);
@@ -660,7 +1384,113 @@ vm_run(struct vm *vm, int xmax)
 				PUSH_VALUE(v);
 
 			vm->pc += sizeof(struct builtin *);
-			break;
+			VM_NEXT();
+
+		/*
+		 * Superinstructions.
+		 */
+		VM_CASE(INSTR_PUSH_LOCAL2):
+			l = LOCAL_OPERAND(0);
+			r = LOCAL_OPERAND(2);
+			PUSH_VALUE(l);
+			PUSH_VALUE(r);
+			vm->pc += sizeof(unsigned char) * 4;
+			VM_NEXT();
+
+		VM_CASE(INSTR_ADD_LOCAL_IMM):
+			l = LOCAL_OPERAND(0);
+			imm = *(int *)(VM_OPERAND(vm->pc) + 2);
+			if (V_TYPE(l) == VALUE_INTEGER) {
+				v = value_new_integer(V_INT(l) + imm);
+			} else {
+				v = value_new_error("type mismatch");
+			}
+			PUSH_VALUE(v);
+			vm->pc += sizeof(unsigned char) * 2 + sizeof(int);
+			VM_NEXT();
+
+		VM_CASE(INSTR_EQU_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(==, INDEX_BUILTIN_EQU);
+		VM_CASE(INSTR_NEQ_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(!=, INDEX_BUILTIN_NEQ);
+		VM_CASE(INSTR_GT_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(>, INDEX_BUILTIN_GT);
+		VM_CASE(INSTR_LT_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(<, INDEX_BUILTIN_LT);
+		VM_CASE(INSTR_GTE_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(>=, INDEX_BUILTIN_GTE);
+		VM_CASE(INSTR_LTE_LOCAL_IMM_JZ):
+			CMP_LOCAL_IMM_JZ(<=, INDEX_BUILTIN_LTE);
+
+		VM_CASE(INSTR_EQU_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(==, INDEX_BUILTIN_EQU);
+		VM_CASE(INSTR_NEQ_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(!=, INDEX_BUILTIN_NEQ);
+		VM_CASE(INSTR_GT_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(>, INDEX_BUILTIN_GT);
+		VM_CASE(INSTR_LT_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(<, INDEX_BUILTIN_LT);
+		VM_CASE(INSTR_GTE_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(>=, INDEX_BUILTIN_GTE);
+		VM_CASE(INSTR_LTE_LOCAL_LOCAL_JZ):
+			CMP_LOCAL_LOCAL_JZ(<=, INDEX_BUILTIN_LTE);
+
+		/*
+		 * Register instructions.
+		 */
+		VM_CASE(INSTR_R_MOVE):
+			REG_GET(l, VM_OPERAND(vm->pc) + 2);
+			REG_SET(VM_OPERAND(vm->pc), l);
+			vm->pc += 4;
+			VM_NEXT();
+		VM_CASE(INSTR_R_NOT):
+			REG_GET(l, VM_OPERAND(vm->pc) + 2);
+			v = vm_operate(INDEX_BUILTIN_NOT, l, l);
+			REG_SET(VM_OPERAND(vm->pc), v);
+			vm->pc += 4;
+			VM_NEXT();
+		VM_CASE(INSTR_R_AND):
+			R_SLOW_OP(INDEX_BUILTIN_AND);
+		VM_CASE(INSTR_R_OR):
+			R_SLOW_OP(INDEX_BUILTIN_OR);
+		VM_CASE(INSTR_R_EQU):
+			R_OP(INDEX_BUILTIN_EQU, VALUE_BOOLEAN, ==);
+		VM_CASE(INSTR_R_NEQ):
+			R_OP(INDEX_BUILTIN_NEQ, VALUE_BOOLEAN, !=);
+		VM_CASE(INSTR_R_GT):
+			R_OP(INDEX_BUILTIN_GT, VALUE_BOOLEAN, >);
+		VM_CASE(INSTR_R_LT):
+			R_OP(INDEX_BUILTIN_LT, VALUE_BOOLEAN, <);
+		VM_CASE(INSTR_R_GTE):
+			R_OP(INDEX_BUILTIN_GTE, VALUE_BOOLEAN, >=);
+		VM_CASE(INSTR_R_LTE):
+			R_OP(INDEX_BUILTIN_LTE, VALUE_BOOLEAN, <=);
+		VM_CASE(INSTR_R_ADD):
+			R_OP(INDEX_BUILTIN_ADD, VALUE_INTEGER, +);
+		VM_CASE(INSTR_R_SUB):
+			R_OP(INDEX_BUILTIN_SUB, VALUE_INTEGER, -);
+		VM_CASE(INSTR_R_MUL):
+			R_OP(INDEX_BUILTIN_MUL, VALUE_INTEGER, *);
+		VM_CASE(INSTR_R_DIV):
+			R_SLOW_OP(INDEX_BUILTIN_DIV);
+		VM_CASE(INSTR_R_MOD):
+			R_SLOW_OP(INDEX_BUILTIN_MOD);
+		VM_CASE(INSTR_R_JZ):
+			REG_GET(l, VM_OPERAND(vm->pc));
+			CMP_JZ(V_BOOL(l), 2);
+		VM_CASE(INSTR_R_EQU_JZ):
+			R_CMP_JZ(==, INDEX_BUILTIN_EQU);
+		VM_CASE(INSTR_R_NEQ_JZ):
+			R_CMP_JZ(!=, INDEX_BUILTIN_NEQ);
+		VM_CASE(INSTR_R_GT_JZ):
+			R_CMP_JZ(>, INDEX_BUILTIN_GT);
+		VM_CASE(INSTR_R_LT_JZ):
+			R_CMP_JZ(<, INDEX_BUILTIN_LT);
+		VM_CASE(INSTR_R_GTE_JZ):
+			R_CMP_JZ(>=, INDEX_BUILTIN_GTE);
+		VM_CASE(INSTR_R_LTE_JZ):
+			R_CMP_JZ(<=, INDEX_BUILTIN_LTE);
+#ifndef DIRECT_THREADING
 		default:
 			/*
 			 * We assume it was a non-inline builtin.
@@ -675,9 +1505,10 @@ vm_run(struct vm *vm, int xmax)
 			varity = builtins[*vm->pc].arity;
 			if (varity == -1) {
 				POP_VALUE(l);
-				varity = l.v.i;
+				varity = V_INT(l);
 			}
 			ar = activation_new_on_stack(varity, vm->current_ar, NULL, vm);
+			ar->admin |= AR_ADMIN_UNCOUNTED;
 			for (i = varity - 1; i >= 0; i--) {
 				POP_VALUE(l);
 				activation_initialize_value(ar, i, l);
@@ -695,8 +1526,13 @@ vm_run(struct vm *vm, int xmax)
 			if (builtins[*vm->pc].retval == 1)
 				PUSH_VALUE(v);
 		}
-		vm->pc++;
+		vm->pc += sizeof(vm_opcode_t);
 	}
+#else
+	VM_CASE(INSTR_HALT):
+		;
+	}
+#endif
 
 #ifdef DEBUG
 	if (trace_vm) {
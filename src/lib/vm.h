@@ -12,6 +12,38 @@ struct iprogram;
 
 typedef	unsigned char *	vm_label_t;
 
+/*
+ * With DIRECT_THREADING, the first cell of each instruction in the
+ * generated program is the address of its handler inside vm_run()
+ * instead of an opcode byte, and vm_run() jumps from handler to handler
+ * with computed gotos.  This needs GCC's labels-as-values; tracing needs
+ * the per-instruction loop of the switch engine, so DEBUG builds use that.
+ */
+#if defined(DIRECT_THREADING) && (!defined(__GNUC__) || defined(DEBUG))
+#undef DIRECT_THREADING
+#endif
+
+/*
+ * With JIT, closures which are called often enough are compiled to
+ * native code by jit.c.  Only x86-64 is supported, and only with the
+ * 16-byte struct value; otherwise the flag is ignored and everything
+ * is interpreted.
+ */
+#if defined(JIT) && (!defined(__x86_64__) || defined(TAGGED_VALUES))
+#undef JIT
+#endif
+
+#ifdef DIRECT_THREADING
+typedef void *		vm_opcode_t;
+#else
+typedef unsigned char	vm_opcode_t;
+#endif
+
+/*
+ * Operands of an instruction follow its opcode cell.
+ */
+#define	VM_OPERAND(pc)		((pc) + sizeof(vm_opcode_t))
+
 #define	INSTR_HALT		128
 #define	INSTR_PUSH_VALUE	129
 #define	INSTR_PUSH_LOCAL	130
@@ -30,28 +62,140 @@ typedef	unsigned char *	vm_label_t;
 #define	INSTR_PUSH_TWO		143
 #define INSTR_INIT_LOCAL	144
 
+/*
+ * Superinstructions, formed from common sequences by
+ * iprogram_fuse_superinstructions().  Operands are given in
+ * order after the opcode: L is a local (index, upcount), I an
+ * int immediate, and J a branch label taken if the comparison fails.
+ */
+#define	INSTR_PUSH_LOCAL2	145	/* L L: PUSH_LOCAL, PUSH_LOCAL */
+#define	INSTR_ADD_LOCAL_IMM	146	/* L I: PUSH_LOCAL, PUSH int, ADD/SUB */
+#define	INSTR_EQU_LOCAL_IMM_JZ	147	/* L I J: PUSH_LOCAL, PUSH int, cmp, JZ */
+#define	INSTR_NEQ_LOCAL_IMM_JZ	148
+#define	INSTR_GT_LOCAL_IMM_JZ	149
+#define	INSTR_LT_LOCAL_IMM_JZ	150
+#define	INSTR_GTE_LOCAL_IMM_JZ	151
+#define	INSTR_LTE_LOCAL_IMM_JZ	152
+#define	INSTR_EQU_LOCAL_LOCAL_JZ 153	/* L L J: PUSH_LOCAL x2, cmp, JZ */
+#define	INSTR_NEQ_LOCAL_LOCAL_JZ 154
+#define	INSTR_GT_LOCAL_LOCAL_JZ	155
+#define	INSTR_LT_LOCAL_LOCAL_JZ	156
+#define	INSTR_GTE_LOCAL_LOCAL_JZ 157
+#define	INSTR_LTE_LOCAL_LOCAL_JZ 158
+
+/*
+ * Enter native code compiled by the jit.  The operand is a vm_native_t;
+ * the native code runs on the vm's state and returns the label at which
+ * interpretation should continue (NULL if the process has returned.)
+ * These instructions live in small stubs made by jit.c, never in the
+ * generated program.
+ */
+#define	INSTR_NATIVE		159	/* N */
+
+/*
+ * Register-machine instructions, generated by iprogram_gen_registers().
+ * Each operand is two bytes naming a slot in an activation record,
+ * (index, upcount), like the operand of INSTR_PUSH_LOCAL; or else one
+ * of the pseudo-registers below.  D is the destination, A and B the
+ * sources and J a branch label taken if the comparison fails.
+ * The arithmetic instructions are numbered INSTR_R_MOVE + builtin index.
+ */
+#define	REG_STACK		0xff	/* upcount: pop/push the vm stack */
+#define	REG_CONST		0xfe	/* upcount: index is a signed char */
+
+#define	INSTR_R_MOVE		160	/* D A */
+#define	INSTR_R_NOT		161	/* D A */
+#define	INSTR_R_AND		162	/* D A B */
+#define	INSTR_R_OR		163
+#define	INSTR_R_EQU		164
+#define	INSTR_R_NEQ		165
+#define	INSTR_R_GT		166
+#define	INSTR_R_LT		167
+#define	INSTR_R_GTE		168
+#define	INSTR_R_LTE		169
+#define	INSTR_R_ADD		170
+#define	INSTR_R_SUB		171
+#define	INSTR_R_MUL		172
+#define	INSTR_R_DIV		173
+#define	INSTR_R_MOD		174
+#define	INSTR_R_JZ		175	/* A J */
+#define	INSTR_R_EQU_JZ		176	/* A B J */
+#define	INSTR_R_NEQ_JZ		177
+#define	INSTR_R_GT_JZ		178
+#define	INSTR_R_LT_JZ		179
+#define	INSTR_R_GTE_JZ		180
+#define	INSTR_R_LTE_JZ		181
+
+/*
+ * Unchecked integer arithmetic and comparison, generated in place of
+ * the inline builtins where type inference has proven both operands
+ * are integers.  They are numbered INSTR_IEQU + (builtin index -
+ * INDEX_BUILTIN_EQU); icode_builtin_index() maps them back.
+ */
+#define	INSTR_IEQU		182
+#define	INSTR_INEQ		183
+#define	INSTR_IGT		184
+#define	INSTR_ILT		185
+#define	INSTR_IGTE		186
+#define	INSTR_ILTE		187
+#define	INSTR_IADD		188
+#define	INSTR_ISUB		189
+#define	INSTR_IMUL		190
+
+/*
+ * A vm starts out on small stacks, allocated in one piece with it, so
+ * that a process costs only a few hundred bytes until it needs more.
+ * Calls check for room (see vm_reserve()); the first time the small
+ * value and call stacks are not enough, they are moved to stacks
+ * reserved at the sizes below, of which only as much as has been
+ * touched is actually allocated (see stack.c.)  Activation records
+ * which don't fit on the small activation stack go on a reserved one
+ * instead, until they are freed again.
+ */
+#define	VM_VSTACK_SMALL		8			/* values */
+#define	VM_CSTACK_SMALL		8			/* return labels */
+#define	VM_ASTACK_SMALL		128			/* bytes */
+
+#define	VM_VSTACK_MAX		(1024 * 1024)		/* values */
+#define	VM_CSTACK_MAX		(256 * 1024)		/* return labels */
+#define	VM_ASTACK_MAX		(16 * 1024 * 1024)	/* bytes */
+
 struct vm {
 	vm_label_t	  program;	/* vm bytecode array */
 	size_t		  prog_size;	/* size of bytecode array */
 	vm_label_t	  pc;
 
 	struct value	 *vstack;	/* vm's working stack */
-	size_t		  vstack_size;	/* size of array for stack */
+	struct value	 *vstack_end;	/* end of working stack */
 	struct value	 *vstack_ptr;	/* ptr to top of stack */
 
 	vm_label_t	 *cstack;	/* vm's call stack */
-	size_t		  cstack_size;	/* size of call stack array */
+	vm_label_t	 *cstack_end;	/* end of call stack */
 	vm_label_t	 *cstack_ptr;	/* ptr to top of call stack */
 
-	unsigned char	 *astack;
-	size_t		  astack_size;	/* size of activation stack */
+	unsigned char	 *astack;	/* activation stack in use */
+	unsigned char	 *astack_end;	/* end of activation stack in use */
 	unsigned char	 *astack_ptr;	/* top of activation stack */
 
-	unsigned char	 *astack_hi;	/* hiwater mark on activation stack */
-	
+	unsigned char	 *astack_big;	/* reserved activation stack, if any */
+	unsigned char	 *astack_small_ptr; /* top of small one, while on it */
+
 	struct activation *current_ar;	/* current activation record */
+	struct vm	 *next_free;	/* in freelist of terminated vm's */
 };
 
+/*
+ * The small stacks follow the struct vm.
+ */
+#define	VM_SMALL_VSTACK(vm)	((struct value *)((vm) + 1))
+#define	VM_SMALL_CSTACK(vm)	((vm_label_t *)(VM_SMALL_VSTACK(vm) + VM_VSTACK_SMALL))
+#define	VM_SMALL_ASTACK(vm)	((unsigned char *)(VM_SMALL_CSTACK(vm) + VM_CSTACK_SMALL))
+#define	VM_SMALL_SIZE		(VM_VSTACK_SMALL * sizeof(struct value) + \
+				 VM_CSTACK_SMALL * sizeof(vm_label_t) + \
+				 VM_ASTACK_SMALL)
+
+typedef vm_label_t (*vm_native_t)(struct vm *);
+
 /*
  * Return codes for vm_run() function.
  */
@@ -62,11 +206,25 @@ struct vm {
 
 struct vm	*vm_new(vm_label_t, size_t);
 void		 vm_free(struct vm *);
+void		 vm_reserve(struct vm *, int);
+void		 vm_astack_grow(struct vm *, size_t);
+void		 vm_astack_shrink(struct vm *);
 
 void		 ast_gen(vm_label_t *, struct ast *);
+size_t		 iprogram_gen_size(struct iprogram *);
 void		 iprogram_gen(vm_label_t *, struct iprogram *);
+void		 iprogram_gen_registers(vm_label_t *, struct iprogram *);
 
 void		 vm_set_pc(struct vm *, vm_label_t);
 int		 vm_run(struct vm *, int);
+vm_label_t	 vm_call(struct vm *, vm_label_t);
+vm_label_t	 vm_goto(struct vm *);
+vm_label_t	 vm_return(struct vm *);
+#ifdef DIRECT_THREADING
+void		**vm_dispatch_table(void);
+#endif
+#ifdef DEBUG
+void		 vm_profile_dump(void);
+#endif
 
 #endif